@@ -0,0 +1,403 @@
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+
+// Load generator: sellers register a service and answer calls for proposals, buyers run
+// search -> CFP -> propose -> accept negotiations at a target rate. Negotiations are started on an
+// open-loop schedule and their latency counts from when they were due, so a slow node shows up as
+// latency instead of silently lowering the load.
+// The agents are split between sellers, buyers and idle agents, which only hold a connection, by --mix.
+// The operations started are drawn by --ops weights: negotiations, searches alone, and sellers' service
+// updates.
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include "clara.hpp"
+#include "agent.hpp"
+#include "metrics.hpp"
+#include "oefcoreproxy.hpp"
+
+using namespace fetch::oef;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+  struct Stats {
+    std::atomic<size_t> started{0};   // negotiations and searches
+    std::atomic<size_t> completed{0}; // negotiations
+    std::atomic<size_t> searched{0};
+    std::atomic<size_t> failed{0};
+    std::atomic<size_t> accepted{0};
+    std::atomic<size_t> updates{0};
+    LatencyHistogram search;
+    LatencyHistogram negotiation;
+  };
+
+  uint64_t since(Clock::time_point t) {
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - t).count());
+  }
+
+  // Parses name=weight,... into weights, whose keys are the names allowed. False if a name is not one of them, or
+  // a weight is not a non-negative number.
+  bool parseWeights(const std::string &text, std::map<std::string,double> &weights) {
+    std::istringstream is{text};
+    std::string item;
+    while(std::getline(is, item, ',')) {
+      auto eq = item.find('=');
+      if(eq == std::string::npos) {
+        return false;
+      }
+      auto iter = weights.find(item.substr(0, eq));
+      if(iter == weights.end()) {
+        return false;
+      }
+      auto value = item.substr(eq + 1);
+      try {
+        size_t used = 0;
+        double weight = std::stod(value, &used);
+        if(used != value.size() || weight < 0.0) {
+          return false;
+        }
+        iter->second = weight;
+      } catch(std::exception &) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // All sends go through the agent's io_context, which runs on one thread: its socket is never
+  // written to from two threads at once.
+  class LoadAgent : public Agent {
+  protected:
+    asio::io_context &io_context_;
+    Stats &stats_;
+  public:
+    LoadAgent(const std::string &agentId, asio::io_context &io_context, const std::string &host, Stats &stats)
+      : Agent{std::unique_ptr<OEFCoreInterface>(new OEFCoreNetworkProxy{agentId, io_context, host})},
+        io_context_{io_context}, stats_{stats} {
+      start();
+    }
+    void onOEFError(uint32_t answerId, pb::Server_AgentMessage_OEFError_Operation operation) override {
+      std::cerr << getPublicKey() << " OEFError " << operation << std::endl;
+    }
+    void onDialogueError(uint32_t answerId, uint32_t dialogueId, const std::string &origin) override {}
+    void onSearchResult(uint32_t searchId, const std::vector<std::string> &results) override {}
+    void onMessage(uint32_t msgId, uint32_t dialogueId, const std::string &from, const std::string &content) override {}
+    void onCFP(uint32_t msgId, uint32_t dialogueId, const std::string &from, uint32_t target, const CFPType &constraints) override {}
+    void onPropose(uint32_t msgId, uint32_t dialogueId, const std::string &from, uint32_t target, const ProposeType &proposals) override {}
+    void onAccept(uint32_t msgId, uint32_t dialogueId, const std::string &from, uint32_t target) override {}
+    void onDecline(uint32_t msgId, uint32_t dialogueId, const std::string &from, uint32_t target) override {}
+  };
+
+  class Seller : public LoadAgent {
+  private:
+    Instance service_; // on the io_context's thread only
+    int price_;
+    uint32_t msgId_ = 1;
+  public:
+    static const DataModel &model() {
+      static DataModel model{"loadgen", {Attribute{"id", Type::Int, true}, Attribute{"price", Type::Int, true}}, "Load generator."};
+      return model;
+    }
+    Seller(const std::string &agentId, asio::io_context &io_context, const std::string &host, Stats &stats, int id)
+      : LoadAgent{agentId, io_context, host, stats},
+        service_{model(), {{"id", VariantType{id}}, {"price", VariantType{id % 100}}}}, price_{id % 100} {
+      asio::post(io_context_, [this]() { registerService(msgId_, service_); });
+    }
+    // Changes the price of the service, which stays below the one buyers search for.
+    void update() {
+      ++stats_.updates;
+      asio::post(io_context_, [this]() {
+          price_ = (price_ + 1) % 100;
+          updateService(++msgId_, service_, {{"price", VariantType{price_}}});
+        });
+    }
+    void onCFP(uint32_t msgId, uint32_t dialogueId, const std::string &from, uint32_t target, const CFPType &constraints) override {
+      sendPropose(msgId + 1, dialogueId, from, msgId, ProposeType{std::string{"offer"}});
+    }
+    void onAccept(uint32_t msgId, uint32_t dialogueId, const std::string &from, uint32_t target) override {
+      ++stats_.accepted;
+    }
+  };
+
+  class Buyer : public LoadAgent {
+  private:
+    struct Negotiation {
+      Clock::time_point due;
+      bool searchOnly;
+    };
+    std::mutex lock_;
+    std::unordered_map<uint32_t,Negotiation> negotiations_;
+    uint32_t next_ = 0;
+    std::mt19937 gen_{std::random_device{}()};
+
+    // Removes the negotiation, returning false if it was not in progress.
+    bool finish(uint32_t id, Negotiation &negotiation) {
+      std::lock_guard<std::mutex> lock(lock_);
+      auto iter = negotiations_.find(id);
+      if(iter == negotiations_.end()) {
+        return false;
+      }
+      negotiation = iter->second;
+      negotiations_.erase(iter);
+      return true;
+    }
+    void fail(uint32_t id) {
+      Negotiation negotiation;
+      if(finish(id, negotiation)) {
+        ++stats_.failed;
+      }
+    }
+  public:
+    using LoadAgent::LoadAgent;
+    // Starts a negotiation that was due at due, or only its search if searchOnly.
+    void negotiate(Clock::time_point due, bool searchOnly = false) {
+      ++stats_.started;
+      asio::post(io_context_, [this,due,searchOnly]() {
+          uint32_t id;
+          {
+            std::lock_guard<std::mutex> lock(lock_);
+            id = ++next_;
+            negotiations_[id] = Negotiation{due, searchOnly};
+          }
+          QueryModel query{{ConstraintExpr{Constraint{"price", Relation{Relation::Op::Lt, 100}}}}, Seller::model()};
+          searchServices(id, query);
+        });
+    }
+    // Gives up on the negotiations due before deadline.
+    void expire(Clock::time_point deadline) {
+      std::lock_guard<std::mutex> lock(lock_);
+      for(auto iter = negotiations_.begin(); iter != negotiations_.end();) {
+        if(iter->second.due < deadline) {
+          ++stats_.failed;
+          iter = negotiations_.erase(iter);
+        } else {
+          ++iter;
+        }
+      }
+    }
+    void onSearchResult(uint32_t searchId, const std::vector<std::string> &results) override {
+      Negotiation negotiation;
+      {
+        std::lock_guard<std::mutex> lock(lock_);
+        auto iter = negotiations_.find(searchId);
+        if(iter == negotiations_.end()) {
+          return;
+        }
+        negotiation = iter->second;
+        if(negotiation.searchOnly) {
+          negotiations_.erase(iter);
+        }
+      }
+      stats_.search.record(since(negotiation.due));
+      if(negotiation.searchOnly) {
+        ++stats_.searched;
+        return;
+      }
+      if(results.empty()) {
+        fail(searchId);
+        return;
+      }
+      std::uniform_int_distribution<size_t> pick{0, results.size() - 1};
+      sendCFP(1, searchId, results[pick(gen_)], 0, CFPType{std::string{"cfp"}});
+    }
+    void onPropose(uint32_t msgId, uint32_t dialogueId, const std::string &from, uint32_t target, const ProposeType &proposals) override {
+      Negotiation negotiation;
+      if(!finish(dialogueId, negotiation)) {
+        return;
+      }
+      sendAccept(msgId + 1, dialogueId, from, msgId);
+      stats_.negotiation.record(since(negotiation.due));
+      ++stats_.completed;
+    }
+    void onDialogueError(uint32_t answerId, uint32_t dialogueId, const std::string &origin) override {
+      fail(dialogueId);
+    }
+    void onDecline(uint32_t msgId, uint32_t dialogueId, const std::string &from, uint32_t target) override {
+      fail(dialogueId);
+    }
+  };
+
+  std::string milliseconds(const LatencyHistogram &h, double q) {
+    std::ostringstream os;
+    os << std::fixed << std::setprecision(2) << h.quantile(q) / 1e6;
+    return os.str();
+  }
+  void report(std::ostream &os, double elapsed, size_t connected, const Stats &stats, size_t completedBefore, double interval) {
+    os << std::fixed << std::setprecision(1) << "[" << elapsed << "s] agents " << connected
+       << " started " << stats.started << " completed " << stats.completed << " failed " << stats.failed
+       << " rate " << (interval > 0 ? (stats.completed - completedBefore) / interval : 0.0) << "/s"
+       << " negotiation p50 " << milliseconds(stats.negotiation, 0.5) << "ms p99 " << milliseconds(stats.negotiation, 0.99)
+       << "ms" << std::endl;
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  bool showHelp = false;
+  std::string host = "127.0.0.1";
+  std::string prefix = "Agent_";
+  uint32_t nbAgents = 20;
+  std::string mixText;
+  std::string opsText;
+  double ramp = 50.0;
+  double rate = 10.0;
+  uint32_t duration = 30;
+  uint32_t interval = 5;
+  uint32_t timeout = 10;
+  uint32_t nbThreads = 4;
+
+  auto parser = clara::Help(showHelp)
+    | clara::Opt(host, "host")["--host"]("Host address to connect. Default: 127.0.0.1")
+    | clara::Opt(prefix, "prefix")["--prefix"]["-p"]("Prefix used for all agents name. Default: Agent_")
+    | clara::Opt(nbAgents, "n")["--agents"]("Agents connected. Default: 20")
+    | clara::Opt(mixText, "seller=w,buyer=w,idle=w")["--mix"]("Shares of the agents: sellers register a service and answer CFPs, "
+                                                            "buyers search and negotiate, idle agents only stay connected. Default: seller=1,buyer=1,idle=0")
+    | clara::Opt(opsText, "negotiate=w,search=w,update=w")["--ops"]("Weights of the operations started: a buyer's negotiation, "
+                                                                  "a buyer's search alone, a seller's service update. Default: negotiate=1,search=0,update=0")
+    | clara::Opt(ramp, "agents/s")["--ramp"]("Connections per second, sellers first, 0 for all at once. Default: 50")
+    | clara::Opt(rate, "operations/s")["--rate"]("Operations started per second, over all agents. Default: 10")
+    | clara::Opt(duration, "seconds")["--duration"]["-d"]("Time operations are started for, once connected. Default: 30")
+    | clara::Opt(interval, "seconds")["--report"]("Time between live reports, 0 for none. Default: 5")
+    | clara::Opt(timeout, "seconds")["--timeout"]("Time after which a negotiation or search has failed. Default: 10")
+    | clara::Opt(nbThreads, "n")["--threads"]("Network threads. Default: 4");
+  auto result = parser.parse(clara::Args(argc, argv));
+  std::map<std::string,double> mix{{"seller", 1.0}, {"buyer", 1.0}, {"idle", 0.0}};
+  std::map<std::string,double> ops{{"negotiate", 1.0}, {"search", 0.0}, {"update", 0.0}};
+  bool weights = parseWeights(mixText, mix) && parseWeights(opsText, ops);
+  double mixTotal = mix["seller"] + mix["buyer"] + mix["idle"];
+  uint32_t nbSellers = mixTotal > 0.0 ? uint32_t(std::lround(nbAgents * mix["seller"] / mixTotal)) : 0;
+  uint32_t nbBuyers = mixTotal > 0.0 ? std::min(nbAgents - nbSellers, uint32_t(std::lround(nbAgents * mix["buyer"] / mixTotal))) : 0;
+  // Negotiations and searches need buyers to run them and sellers to find, updates need sellers.
+  bool buying = ops["negotiate"] > 0.0 || ops["search"] > 0.0;
+  bool agents = nbSellers > 0 && (nbBuyers > 0 || !buying);
+  if(!result || showHelp || !weights || !agents || ops["negotiate"] + ops["search"] + ops["update"] <= 0.0
+     || rate <= 0.0 || nbThreads == 0) {
+    if(!result) {
+      std::cerr << "Error: " << result.errorMessage() << "\n";
+    } else if(!weights) {
+      std::cerr << "Error: cannot parse --mix or --ops\n";
+    } else if(!showHelp && !agents) {
+      std::cerr << "Error: " << nbSellers << " sellers and " << nbBuyers << " buyers cannot run these operations\n";
+    }
+    std::cerr << parser << std::endl;
+    return showHelp ? 0 : 1;
+  }
+  // Many agents need many sockets, e.g. ulimit -n 8000.
+  Stats stats;
+  IoContextPool pool(nbThreads);
+  pool.run();
+  std::vector<std::unique_ptr<Seller>> sellers;
+  std::vector<std::unique_ptr<Buyer>> buyers;
+  std::vector<std::unique_ptr<LoadAgent>> idle;
+  auto start = Clock::now();
+  try {
+    auto step = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(ramp > 0 ? 1.0 / ramp : 0.0));
+    for(uint32_t i = 0; i < nbAgents; ++i) {
+      std::this_thread::sleep_until(start + i * step);
+      if(i < nbSellers) {
+        sellers.emplace_back(std::make_unique<Seller>(prefix + "seller" + std::to_string(i), pool.getIoContext(), host, stats, int(i)));
+      } else if(i < nbSellers + nbBuyers) {
+        buyers.emplace_back(std::make_unique<Buyer>(prefix + "buyer" + std::to_string(i - nbSellers), pool.getIoContext(), host, stats));
+      } else {
+        idle.emplace_back(std::make_unique<LoadAgent>(prefix + "idle" + std::to_string(i - nbSellers - nbBuyers), pool.getIoContext(), host, stats));
+      }
+    }
+  } catch(std::exception &e) {
+    std::cerr << "Cannot connect agent " << sellers.size() + buyers.size() + idle.size() << ": " << e.what() << std::endl;
+    return 1;
+  }
+  size_t connected = sellers.size() + buyers.size() + idle.size();
+  std::cerr << "Connected " << connected << " agents in " << since(start) / 1e9 << "s" << std::endl;
+  // let the registrations reach the node
+  std::this_thread::sleep_for(std::chrono::seconds{1});
+
+  auto begin = Clock::now();
+  auto end = begin + std::chrono::seconds{duration};
+  auto period = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / rate));
+  auto nextReport = begin + std::chrono::seconds{interval};
+  size_t completedBefore = 0;
+  std::mt19937 gen{std::random_device{}()};
+  std::discrete_distribution<int> pick{ops["negotiate"], ops["search"], ops["update"]};
+  size_t nextBuyer = 0;
+  size_t nextSeller = 0;
+  for(uint64_t k = 0;; ++k) {
+    auto due = begin + k * period;
+    if(due >= end) {
+      break;
+    }
+    while(interval && nextReport <= due) {
+      std::this_thread::sleep_until(nextReport);
+      report(std::cout, since(begin) / 1e9, connected, stats, completedBefore, interval);
+      completedBefore = stats.completed;
+      for(auto &b : buyers) {
+        b->expire(Clock::now() - std::chrono::seconds{timeout});
+      }
+      nextReport += std::chrono::seconds{interval};
+    }
+    // Late operations start at once: the schedule does not wait for the node.
+    std::this_thread::sleep_until(due);
+    switch(pick(gen)) {
+    case 0:
+      buyers[nextBuyer++ % buyers.size()]->negotiate(due);
+      break;
+    case 1:
+      buyers[nextBuyer++ % buyers.size()]->negotiate(due, true);
+      break;
+    default:
+      sellers[nextSeller++ % sellers.size()]->update();
+    }
+  }
+  auto deadline = Clock::now() + std::chrono::seconds{timeout};
+  while(stats.completed + stats.searched + stats.failed < stats.started && Clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds{100});
+  }
+  for(auto &b : buyers) {
+    b->expire(Clock::time_point::max());
+  }
+  double elapsed = since(begin) / 1e9;
+  std::cout << "Summary: " << connected << " agents (" << sellers.size() << " sellers, " << buyers.size() << " buyers, "
+            << idle.size() << " idle), " << stats.started + stats.updates << " operations started over " << duration
+            << "s (target " << rate << "/s): " << stats.completed << " negotiations completed (" << stats.completed / elapsed
+            << "/s), " << stats.searched << " searches completed, " << stats.failed << " failed, " << stats.updates
+            << " updates sent, " << stats.accepted << " accepts received by sellers\n";
+  for(auto &h : {std::make_pair("search", &stats.search), std::make_pair("negotiation", &stats.negotiation)}) {
+    std::cout << "  " << h.first << " latency ms: p50 " << milliseconds(*h.second, 0.5) << " p90 " << milliseconds(*h.second, 0.9)
+              << " p99 " << milliseconds(*h.second, 0.99) << " p999 " << milliseconds(*h.second, 0.999)
+              << " count " << h.second->count() << "\n";
+  }
+  std::cout << std::flush;
+  for(auto &a : sellers) {
+    a->stop();
+  }
+  for(auto &a : buyers) {
+    a->stop();
+  }
+  for(auto &a : idle) {
+    a->stop();
+  }
+  pool.stop();
+  return stats.failed == 0 ? 0 : 2;
+}
@@ -0,0 +1,390 @@
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+// Throughput and latency of a node on loopback, driven by network agents in the same process.
+// Results are written as one JSON object, to compare runs.
+
+#include "clara.hpp"
+#include "server.hpp"
+#include "agent.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace fetch::oef;
+
+namespace {
+  // Counts events down, from the agents' threads, to the benchmark's.
+  class Latch {
+  private:
+    std::mutex lock_;
+    std::condition_variable cond_;
+    size_t count_ = 0;
+  public:
+    void reset(size_t count) {
+      std::lock_guard<std::mutex> lock(lock_);
+      count_ = count;
+    }
+    void countDown() {
+      std::lock_guard<std::mutex> lock(lock_);
+      if(count_ > 0 && --count_ == 0) {
+        cond_.notify_all();
+      }
+    }
+    // False if the count did not reach 0 in time.
+    bool wait(std::chrono::seconds timeout) {
+      std::unique_lock<std::mutex> lock(lock_);
+      return cond_.wait_for(lock, timeout, [this]() { return count_ == 0; });
+    }
+    size_t count() {
+      std::lock_guard<std::mutex> lock(lock_);
+      return count_;
+    }
+  };
+
+  // Records the latency of the answers to the requests it stamped, and of the messages it receives.
+  class BenchAgent : public Agent {
+  private:
+    std::mutex lock_;
+    std::unordered_map<uint32_t,uint64_t> sent_;
+
+    void answered(uint32_t id) {
+      {
+        std::lock_guard<std::mutex> lock(lock_);
+        auto iter = sent_.find(id);
+        if(iter != sent_.end()) {
+          latencies.load()->record(Tracer::now() - iter->second);
+          sent_.erase(iter);
+        }
+      }
+      answers.countDown();
+    }
+  public:
+    std::atomic<LatencyHistogram*> latencies{nullptr};
+    Latch answers;
+    std::atomic<Latch*> received{nullptr};
+    std::atomic<size_t> errors{0};
+    std::atomic<size_t> dropped{0}; // messages the node did not deliver, while received is set
+    std::atomic<size_t> results{0};
+
+    BenchAgent(const std::string &agentId, asio::io_context &io_context)
+      : Agent{std::unique_ptr<OEFCoreInterface>(new OEFCoreNetworkProxy{agentId, io_context, "127.0.0.1"})} {
+      start();
+    }
+    void stamp(uint32_t id) {
+      std::lock_guard<std::mutex> lock(lock_);
+      sent_[id] = Tracer::now();
+    }
+    void onOEFError(uint32_t answerId, pb::Server_AgentMessage_OEFError_Operation operation) override {
+      ++errors;
+    }
+    void onDialogueError(uint32_t answerId, uint32_t dialogueId, const std::string &origin) override {
+      ++errors;
+      if(auto latch = received.load()) {
+        ++dropped;
+        latch->countDown();
+      }
+      answers.countDown();
+    }
+    void onRegistrationStatus(uint32_t answerId, pb::Server_AgentMessage_OEFError_Operation operation,
+                              const std::vector<bool> &status) override {
+      for(bool ok : status) {
+        errors += !ok;
+      }
+      answered(answerId);
+    }
+    void onSearchResult(uint32_t searchId, const std::vector<std::string> &agents) override {
+      results = agents.size();
+      answered(searchId);
+    }
+    void onMessage(uint32_t msgId, uint32_t dialogueId, const std::string &from, const std::string &content) override {
+      uint64_t sent = 0;
+      if(content.size() >= sizeof(sent)) {
+        std::memcpy(&sent, content.data(), sizeof(sent));
+        latencies.load()->record(Tracer::now() - sent);
+      }
+      if(auto latch = received.load()) {
+        latch->countDown();
+      }
+    }
+    void onCFP(uint32_t msgId, uint32_t dialogueId, const std::string &from, uint32_t target, const CFPType &constraints) override {
+      sendPropose(msgId + 1, dialogueId, from, msgId, ProposeType{std::string{"offer"}});
+    }
+    void onPropose(uint32_t msgId, uint32_t dialogueId, const std::string &from, uint32_t target, const ProposeType &proposals) override {
+      answered(dialogueId);
+    }
+    void onAccept(uint32_t msgId, uint32_t dialogueId, const std::string &from, uint32_t target) override {}
+    void onDecline(uint32_t msgId, uint32_t dialogueId, const std::string &from, uint32_t target) override {}
+  };
+
+  class Report {
+  private:
+    std::ostringstream os_;
+    bool first_ = true;
+  public:
+    Report(size_t agents, size_t messages) {
+      os_ << "{\"agents\":" << agents << ",\"messages\":" << messages << ",\"results\":[";
+    }
+    // expected operations of which done completed, and dropped were refused by the node, in seconds.
+    void add(const std::string &name, size_t directory, size_t expected, size_t done, double seconds,
+             const LatencyHistogram &latencies, size_t dropped = 0) {
+      os_ << (first_ ? "" : ",") << "\n  {\"name\":\"" << name << "\"";
+      if(directory) {
+        os_ << ",\"directory_size\":" << directory;
+      }
+      os_ << ",\"expected\":" << expected << ",\"completed\":" << done << ",\"dropped\":" << dropped
+          << ",\"seconds\":" << seconds
+          << ",\"per_second\":" << (seconds > 0 ? done / seconds : 0.0)
+          << ",\"p50_us\":" << latencies.quantile(0.5) / 1e3
+          << ",\"p99_us\":" << latencies.quantile(0.99) / 1e3
+          << ",\"p999_us\":" << latencies.quantile(0.999) / 1e3 << "}";
+      first_ = false;
+    }
+    std::string str() const {
+      return os_.str() + "\n]}\n";
+    }
+  };
+
+  double since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+  std::vector<size_t> sizes(const std::string &list) {
+    std::vector<size_t> res;
+    std::istringstream is{list};
+    std::string item;
+    while(std::getline(is, item, ',')) {
+      res.push_back(std::stoul(item));
+    }
+    std::sort(res.begin(), res.end());
+    return res;
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  bool showHelp = false;
+  size_t nbAgents = 8;
+  size_t nbMessages = 10000;
+  size_t nbRoundTrips = 1000;
+  std::string directorySizes = "100,1000,10000";
+  size_t nbSearches = 200;
+  size_t nbChurn = 1000;
+  uint32_t timeout = 30;
+  std::string overflow = "pause";
+  std::string output;
+  auto parser = clara::Help(showHelp)
+    | clara::Opt(nbAgents, "n")["--agents"]("Agents, half of them sending and half answering. Default: 8")
+    | clara::Opt(nbMessages, "n")["--messages"]("Messages sent by each sending agent. Default: 10000")
+    | clara::Opt(nbRoundTrips, "n")["--round-trips"]("CFP/propose round trips of each sending agent. Default: 1000")
+    | clara::Opt(directorySizes, "n,...")["--directory-sizes"]("Services registered when searching. Default: 100,1000,10000")
+    | clara::Opt(nbSearches, "n")["--searches"]("Searches at each directory size. Default: 200")
+    | clara::Opt(nbChurn, "n")["--churn"]("Register then unregister cycles. Default: 1000")
+    | clara::Opt(timeout, "seconds")["--timeout"]("Longest wait for one phase. Default: 30")
+    | clara::Opt(overflow, "drop|pause|disconnect")["--overflow"]("What the node does when a receiver's queue is full: drop, pause or disconnect. Default: pause")
+    | clara::Opt(output, "file")["--output"]["-o"]("Writes the JSON results to file instead of the standard output.");
+  auto result = parser.parse(clara::Args(argc, argv));
+  if(!result || showHelp || nbAgents < 2) {
+    if(!result) {
+      std::cerr << "Error: " << result.errorMessage() << "\n";
+    }
+    std::cerr << parser << std::endl;
+    return showHelp ? 0 : 1;
+  }
+  SessionLimits limits;
+  if(!SessionLimits::parse(overflow, limits.overflow)) {
+    std::cerr << "Unknown overflow policy " << overflow << "\n" << parser << std::endl;
+    return 1;
+  }
+  Logger::level("warning");
+  const std::chrono::seconds wait{timeout};
+  Report report{nbAgents, nbMessages};
+  // Unpaced senders fill the receivers' queues: by default the node paces them rather than dropping.
+  Server server{4, 256, 0, limits};
+  server.run();
+  std::this_thread::sleep_for(std::chrono::milliseconds{200});
+  {
+    IoContextPool pool(4);
+    pool.run();
+    std::vector<std::unique_ptr<BenchAgent>> agents;
+    for(size_t i = 0; i < nbAgents; ++i) {
+      agents.emplace_back(std::make_unique<BenchAgent>("Bench" + std::to_string(i), pool.getIoContext()));
+    }
+    // Each socket is only written to by one thread: senders send and receivers only answer.
+    size_t pairs = nbAgents / 2;
+    auto sender = [&agents](size_t i) -> BenchAgent & { return *agents[i]; };
+    auto receiver = [&agents,pairs](size_t i) -> BenchAgent & { return *agents[pairs + i]; };
+
+    {
+      LatencyHistogram latencies;
+      Latch received;
+      received.reset(pairs * nbMessages);
+      for(auto &a : agents) {
+        a->latencies = &latencies;
+        a->received = &received;
+      }
+      auto start = std::chrono::steady_clock::now();
+      std::vector<std::thread> threads;
+      for(size_t p = 0; p < pairs; ++p) {
+        threads.emplace_back([&,p]() {
+            std::string content(sizeof(uint64_t), '\0');
+            auto dest = receiver(p).getPublicKey();
+            for(size_t i = 0; i < nbMessages; ++i) {
+              uint64_t now = Tracer::now();
+              std::memcpy(&content[0], &now, sizeof(now));
+              sender(p).sendMessage(uint32_t(i), 1, dest, content);
+            }
+          });
+      }
+      for(auto &t : threads) {
+        t.join();
+      }
+      received.wait(wait);
+      double seconds = since(start);
+      size_t dropped = 0;
+      for(auto &a : agents) {
+        a->received = nullptr;
+        dropped += a->dropped;
+      }
+      size_t expected = pairs * nbMessages;
+      report.add("send_message", 0, expected, expected - received.count() - dropped, seconds, latencies, dropped);
+    }
+    {
+      LatencyHistogram latencies;
+      std::atomic<size_t> done{0};
+      for(auto &a : agents) {
+        a->latencies = &latencies;
+      }
+      auto start = std::chrono::steady_clock::now();
+      std::vector<std::thread> threads;
+      for(size_t p = 0; p < pairs; ++p) {
+        threads.emplace_back([&,p]() {
+            auto &a = sender(p);
+            auto dest = receiver(p).getPublicKey();
+            for(uint32_t i = 0; i < nbRoundTrips; ++i) {
+              a.answers.reset(1);
+              a.stamp(i);
+              a.sendCFP(i, i, dest, 0, CFPType{std::string{"cfp"}});
+              if(!a.answers.wait(wait)) {
+                break;
+              }
+              ++done;
+            }
+          });
+      }
+      for(auto &t : threads) {
+        t.join();
+      }
+      report.add("cfp_propose", 0, pairs * nbRoundTrips, done, since(start), latencies);
+    }
+    {
+      Attribute id{"id", Type::Int, true};
+      Attribute price{"price", Type::Int, true};
+      DataModel model{"bench", {id, price}, "Benchmark service."};
+      auto instance = [&model](size_t i) {
+        return Instance{model, {{"id", VariantType{int(i)}}, {"price", VariantType{int(i % 100)}}}};
+      };
+      auto &registrar = receiver(0);
+      auto &searcher = sender(0);
+      LatencyHistogram registrations;
+      registrar.latencies = &registrations;
+      size_t registered = 0;
+      uint32_t msgId = 0;
+      for(auto size : sizes(directorySizes)) {
+        while(registered < size) {
+          std::vector<Instance> batch;
+          for(; registered < size && batch.size() < 1000; ++registered) {
+            batch.emplace_back(instance(registered));
+          }
+          registrar.answers.reset(1);
+          registrar.registerServices(++msgId, batch);
+          registrar.answers.wait(wait);
+        }
+        // 10% of the services match.
+        QueryModel query{{ConstraintExpr{Constraint{price.name(), Relation{Relation::Op::Lt, 10}}}}, model};
+        LatencyHistogram latencies;
+        searcher.latencies = &latencies;
+        size_t done = 0;
+        auto start = std::chrono::steady_clock::now();
+        for(uint32_t i = 0; i < nbSearches; ++i) {
+          searcher.answers.reset(1);
+          searcher.stamp(i);
+          searcher.searchServices(i, query);
+          if(!searcher.answers.wait(wait)) {
+            break;
+          }
+          ++done;
+        }
+        report.add("search_services", size, nbSearches, done, since(start), latencies);
+      }
+      registrar.unregisterServices(++msgId, [&]() {
+          std::vector<Instance> all;
+          for(size_t i = 0; i < registered; ++i) {
+            all.emplace_back(instance(i));
+          }
+          return all;
+        }());
+    }
+    {
+      Attribute id{"id", Type::Int, true};
+      DataModel model{"churn", {id}, "Benchmark churn."};
+      auto &a = sender(0);
+      LatencyHistogram latencies;
+      a.latencies = &latencies;
+      size_t done = 0;
+      auto start = std::chrono::steady_clock::now();
+      for(uint32_t i = 0; i < nbChurn; ++i) {
+        std::vector<Instance> one{Instance{model, {{"id", VariantType{int(i)}}}}};
+        a.answers.reset(1);
+        a.stamp(2 * i);
+        a.registerServices(2 * i, one);
+        if(!a.answers.wait(wait)) {
+          break;
+        }
+        a.answers.reset(1);
+        a.stamp(2 * i + 1);
+        a.unregisterServices(2 * i + 1, one);
+        if(!a.answers.wait(wait)) {
+          break;
+        }
+        done += 2;
+      }
+      report.add("register_unregister", 0, 2 * nbChurn, done, since(start), latencies);
+    }
+    for(auto &a : agents) {
+      a->stop();
+    }
+    pool.stop();
+  }
+  server.stop();
+  if(output.empty()) {
+    std::cout << report.str();
+  } else {
+    std::ofstream file{output};
+    file << report.str();
+  }
+  return 0;
+}
@@ -25,8 +25,10 @@
 #include "clientmsg.hpp"
 #include "queue.hpp"
 #include "servicedirectory.hpp"
+#include "trace.hpp"
 
 #include <unordered_map>
+#include <deque>
 #include <mutex>
 #include <condition_variable>
 #include <google/protobuf/text_format.h>
@@ -112,11 +114,18 @@ namespace fetch {
 
     class MessageDecoder {
     private:
+      // Reused from one frame to the next: protobuf keeps the memory of cleared fields around,
+      // so decoding a stream of similar messages does not hit the allocator.
+      fetch::oef::pb::Server_AgentMessage msg_;
+      std::vector<std::string> searchResults_;
+      std::function<void(uint64_t)> ping_;
+      std::function<bool(const fetch::oef::pb::Server_AgentMessage &, AgentInterface &)> answer_;
+
       static fetch::oef::Logger logger;
 
-      static void dispatch(AgentInterface &agent, const fetch::oef::pb::Fipa_Message &fipa,
-                           const fetch::oef::pb::Server_AgentMessage_Content &content,
-                           const fetch::oef::pb::Server_AgentMessage &msg) {
+      void dispatch(AgentInterface &agent, const fetch::oef::pb::Fipa_Message &fipa,
+                    const fetch::oef::pb::Server_AgentMessage_Content &content,
+                    const fetch::oef::pb::Server_AgentMessage &msg) {
         logger.trace("dispatch msg {}", fipa.msg_case());
         switch(fipa.msg_case()) {
         case fetch::oef::pb::Fipa_Message::kCfp:
@@ -184,14 +193,36 @@ namespace fetch {
         }
       }
     public:
-      static void decode(const std::string &agentPublicKey, const std::shared_ptr<Buffer> &buffer, AgentInterface &agent) {
+      MessageDecoder() = default;
+      MessageDecoder(const MessageDecoder &) = delete;
+      MessageDecoder(MessageDecoder &&) = default;
+      MessageDecoder operator=(const MessageDecoder &) = delete;
+      // Called with the nonce of the node's pings, which the agent does not see.
+      void onPing(std::function<void(uint64_t)> ping) {
+        ping_ = std::move(ping);
+      }
+      // Called, before the agent is, with the node's errors and registration statuses. The agent does not see the
+      // ones for which answer returns true.
+      void onAnswer(std::function<bool(const fetch::oef::pb::Server_AgentMessage &, AgentInterface &)> answer) {
+        answer_ = std::move(answer);
+      }
+      void decode(const std::string &agentPublicKey, const std::shared_ptr<Buffer> &buffer, AgentInterface &agent) {
         try {
-          auto msg = deserialize<fetch::oef::pb::Server_AgentMessage>(*buffer);
+          auto received = Tracer::now();
+          auto &msg = msg_;
+          msg.ParseFromArray(buffer->data(), buffer->size());
+          if(msg.has_trace()) {
+            msg.mutable_trace()->set_client_receive(received);
+            Tracer::instance().write(msg.trace(), agentPublicKey);
+          }
           switch(msg.payload_case()) {
           case fetch::oef::pb::Server_AgentMessage::kOefError:
             {
               logger.trace("MessageDecoder::loop error");
               auto &error = msg.oef_error();
+              if(answer_ && answer_(msg, agent)) {
+                break;
+              }
               agent.onOEFError(msg.answer_id(), error.operation());
             }
             break;
@@ -202,14 +233,22 @@ namespace fetch {
               agent.onDialogueError(msg.answer_id(), error.dialogue_id(), error.origin());
             }
             break;
+          case fetch::oef::pb::Server_AgentMessage::kRegistrationStatus:
+            {
+              logger.trace("MessageDecoder::loop registrationStatus");
+              auto &status = msg.registration_status();
+              if(answer_ && answer_(msg, agent)) {
+                break;
+              }
+              agent.onRegistrationStatus(msg.answer_id(), status.operation(), RegistrationStatus::decode(status));
+            }
+            break;
           case fetch::oef::pb::Server_AgentMessage::kAgents:
             {
               logger.trace("MessageDecoder::loop searchResults");
-              std::vector<std::string> searchResults;
-              for(auto &s : msg.agents().agents()) {
-                searchResults.emplace_back(s);
-              }
-              agent.onSearchResult(msg.answer_id(), searchResults);
+              const auto &agents = msg.agents().agents();
+              searchResults_.assign(agents.begin(), agents.end());
+              agent.onSearchResult(msg.answer_id(), searchResults_);
             }
             break;
           case fetch::oef::pb::Server_AgentMessage::kContent:
@@ -234,6 +273,12 @@ namespace fetch {
               }
             }
             break;
+          case fetch::oef::pb::Server_AgentMessage::kPing:
+            logger.trace("MessageDecoder::loop ping {}", msg.ping().nonce());
+            if(ping_) {
+              ping_(msg.ping().nonce());
+            }
+            break;
           case fetch::oef::pb::Server_AgentMessage::PAYLOAD_NOT_SET:
             logger.error("MessageDecoder::loop error {}", static_cast<int>(msg.payload_case()));
           }
@@ -248,27 +293,32 @@ namespace fetch {
       struct LocalAgentSession {
         AgentInterface *_agent;
         stde::optional<Instance> _description;
-        
-        bool match(const QueryModel &query) const {
-          if(!_description)
-            return false;
-          return query.check(*_description);
-        }
       };
+      mutable std::mutex _lock;
       std::unordered_map<std::string, LocalAgentSession> _agents;
       Queue<std::pair<std::string,std::shared_ptr<Buffer>>> _queue;
       std::unique_ptr<std::thread> _thread;
       bool _stopping = false;
       ServiceDirectory _sd;
+      ServiceDirectory _descriptions;
+      MessageDecoder _decoder;
       
       static fetch::oef::Logger logger;
       
+      AgentInterface *agent(const std::string &agentPublicKey) const {
+        std::lock_guard<std::mutex> lock(_lock);
+        auto iter = _agents.find(agentPublicKey);
+        if(iter == _agents.end())
+          return nullptr;
+        return iter->second._agent;
+      }
       void process() {
         while(!_stopping) {
           auto p = _queue.pop();
           if(!_stopping) {
-            if(_agents.find(p.first) != _agents.end() && _agents[p.first]._agent)
-              MessageDecoder::decode(p.first, p.second, *_agents[p.first]._agent);
+            auto *agent = this->agent(p.first);
+            if(agent)
+              _decoder.decode(p.first, p.second, *agent);
           }
         }
       }
@@ -286,35 +336,55 @@ namespace fetch {
         if(_thread)
           _thread->join();
       }
-      size_t nbAgents() const { return _agents.size(); }
+      size_t nbAgents() const {
+        std::lock_guard<std::mutex> lock(_lock);
+        return _agents.size();
+      }
       bool connect(const std::string &agentPublicKey) {
+        std::lock_guard<std::mutex> lock(_lock);
         logger.trace("SchedulerPB::connect {} size {}", agentPublicKey, _agents.size());
-        if(_agents.find(agentPublicKey) != _agents.end())
-          return false;
-        _agents[agentPublicKey] = LocalAgentSession{};
-        return true;
+        return _agents.emplace(agentPublicKey, LocalAgentSession{nullptr, stde::nullopt}).second;
       }
       void disconnect(const std::string &agentPublicKey) {
         logger.trace("SchedulerPB::disconnect {}", agentPublicKey);
-        _agents.erase(agentPublicKey);
+        std::lock_guard<std::mutex> lock(_lock);
+        auto iter = _agents.find(agentPublicKey);
+        if(iter == _agents.end())
+          return;
+        if(iter->second._description)
+          _descriptions.unregisterAgent(*iter->second._description, agentPublicKey);
+        _sd.unregisterAll(agentPublicKey);
+        _agents.erase(iter);
       }
       void loop(const std::string &agentPublicKey, AgentInterface &agent) {
         logger.trace("SchedulerPB::loop {}", agentPublicKey);
+        std::lock_guard<std::mutex> lock(_lock);
         _agents[agentPublicKey]._agent = &agent;
       }
       void registerDescription(const std::string &agentPublicKey, const Instance &instance) {
         logger.trace("SchedulerPB::registerDescription {}", agentPublicKey);
-        if(_agents.find(agentPublicKey) == _agents.end())
+        std::lock_guard<std::mutex> lock(_lock);
+        auto iter = _agents.find(agentPublicKey);
+        if(iter == _agents.end()) {
           logger.error("SchedulerPB::registerDescription {} is not registered", agentPublicKey);
-        else
-          _agents[agentPublicKey]._description = instance;
+          return;
+        }
+        if(iter->second._description)
+          _descriptions.unregisterAgent(*iter->second._description, agentPublicKey);
+        iter->second._description = instance;
+        _descriptions.registerAgent(instance, agentPublicKey);
       }
       void unregisterDescription(const std::string &agentPublicKey) {
         logger.trace("SchedulerPB::unregisterDescription {}", agentPublicKey);
-        if(_agents.find(agentPublicKey) == _agents.end())
+        std::lock_guard<std::mutex> lock(_lock);
+        auto iter = _agents.find(agentPublicKey);
+        if(iter == _agents.end()) {
           logger.error("SchedulerPB::unregisterDescription {} is not registered", agentPublicKey);
-        else
-          _agents[agentPublicKey]._description = stde::nullopt;
+          return;
+        }
+        if(iter->second._description)
+          _descriptions.unregisterAgent(*iter->second._description, agentPublicKey);
+        iter->second._description = stde::nullopt;
       }
       void registerService(const std::string &agentPublicKey, const Instance &instance) {
         logger.trace("SchedulerPB::registerService {}", agentPublicKey);
@@ -324,13 +394,49 @@ namespace fetch {
         logger.trace("SchedulerPB::unregisterService {}", agentPublicKey);
         _sd.unregisterAgent(instance, agentPublicKey);
       }
-      std::vector<std::string> searchAgents(uint32_t, const QueryModel &model) const {
-        logger.trace("SchedulerPB::searchServices");
-        std::vector<std::string> res;
-        for(const auto &s : _agents) {
-          if(s.second.match(model))
-            res.emplace_back(s.first);
+      bool updateDescription(const std::string &agentPublicKey, const fetch::oef::pb::AgentUpdate &update) {
+        logger.trace("SchedulerPB::updateDescription {}", agentPublicKey);
+        std::lock_guard<std::mutex> lock(_lock);
+        auto iter = _agents.find(agentPublicKey);
+        if(iter == _agents.end() || !iter->second._description) {
+          logger.error("SchedulerPB::updateDescription {} has no description", agentPublicKey);
+          return false;
+        }
+        try {
+          auto updated = _descriptions.update(*iter->second._description, agentPublicKey, update.values(), update.removed());
+          if(!updated)
+            return false;
+          iter->second._description = std::move(*updated);
+          return true;
+        } catch(std::invalid_argument &e) {
+          logger.error("SchedulerPB::updateDescription {}: {}", agentPublicKey, e.what());
+          return false;
+        }
+      }
+      bool updateService(const std::string &agentPublicKey, const fetch::oef::pb::AgentUpdate &update) {
+        logger.trace("SchedulerPB::updateService {}", agentPublicKey);
+        const auto &model = update.model();
+        try {
+          return bool(_sd.update(model.name(), Fingerprint{model.hi(), model.lo()},
+                                 Fingerprint{update.service_hi(), update.service_lo()}, agentPublicKey,
+                                 update.values(), update.removed()));
+        } catch(std::invalid_argument &e) {
+          logger.error("SchedulerPB::updateService {}: {}", agentPublicKey, e.what());
+          return false;
         }
+      }
+      std::vector<bool> registerServices(const std::string &agentPublicKey, const std::vector<Instance> &instances) {
+        logger.trace("SchedulerPB::registerServices {} size {}", agentPublicKey, instances.size());
+        return _sd.registerAgent(instances, agentPublicKey);
+      }
+      std::vector<bool> unregisterServices(const std::string &agentPublicKey, const std::vector<Instance> &instances) {
+        logger.trace("SchedulerPB::unregisterServices {} size {}", agentPublicKey, instances.size());
+        return _sd.unregisterAgent(instances, agentPublicKey);
+      }
+      std::vector<std::string> searchAgents(uint32_t, const QueryModel &model) const {
+        logger.trace("SchedulerPB::searchAgents");
+        auto res = _descriptions.query(model);
+        logger.trace("SchedulerPB::searchAgents size {}", res.size());
         return res;
       }
       std::vector<std::string> searchServices(uint32_t, const QueryModel &model) const {
@@ -345,7 +451,12 @@ namespace fetch {
       }
       void sendTo(const std::string &agentPublicKey, const std::string &to, const std::shared_ptr<Buffer> &buffer) {
         logger.trace("SchedulerPB::sendTo {} to {}", agentPublicKey, to);
-        if(_agents.find(to) == _agents.end()) {
+        bool connected;
+        {
+          std::lock_guard<std::mutex> lock(_lock);
+          connected = _agents.find(to) != _agents.end();
+        }
+        if(!connected) {
           logger.error("SchedulerPB::sendTo {} is not connected.", to);
         }
         else
@@ -358,6 +469,19 @@ namespace fetch {
       SchedulerPB &_scheduler;
       
       static fetch::oef::Logger logger;
+
+      void sendOEFError(uint32_t msgId, fetch::oef::pb::Server_AgentMessage_OEFError_Operation operation) {
+        fetch::oef::pb::Server_AgentMessage answer;
+        answer.set_answer_id(msgId);
+        answer.mutable_oef_error()->set_operation(operation);
+        _scheduler.send(agentPublicKey_, serialize(answer));
+      }
+      void sendStatus(uint32_t msgId, fetch::oef::pb::Server_AgentMessage_OEFError_Operation operation, const std::vector<bool> &status) {
+        fetch::oef::pb::Server_AgentMessage answer;
+        answer.set_answer_id(msgId);
+        RegistrationStatus::encode(operation, status, *answer.mutable_registration_status());
+        _scheduler.send(agentPublicKey_, serialize(answer));
+      }
     public:
       OEFCoreLocalPB(const std::string &agentPublicKey, SchedulerPB &scheduler) : OEFCoreInterface{agentPublicKey},
                                                                                   _scheduler{scheduler} {}
@@ -405,6 +529,29 @@ namespace fetch {
       void unregisterService(uint32_t msgId, const Instance &instance) override {
         _scheduler.unregisterService(agentPublicKey_, instance);
       }
+      void updateDescription(uint32_t msgId, const std::unordered_map<std::string,VariantType> &values,
+                             const std::vector<std::string> &removed) override {
+        UpdateDescription update{msgId, values, removed};
+        if(!_scheduler.updateDescription(agentPublicKey_, update.handle().update_description())) {
+          sendOEFError(msgId, fetch::oef::pb::Server_AgentMessage_OEFError::UPDATE_DESCRIPTION);
+        }
+      }
+      void updateService(uint32_t msgId, Instance &instance, const std::unordered_map<std::string,VariantType> &values,
+                         const std::vector<std::string> &removed) override {
+        UpdateService update{msgId, instance, values, removed};
+        instance = update.apply(instance);
+        if(!_scheduler.updateService(agentPublicKey_, update.handle().update_service())) {
+          sendOEFError(msgId, fetch::oef::pb::Server_AgentMessage_OEFError::UPDATE_SERVICE);
+        }
+      }
+      void registerServices(uint32_t msgId, const std::vector<Instance> &instances) override {
+        sendStatus(msgId, fetch::oef::pb::Server_AgentMessage_OEFError::REGISTER_SERVICE,
+                   _scheduler.registerServices(agentPublicKey_, instances));
+      }
+      void unregisterServices(uint32_t msgId, const std::vector<Instance> &instances) override {
+        sendStatus(msgId, fetch::oef::pb::Server_AgentMessage_OEFError::UNREGISTER_SERVICE,
+                   _scheduler.unregisterServices(agentPublicKey_, instances));
+      }
       void sendMessage(uint32_t msgId, uint32_t dialogueId, const std::string &dest, const std::string &msg) override {
         fetch::oef::pb::Server_AgentMessage message;
         message.set_answer_id(msgId);
@@ -460,16 +607,201 @@ namespace fetch {
     private:
       asio::io_context &_io_context;
       tcp::socket _socket;
+      MessageDecoder _decoder;
+      // Frames to the node, written one at a time whichever thread sends them: two writes in flight on
+      // one socket could interleave their bytes.
+      std::mutex _writeLock;
+      std::deque<std::shared_ptr<Buffer>> _queue;
+      // Data models of the instances registered on this connection, with how many use each. The node keeps
+      // a model while a registered instance uses it, so only a reference is sent for these. When the node does
+      // not know one anyway, as after a registration it rejected, it says so and the registration is sent again
+      // with the model in full.
+      // Guarded by _writeLock, so that a model is written in full before any reference to it.
+      std::unordered_map<std::string, size_t> _models;
+      std::string _descriptionModel;
+      // Registrations sent to the node, oldest first. The node answers in order, so an answer goes with the first
+      // one of the same message id and operation, and the ones before it are done. The ones that referred to data
+      // models keep their instances, to be sent again in full. Only the latest maxSent are kept: the answer to an
+      // older one reaches the agent as it is. Guarded by _writeLock.
+      struct Sent {
+        uint32_t msgId;
+        fetch::oef::pb::Server_AgentMessage_OEFError_Operation operation;
+        bool bulk;
+        std::vector<Instance> instances; // empty if no data model was sent as a reference
+        // For the items of a bulk sent again: the status of the first attempt, and the item of each instance.
+        std::vector<bool> status;
+        std::vector<size_t> items;
+      };
+      static constexpr size_t maxSent = 1024;
+      std::deque<Sent> _sent;
       
       static fetch::oef::Logger logger;
 
+      void write(std::shared_ptr<Buffer> buffer) {
+        std::lock_guard<std::mutex> lock(_writeLock);
+        push(std::move(buffer));
+      }
+      // Called with _writeLock held.
+      void push(std::shared_ptr<Buffer> buffer) {
+        _queue.push_back(std::move(buffer));
+        if(_queue.size() == 1) {
+          do_write();
+        }
+      }
+      // Called with _writeLock held.
+      void do_write() {
+        asyncWriteBuffer(_socket, _queue.front(), 5, [this](std::error_code ec, std::size_t) {
+            std::lock_guard<std::mutex> lock(_writeLock);
+            if(ec) {
+              logger.error("OEFCoreNetworkProxy::write failure {}, dropping {} messages", ec.value(), _queue.size());
+              _queue.clear();
+              return;
+            }
+            _queue.pop_front();
+            if(!_queue.empty()) {
+              do_write();
+            }
+          });
+      }
+
+      static std::string modelKey(const Instance &instance) {
+        const auto &fp = instance.dataModel().fingerprint();
+        return instance.dataModel().name() + ':' + std::to_string(fp.hi()) + ':' + std::to_string(fp.lo());
+      }
+      // The following are called with _writeLock held.
+      bool modelRef(const Instance &instance) const {
+        return _models.find(modelKey(instance)) != _models.end();
+      }
+      void acquire(const std::string &key) {
+        ++_models[key];
+      }
+      void release(const std::string &key) {
+        auto iter = _models.find(key);
+        if(iter != _models.end() && --iter->second == 0) {
+          _models.erase(iter);
+        }
+      }
+      void track(Sent sent) {
+        _sent.push_back(std::move(sent));
+        if(_sent.size() > maxSent) {
+          _sent.pop_front();
+        }
+      }
+      void track(uint32_t msgId, fetch::oef::pb::Server_AgentMessage_OEFError_Operation operation, bool bulk,
+                 std::vector<Instance> instances = {}) {
+        track(Sent{msgId, operation, bulk, std::move(instances), {}, {}});
+      }
+      // Sends a registration again, with its data model in full.
+      void resend(uint32_t msgId, fetch::oef::pb::Server_AgentMessage_OEFError_Operation operation, const Instance &instance) {
+        switch(operation) {
+        case fetch::oef::pb::Server_AgentMessage_OEFError::REGISTER_SERVICE:
+          push(serialize(Register{msgId, instance}.handle()));
+          break;
+        case fetch::oef::pb::Server_AgentMessage_OEFError::UNREGISTER_SERVICE:
+          push(serialize(Unregister{msgId, instance}.handle()));
+          break;
+        case fetch::oef::pb::Server_AgentMessage_OEFError::REGISTER_DESCRIPTION:
+          // unless a later description replaced it.
+          if(std::any_of(_sent.begin(), _sent.end(), [](const Sent &s) {
+                return s.operation == fetch::oef::pb::Server_AgentMessage_OEFError::REGISTER_DESCRIPTION
+                  || s.operation == fetch::oef::pb::Server_AgentMessage_OEFError::UNREGISTER_DESCRIPTION;
+              })) {
+            return;
+          }
+          push(serialize(Description{msgId, instance}.handle()));
+          break;
+        default:
+          return;
+        }
+        track(msgId, operation, false);
+      }
+      // The items of a bulk the node did not resolve, sent again with their data models in full. Their status
+      // is merged with the first one's before the agent sees it.
+      void resend(Sent &sent, std::vector<bool> status, const std::vector<bool> &unknown) {
+        Sent again{sent.msgId, sent.operation, true, {}, std::move(status), {}};
+        std::vector<Instance> instances;
+        for(size_t i = 0; i < unknown.size() && i < sent.instances.size(); ++i) {
+          if(unknown[i]) {
+            instances.push_back(sent.instances[i]);
+            again.items.push_back(i);
+          }
+        }
+        auto full = [](const Instance &) { return false; };
+        if(sent.operation == fetch::oef::pb::Server_AgentMessage_OEFError::REGISTER_SERVICE) {
+          push(serialize(RegisterServices{sent.msgId, instances, full}.handle()));
+        } else {
+          push(serialize(UnregisterServices{sent.msgId, instances, full}.handle()));
+        }
+        track(std::move(again));
+      }
+      // Called by the decoder with the node's errors and registration statuses.
+      bool answered(const fetch::oef::pb::Server_AgentMessage &msg, AgentInterface &agent) {
+        bool bulk = msg.has_registration_status();
+        auto operation = bulk ? msg.registration_status().operation() : msg.oef_error().operation();
+        std::unique_lock<std::mutex> lock(_writeLock);
+        auto iter = std::find_if(_sent.begin(), _sent.end(), [&msg,operation,bulk](const Sent &s) {
+            return s.msgId == uint32_t(msg.answer_id()) && s.operation == operation && s.bulk == bulk;
+          });
+        if(iter == _sent.end()) {
+          return false;
+        }
+        Sent sent = std::move(*iter);
+        _sent.erase(_sent.begin(), iter + 1);
+        if(!bulk) {
+          if(!msg.oef_error().unknown_model() || sent.instances.empty()) {
+            return false;
+          }
+          logger.debug("OEFCoreNetworkProxy::answered {} sending message {} again with its data model", agentPublicKey_, sent.msgId);
+          resend(sent.msgId, operation, sent.instances.front());
+          return true;
+        }
+        const auto &registration = msg.registration_status();
+        auto status = RegistrationStatus::decode(registration);
+        if(!sent.items.empty()) {
+          for(size_t i = 0; i < sent.items.size() && i < status.size(); ++i) {
+            sent.status[sent.items[i]] = status[i];
+          }
+          status = std::move(sent.status);
+        } else if(!sent.instances.empty() && registration.has_unknown_models()) {
+          logger.debug("OEFCoreNetworkProxy::answered {} sending items of message {} again with their data models", agentPublicKey_, sent.msgId);
+          resend(sent, std::move(status), RegistrationStatus::unknownModels(registration));
+          return true;
+        }
+        lock.unlock();
+        agent.onRegistrationStatus(sent.msgId, operation, status);
+        return true;
+      }
+      void handlers() {
+        _decoder.onPing([this](uint64_t nonce) {
+            fetch::oef::pb::Envelope env;
+            env.set_msg_id(0);
+            env.mutable_pong()->set_nonce(nonce);
+            write(serialize(env));
+          });
+        _decoder.onAnswer([this](const fetch::oef::pb::Server_AgentMessage &msg, AgentInterface &agent) {
+            return answered(msg, agent);
+          });
+      }
+      // Messages to other agents, which may be traced.
+      void send(fetch::oef::pb::Envelope &env) {
+        Tracer::instance().start(env);
+        write(serialize(env));
+      }
+
     public:
       OEFCoreNetworkProxy(const std::string &agentPublicKey, asio::io_context &io_context, const std::string &host)
         : OEFCoreInterface{agentPublicKey}, _io_context{io_context}, _socket{_io_context} {
           tcp::resolver resolver(_io_context);
           asio::connect(_socket, resolver.resolve(host, std::to_string(static_cast<int>(Ports::Agents))));
+          handlers();
+      }
+      // Only before the proxy is used: pending operations refer to the proxy they were started on.
+      OEFCoreNetworkProxy(OEFCoreNetworkProxy &&other)
+        : OEFCoreInterface{other.agentPublicKey_}, _io_context{other._io_context}, _socket{std::move(other._socket)},
+          _decoder{std::move(other._decoder)}, _models{std::move(other._models)},
+          _descriptionModel{std::move(other._descriptionModel)}, _sent{std::move(other._sent)} {
+          handlers();
       }
-      OEFCoreNetworkProxy(OEFCoreNetworkProxy &&) = default;
       void stop() override {
         _socket.shutdown(asio::socket_base::shutdown_both);
         _socket.close();
@@ -543,59 +875,119 @@ namespace fetch {
         return connected;
       }
       void loop(AgentInterface &agent) override {
-        asyncReadBuffer(_socket, 1000, [this,&agent](std::error_code ec, std::shared_ptr<Buffer> buffer) {
+        asyncReadBuffer(_socket, 0, [this,&agent](std::error_code ec, std::shared_ptr<Buffer> buffer) {
             if(ec) {
               logger.error("OEFCoreNetworkProxy::loop failure {}", ec.value());
             } else {
               logger.trace("OEFCoreNetworkProxy::loop");
-              MessageDecoder::decode(agentPublicKey_, buffer, agent);
+              _decoder.decode(agentPublicKey_, buffer, agent);
               loop(agent);
             }
           });
       }
       void registerDescription(uint32_t msgId, const Instance &instance) override {
-        Description description{msgId, instance};
-        asyncWriteBuffer(_socket, serialize(description.handle()), 5);
+        std::lock_guard<std::mutex> lock(_writeLock);
+        bool ref = modelRef(instance);
+        Description description{msgId, instance, ref};
+        push(serialize(description.handle()));
+        track(msgId, fetch::oef::pb::Server_AgentMessage_OEFError::REGISTER_DESCRIPTION, false, ref ? std::vector<Instance>{instance} : std::vector<Instance>{});
+        release(_descriptionModel);
+        _descriptionModel = modelKey(instance);
+        acquire(_descriptionModel);
       }
       void registerService(uint32_t msgId, const Instance &instance) override {
-        Register service{msgId, instance};
-        asyncWriteBuffer(_socket, serialize(service.handle()), 5);
+        std::lock_guard<std::mutex> lock(_writeLock);
+        bool ref = modelRef(instance);
+        Register service{msgId, instance, ref};
+        push(serialize(service.handle()));
+        track(msgId, fetch::oef::pb::Server_AgentMessage_OEFError::REGISTER_SERVICE, false, ref ? std::vector<Instance>{instance} : std::vector<Instance>{});
+        acquire(modelKey(instance));
       }
       void searchAgents(uint32_t searchId, const QueryModel &model) override {
         SearchAgents searchAgents{searchId, model};
-        asyncWriteBuffer(_socket, serialize(searchAgents.handle()), 5);
+        write(serialize(searchAgents.handle()));
       }
       void searchServices(uint32_t searchId, const QueryModel &model) override {
         SearchServices searchServices{searchId, model};
-        asyncWriteBuffer(_socket, serialize(searchServices.handle()), 5);
+        write(serialize(searchServices.handle()));
       }
       void unregisterService(uint32_t msgId, const Instance &instance) override {
-        Unregister service{msgId, instance};
-        asyncWriteBuffer(_socket, serialize(service.handle()), 5);
+        std::lock_guard<std::mutex> lock(_writeLock);
+        bool ref = modelRef(instance);
+        Unregister service{msgId, instance, ref};
+        push(serialize(service.handle()));
+        track(msgId, fetch::oef::pb::Server_AgentMessage_OEFError::UNREGISTER_SERVICE, false, ref ? std::vector<Instance>{instance} : std::vector<Instance>{});
+        release(modelKey(instance));
+      }
+      void updateDescription(uint32_t msgId, const std::unordered_map<std::string,VariantType> &values,
+                             const std::vector<std::string> &removed) override {
+        UpdateDescription update{msgId, values, removed};
+        write(serialize(update.handle()));
+      }
+      void updateService(uint32_t msgId, Instance &instance, const std::unordered_map<std::string,VariantType> &values,
+                         const std::vector<std::string> &removed) override {
+        UpdateService update{msgId, instance, values, removed};
+        auto updated = update.apply(instance);
+        write(serialize(update.handle()));
+        instance = std::move(updated);
+      }
+      void registerServices(uint32_t msgId, const std::vector<Instance> &instances) override {
+        std::lock_guard<std::mutex> lock(_writeLock);
+        // the node resolves the whole batch before registering any of it: a model new to the batch is sent in full
+        // for every instance.
+        bool ref = false;
+        RegisterServices services{msgId, instances, [this,&ref](const Instance &instance) {
+            bool res = modelRef(instance);
+            ref = ref || res;
+            return res;
+          }};
+        push(serialize(services.handle()));
+        track(msgId, fetch::oef::pb::Server_AgentMessage_OEFError::REGISTER_SERVICE, true, ref ? instances : std::vector<Instance>{});
+        for(auto &instance : instances) {
+          acquire(modelKey(instance));
+        }
+      }
+      void unregisterServices(uint32_t msgId, const std::vector<Instance> &instances) override {
+        std::lock_guard<std::mutex> lock(_writeLock);
+        bool ref = false;
+        UnregisterServices services{msgId, instances, [this,&ref](const Instance &instance) {
+            bool res = modelRef(instance);
+            ref = ref || res;
+            return res;
+          }};
+        push(serialize(services.handle()));
+        track(msgId, fetch::oef::pb::Server_AgentMessage_OEFError::UNREGISTER_SERVICE, true, ref ? instances : std::vector<Instance>{});
+        for(auto &instance : instances) {
+          release(modelKey(instance));
+        }
       }
       void unregisterDescription(uint32_t msgId) override {
+        std::lock_guard<std::mutex> lock(_writeLock);
         UnregisterDescription service{msgId};
-        asyncWriteBuffer(_socket, serialize(service.handle()), 5);
+        push(serialize(service.handle()));
+        track(msgId, fetch::oef::pb::Server_AgentMessage_OEFError::UNREGISTER_DESCRIPTION, false);
+        release(_descriptionModel);
+        _descriptionModel.clear();
       }
       void sendMessage(uint32_t msgId, uint32_t dialogueId, const std::string &dest, const std::string &msg) override {
         Message message{msgId, dialogueId, dest, msg};
-        asyncWriteBuffer(_socket, serialize(message.handle()), 5);
+        send(message.handle());
       }
       void sendCFP(uint32_t msgId, uint32_t dialogueId, const std::string &dest, uint32_t target, const CFPType &constraints) override {
         CFP cfp{msgId, dialogueId, dest, target, constraints};
-        asyncWriteBuffer(_socket, serialize(cfp.handle()), 5);
+        send(cfp.handle());
       }
       void sendPropose(uint32_t msgId, uint32_t dialogueId, const std::string &dest, uint32_t target, const ProposeType &proposals) override {
         Propose propose{msgId, dialogueId, dest, target, proposals};
-        asyncWriteBuffer(_socket, serialize(propose.handle()), 5);
+        send(propose.handle());
       }
       void sendAccept(uint32_t msgId, uint32_t dialogueId, const std::string &dest, uint32_t target) override {
         Accept accept{msgId, dialogueId, dest, target};
-        asyncWriteBuffer(_socket, serialize(accept.handle()), 5);
+        send(accept.handle());
       }
       void sendDecline(uint32_t msgId, uint32_t dialogueId, const std::string &dest, uint32_t target) override {
         Decline decline{msgId, dialogueId, dest, target};
-        asyncWriteBuffer(_socket, serialize(decline.handle()), 5);
+        send(decline.handle());
       }
     };
 
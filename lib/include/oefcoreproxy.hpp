@@ -33,6 +33,16 @@ namespace fetch {
       virtual void onOEFError(uint32_t answerId, fetch::oef::pb::Server_AgentMessage_OEFError_Operation operation) = 0;
       virtual void onDialogueError(uint32_t answerId, uint32_t dialogue_id, const std::string &origin) = 0;
       virtual void onSearchResult(uint32_t answerId, const std::vector<std::string> &results) = 0;
+      // Answer to registerServices / unregisterServices: status[i] tells whether item i succeeded.
+      // By default, each failed item is reported as the error of its single item counterpart.
+      virtual void onRegistrationStatus(uint32_t answerId, fetch::oef::pb::Server_AgentMessage_OEFError_Operation operation,
+                                        const std::vector<bool> &status) {
+        for(bool ok : status) {
+          if(!ok) {
+            onOEFError(answerId, operation);
+          }
+        }
+      }
     };
 
     class DialogueInterface {
@@ -59,6 +69,16 @@ namespace fetch {
       virtual void searchServices(uint32_t searchId, const QueryModel &model) = 0;
       virtual void unregisterDescription(uint32_t msgId) = 0;
       virtual void unregisterService(uint32_t msgId, const Instance &instance) = 0;
+      // Sets the given values and removes the removed attributes: only the changes are sent, and a service is
+      // identified by the fingerprint of instance, as registered. instance is then updated the same way, so that
+      // later updates and unregistrations find the service. Throws std::invalid_argument, and sends nothing, if
+      // the update does not fit the data model.
+      virtual void updateDescription(uint32_t msgId, const std::unordered_map<std::string,VariantType> &values,
+                                     const std::vector<std::string> &removed) = 0;
+      virtual void updateService(uint32_t msgId, Instance &instance, const std::unordered_map<std::string,VariantType> &values,
+                                 const std::vector<std::string> &removed) = 0;
+      virtual void registerServices(uint32_t msgId, const std::vector<Instance> &instances) = 0;
+      virtual void unregisterServices(uint32_t msgId, const std::vector<Instance> &instances) = 0;
       virtual void sendMessage(uint32_t msgId, uint32_t dialogueId, const std::string &dest, const std::string &msg) = 0;
       virtual void sendCFP(uint32_t msgId, uint32_t dialogueId, const std::string &dest, uint32_t target, const CFPType &constraints) = 0;
       virtual void sendPropose(uint32_t msgId, uint32_t dialogueId, const std::string &dest, uint32_t target, const ProposeType &proposals) = 0;
@@ -97,6 +117,20 @@ namespace fetch {
       void unregisterService(uint32_t msgId, const Instance &instance) {
         oefCore_->unregisterService(msgId, instance);
       }
+      void updateDescription(uint32_t msgId, const std::unordered_map<std::string,VariantType> &values,
+                             const std::vector<std::string> &removed = {}) {
+        oefCore_->updateDescription(msgId, values, removed);
+      }
+      void updateService(uint32_t msgId, Instance &instance, const std::unordered_map<std::string,VariantType> &values,
+                         const std::vector<std::string> &removed = {}) {
+        oefCore_->updateService(msgId, instance, values, removed);
+      }
+      void registerServices(uint32_t msgId, const std::vector<Instance> &instances) {
+        oefCore_->registerServices(msgId, instances);
+      }
+      void unregisterServices(uint32_t msgId, const std::vector<Instance> &instances) {
+        oefCore_->unregisterServices(msgId, instances);
+      }
       void unregisterDescription(uint32_t msgId) {
         oefCore_->unregisterDescription(msgId);
       }
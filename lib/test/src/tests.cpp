@@ -22,6 +22,7 @@
 #include <iostream>
 #include <chrono>
 #include <future>
+#include <fstream>
 #include "servicedirectory.hpp"
 #include "agent.hpp"
 
@@ -30,19 +31,33 @@ using namespace fetch::oef;
 class SimpleAgent : public fetch::oef::Agent {
 private:
   std::vector<std::string> results_;
+  std::vector<bool> status_;
+  std::atomic<size_t> dialogueErrors_{0};
+  std::atomic<size_t> oefErrors_{0};
 public:
   const std::vector<std::string> &results() const { return results_; }
+  const std::vector<bool> &status() const { return status_; }
+  size_t dialogueErrors() const { return dialogueErrors_; }
+  size_t oefErrors() const { return oefErrors_; }
   SimpleAgent(const std::string &agentId, asio::io_context &io_context, const std::string &host)
     : fetch::oef::Agent{std::unique_ptr<fetch::oef::OEFCoreInterface>(new fetch::oef::OEFCoreNetworkProxy{agentId, io_context, host})}
   {
     start();
   }
   virtual ~SimpleAgent() = default;
-  void onOEFError(uint32_t answer_id, fetch::oef::pb::Server_AgentMessage_OEFError_Operation operation) override {}
-  void onDialogueError(uint32_t answer_id, uint32_t dialogue_id, const std::string &origin) override {}
+  void onOEFError(uint32_t answer_id, fetch::oef::pb::Server_AgentMessage_OEFError_Operation operation) override {
+    ++oefErrors_;
+  }
+  void onDialogueError(uint32_t answer_id, uint32_t dialogue_id, const std::string &origin) override {
+    ++dialogueErrors_;
+  }
   void onSearchResult(uint32_t search_id, const std::vector<std::string> &results) override {
     results_ = results;
   }
+  void onRegistrationStatus(uint32_t answer_id, fetch::oef::pb::Server_AgentMessage_OEFError_Operation operation,
+                            const std::vector<bool> &status) override {
+    status_ = status;
+  }
   void onMessage(uint32_t msgId, uint32_t dialogueId, const std::string &from, const std::string &content) override {}
   void onCFP(uint32_t msgId, uint32_t dialogueId, const std::string &from, uint32_t target, const fetch::oef::CFPType &constraints) override {}
   void onPropose(uint32_t msgId, uint32_t dialogueId, const std::string &from, uint32_t target, const fetch::oef::ProposeType &proposals) override {}
@@ -50,6 +65,29 @@ public:
   void onDecline(uint32_t msgId, uint32_t dialogueId, const std::string &from, uint32_t target) override {}
 };
 
+// Connects at once, but only reads what the node sends once started.
+class LateReader : public fetch::oef::AgentInterface {
+private:
+  fetch::oef::OEFCoreNetworkProxy proxy_;
+  std::atomic<size_t> messages_{0};
+public:
+  LateReader(const std::string &agentId, asio::io_context &io_context, const std::string &host)
+    : proxy_{agentId, io_context, host} {}
+  fetch::oef::OEFCoreNetworkProxy &proxy() { return proxy_; }
+  size_t messages() const { return messages_; }
+  void start() { proxy_.loop(*this); }
+  void onOEFError(uint32_t answer_id, fetch::oef::pb::Server_AgentMessage_OEFError_Operation operation) override {}
+  void onDialogueError(uint32_t answer_id, uint32_t dialogue_id, const std::string &origin) override {}
+  void onSearchResult(uint32_t search_id, const std::vector<std::string> &results) override {}
+  void onMessage(uint32_t msgId, uint32_t dialogueId, const std::string &from, const std::string &content) override {
+    ++messages_;
+  }
+  void onCFP(uint32_t msgId, uint32_t dialogueId, const std::string &from, uint32_t target, const fetch::oef::CFPType &constraints) override {}
+  void onPropose(uint32_t msgId, uint32_t dialogueId, const std::string &from, uint32_t target, const fetch::oef::ProposeType &proposals) override {}
+  void onAccept(uint32_t msgId, uint32_t dialogueId, const std::string &from, uint32_t target) override {}
+  void onDecline(uint32_t msgId, uint32_t dialogueId, const std::string &from, uint32_t target) override {}
+};
+
 class SimpleAgentLocal : public fetch::oef::Agent {
 private:
   std::vector<std::string> results_;
@@ -129,6 +167,475 @@ TEST_CASE("testing register", "[ServiceDiscovery]") {
   std::cerr << "Server stopped\n";
 }
 
+TEST_CASE("testing bulk register", "[ServiceDiscovery]") {
+  fetch::oef::Server as;
+  as.run();
+  std::this_thread::sleep_for(std::chrono::seconds{1});
+  {
+    IoContextPool pool(2);
+    pool.run();
+    SimpleAgent c1("Agent1", pool.getIoContext(), "127.0.0.1");
+    SimpleAgent c2("Agent2", pool.getIoContext(), "127.0.0.1");
+    REQUIRE(as.nbAgents() == 2);
+    Attribute manufacturer{"manufacturer", Type::String, true};
+    Attribute luxury{"luxury", Type::Bool, true};
+    DataModel car{"car", {manufacturer, luxury}, "Car sale."};
+    std::vector<Instance> cars;
+    for(auto &name : {"Ferrari", "Lamborghini", "Fiat", "Ferrari"}) {
+      cars.emplace_back(car, std::unordered_map<std::string,VariantType>{{"manufacturer", VariantType{std::string{name}}},
+                                                                         {"luxury", VariantType{std::string{name} != "Fiat"}}});
+    }
+    c1.registerServices(1, cars);
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    REQUIRE(c1.status() == std::vector<bool>({true, true, true, false}));
+    Constraint luxury_c{luxury.name(), Relation{Relation::Op::Eq, true}};
+    QueryModel q1{{ConstraintExpr{luxury_c}}, car};
+    c2.searchServices(2, q1);
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    REQUIRE(c2.results() == std::vector<std::string>({"Agent1"}));
+    c1.unregisterServices(3, {cars[0], cars[1]});
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    REQUIRE(c1.status() == std::vector<bool>({true, true}));
+    c2.searchServices(4, q1);
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    REQUIRE(c2.results().empty());
+    c1.stop();
+    c2.stop();
+    pool.stop();
+  }
+  as.stop();
+}
+
+TEST_CASE("testing data model references", "[ServiceDiscovery]") {
+  fetch::oef::Server as;
+  as.run();
+  std::this_thread::sleep_for(std::chrono::seconds{1});
+  {
+    IoContextPool pool(2);
+    pool.run();
+    SimpleAgent c1("Agent1", pool.getIoContext(), "127.0.0.1");
+    SimpleAgent c2("Agent2", pool.getIoContext(), "127.0.0.1");
+    REQUIRE(as.nbAgents() == 2);
+    Attribute manufacturer{"manufacturer", Type::String, true};
+    Attribute luxury{"luxury", Type::Bool, true};
+    DataModel car{"car", {manufacturer, luxury}, "Car sale."};
+    Instance ferrari{car, {{"manufacturer", VariantType{std::string{"Ferrari"}}}, {"luxury", VariantType{true}}}};
+    Instance lamborghini{car, {{"manufacturer", VariantType{std::string{"Lamborghini"}}}, {"luxury", VariantType{true}}}};
+    QueryModel q1{{ConstraintExpr{Constraint{luxury.name(), Relation{Relation::Op::Eq, true}}}}, car};
+    // the node does not keep the model of a failed operation: it is sent in full again.
+    c1.unregisterService(1, ferrari);
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    REQUIRE(c1.oefErrors() == 1);
+    c1.registerService(2, ferrari);
+    c1.registerService(3, lamborghini);
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    REQUIRE(c1.oefErrors() == 1);
+    REQUIRE(as.statistics().find("\"car\":{\"rows\":2,") != std::string::npos);
+    // a failed registration still counts for the model: the proxy keeps sending references to it.
+    c1.registerService(4, ferrari);
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    REQUIRE(c1.oefErrors() == 2);
+    c1.unregisterService(5, ferrari);
+    c1.unregisterService(6, lamborghini);
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    REQUIRE(c1.oefErrors() == 2);
+    c2.searchServices(7, q1);
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    REQUIRE(c2.results().empty());
+    // no instance uses car any more: enough new models make the node drop it. The node then reports the references
+    // to car as unknown, and the proxy sends the registrations again in full without the agent seeing an error.
+    Attribute weight{"weight", Type::Int, true};
+    auto models = [&weight](const std::string &prefix, size_t count) {
+      std::vector<Instance> instances;
+      for(size_t i = 0; i < count; ++i) {
+        instances.emplace_back(DataModel{prefix + std::to_string(i), {weight}},
+                               std::unordered_map<std::string,VariantType>{{"weight", VariantType{int(i)}}});
+      }
+      return instances;
+    };
+    c2.registerServices(8, models("first", 200));
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    c1.registerService(9, ferrari);
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    REQUIRE(c1.oefErrors() == 2);
+    c2.searchServices(10, q1);
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    REQUIRE(c2.results() == std::vector<std::string>({"Agent1"}));
+    // the same for the items of a bulk, whose status is merged with the first attempt's.
+    c1.unregisterService(11, ferrari);
+    c2.registerServices(12, models("second", 400));
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    c1.registerServices(13, {ferrari, lamborghini, ferrari});
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    REQUIRE(c1.oefErrors() == 2);
+    REQUIRE(c1.status() == std::vector<bool>({true, true, false}));
+    REQUIRE(as.statistics().find("\"car\":{\"rows\":2,") != std::string::npos);
+    c1.stop();
+    c2.stop();
+    pool.stop();
+  }
+  as.stop();
+}
+
+TEST_CASE("testing updates", "[ServiceDiscovery]") {
+  fetch::oef::Server as;
+  as.run();
+  std::this_thread::sleep_for(std::chrono::seconds{1});
+  {
+    IoContextPool pool(2);
+    pool.run();
+    SimpleAgent c1("Agent1", pool.getIoContext(), "127.0.0.1");
+    SimpleAgent c2("Agent2", pool.getIoContext(), "127.0.0.1");
+    REQUIRE(as.nbAgents() == 2);
+    Attribute manufacturer{"manufacturer", Type::String, true};
+    Attribute price{"price", Type::Int, false};
+    DataModel car{"car", {manufacturer, price}, "Car sale."};
+    Instance ferrari{car, {{"manufacturer", VariantType{std::string{"Ferrari"}}}, {"price", VariantType{300}}}};
+    c1.registerService(1, ferrari);
+    c1.registerDescription(2, ferrari);
+    c1.updateService(3, ferrari, {{"price", VariantType{250}}});
+    c1.updateDescription(4, {{"price", VariantType{200}}});
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    auto priced = [&price,&car](int value) {
+      return QueryModel{{ConstraintExpr{Constraint{price.name(), Relation{Relation::Op::Eq, value}}}}, car};
+    };
+    c2.searchServices(5, priced(250));
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    REQUIRE(c2.results() == std::vector<std::string>({"Agent1"}));
+    c2.searchAgents(6, priced(200));
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    REQUIRE(c2.results() == std::vector<std::string>({"Agent1"}));
+    // the proxy updated ferrari as the node did: later updates find the service.
+    c1.updateService(7, ferrari, {{"price", VariantType{220}}});
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    c2.searchServices(8, priced(250));
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    REQUIRE(c2.results().empty());
+    c2.searchServices(9, priced(220));
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    REQUIRE(c2.results() == std::vector<std::string>({"Agent1"}));
+    c1.updateService(10, ferrari, {}, {"price"});
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    c2.searchServices(11, priced(220));
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    REQUIRE(c2.results().empty());
+    Constraint ferrari_c{manufacturer.name(), Relation{Relation::Op::Eq, std::string{"Ferrari"}}};
+    QueryModel q_ferrari{{ConstraintExpr{ferrari_c}}, car};
+    c2.searchServices(12, q_ferrari);
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    REQUIRE(c2.results() == std::vector<std::string>({"Agent1"}));
+    // and so do unregistrations.
+    c1.unregisterService(13, ferrari);
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    c2.searchServices(14, q_ferrari);
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    REQUIRE(c2.results().empty());
+    REQUIRE(c1.oefErrors() == 0);
+    c1.stop();
+    c2.stop();
+    pool.stop();
+  }
+  as.stop();
+}
+
+TEST_CASE("testing traces", "[Server]") {
+  const std::string path = "trace_test.jsonl";
+  std::remove(path.c_str());
+  REQUIRE(Tracer::instance().configure(1, path));
+  fetch::oef::Server as;
+  as.run();
+  std::this_thread::sleep_for(std::chrono::seconds{1});
+  {
+    IoContextPool pool(2);
+    pool.run();
+    SimpleAgent c1("Agent1", pool.getIoContext(), "127.0.0.1");
+    SimpleAgent c2("Agent2", pool.getIoContext(), "127.0.0.1");
+    c1.sendMessage(1, 1, "Agent2", "Hello");
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    c1.stop();
+    c2.stop();
+    pool.stop();
+  }
+  as.stop();
+  REQUIRE(Tracer::instance().configure(0, ""));
+  std::ifstream file{path};
+  std::string node, agent, line;
+  while(std::getline(file, line)) {
+    (line.find("\"hop\":\"node\"") != std::string::npos ? node : agent) = line;
+  }
+  auto stamp = [&agent](const std::string &name) {
+    auto pos = agent.find("\"" + name + "\":");
+    REQUIRE(pos != std::string::npos);
+    return std::stoull(agent.substr(pos + name.size() + 3));
+  };
+  REQUIRE(node.find("\"node_forward\"") != std::string::npos);
+  REQUIRE(agent.find("\"hop\":\"Agent2\"") != std::string::npos);
+  REQUIRE(stamp("client_send") <= stamp("node_receive"));
+  REQUIRE(stamp("node_receive") <= stamp("node_forward"));
+  REQUIRE(stamp("node_forward") <= stamp("client_receive"));
+  std::remove(path.c_str());
+}
+
+TEST_CASE("testing metrics endpoint", "[Server]") {
+  const uint16_t port = 7501;
+  fetch::oef::Server as{4, 256, port};
+  as.run();
+  std::this_thread::sleep_for(std::chrono::seconds{1});
+  {
+    asio::io_context io_context;
+    tcp::resolver resolver{io_context};
+    // connects and never sends its request
+    tcp::socket silent{io_context};
+    asio::connect(silent, resolver.resolve("127.0.0.1", std::to_string(port)));
+    auto start = std::chrono::steady_clock::now();
+    auto get = [&](const std::string &path) {
+      tcp::socket socket{io_context};
+      asio::connect(socket, resolver.resolve("127.0.0.1", std::to_string(port)));
+      asio::write(socket, asio::buffer("GET " + path + " HTTP/1.0\r\n\r\n"));
+      std::string response;
+      std::error_code ec;
+      asio::read(socket, asio::dynamic_buffer(response), ec);
+      REQUIRE(ec == asio::error::eof);
+      REQUIRE(response.compare(0, 15, "HTTP/1.0 200 OK") == 0);
+      return response.substr(response.find("\r\n\r\n") + 4);
+    };
+    REQUIRE(get("/metrics").find("\noef_connections_total ") != std::string::npos);
+    IoContextPool pool(1);
+    pool.run();
+    SimpleAgent c1("Agent1", pool.getIoContext(), "127.0.0.1");
+    DataModel paint{"paint", {Attribute{"colour", Type::String, true}}};
+    c1.registerService(1, Instance{paint, {{"colour", VariantType{std::string{"red"}}}}});
+    std::this_thread::sleep_for(std::chrono::milliseconds{500});
+    auto statistics = get("/statistics");
+    REQUIRE(statistics == as.statistics());
+    REQUIRE(statistics.find("\"services\":{\"paint\":{\"rows\":1,") != std::string::npos);
+    c1.stop();
+    pool.stop();
+    char c;
+    std::error_code ec;
+    asio::read(silent, asio::buffer(&c, 1), ec);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    REQUIRE(ec == asio::error::eof);
+    REQUIRE(elapsed >= std::chrono::seconds{5});
+    REQUIRE(elapsed < std::chrono::seconds{7});
+  }
+  as.stop();
+}
+
+// Value of the metric line starting with name.
+static double metric(const fetch::oef::Server &server, const std::string &name) {
+  std::istringstream lines{server.metrics().prometheus()};
+  std::string line;
+  while(std::getline(lines, line)) {
+    if(line.compare(0, name.size() + 1, name + " ") == 0) {
+      return std::stod(line.substr(name.size() + 1));
+    }
+  }
+  return -1.0;
+}
+
+TEST_CASE("testing slow consumers", "[Server]") {
+  SessionLimits limits;
+  limits.bytes = 64 * 1024;
+  limits.messages = 16;
+  const std::string content(4096, 'x');
+  SECTION("drop") {
+    fetch::oef::Server as{4, 256, 0, limits};
+    as.run();
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    {
+      IoContextPool pool(2);
+      pool.run();
+      SimpleAgent c1("Agent1", pool.getIoContext(), "127.0.0.1");
+      // connected, never read
+      OEFCoreNetworkProxy stuck{"Stuck", pool.getIoContext(), "127.0.0.1"};
+      REQUIRE(stuck.handshake());
+      for(uint32_t i = 0; i < 4000; ++i) {
+        c1.sendMessage(i, i, "Stuck", content);
+        if(i % 100 == 0) {
+          std::this_thread::sleep_for(std::chrono::milliseconds{1});
+        }
+      }
+      std::this_thread::sleep_for(std::chrono::seconds{1});
+      REQUIRE(c1.dialogueErrors() > 0);
+      REQUIRE(metric(as, "oef_outbound_dropped_total") == c1.dialogueErrors());
+      REQUIRE(metric(as, "oef_outbound_queued_messages") <= limits.messages);
+      REQUIRE(metric(as, "oef_outbound_queued_bytes") <= limits.bytes + content.size() + 100);
+      REQUIRE(as.nbAgents() == 2);
+      c1.stop();
+      stuck.stop();
+      pool.stop();
+    }
+    as.stop();
+  }
+  SECTION("disconnect") {
+    limits.overflow = SessionLimits::Overflow::Disconnect;
+    fetch::oef::Server as{4, 256, 0, limits};
+    as.run();
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    {
+      IoContextPool pool(2);
+      pool.run();
+      SimpleAgent c1("Agent1", pool.getIoContext(), "127.0.0.1");
+      OEFCoreNetworkProxy stuck{"Stuck", pool.getIoContext(), "127.0.0.1"};
+      REQUIRE(stuck.handshake());
+      for(uint32_t i = 0; i < 4000 && as.nbAgents() == 2; ++i) {
+        c1.sendMessage(i, i, "Stuck", content);
+        if(i % 100 == 0) {
+          std::this_thread::sleep_for(std::chrono::milliseconds{1});
+        }
+      }
+      std::this_thread::sleep_for(std::chrono::seconds{1});
+      REQUIRE(metric(as, "oef_overflow_disconnects_total") == 1);
+      REQUIRE(metric(as, "oef_outbound_queued_messages") == 0);
+      REQUIRE(as.nbAgents() == 1);
+      REQUIRE(c1.dialogueErrors() > 0);
+      c1.stop();
+      pool.stop();
+    }
+    as.stop();
+  }
+  SECTION("pause") {
+    limits.overflow = SessionLimits::Overflow::Pause;
+    fetch::oef::Server as{4, 256, 0, limits};
+    as.run();
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    {
+      IoContextPool pool(2);
+      pool.run();
+      SimpleAgent c1("Agent1", pool.getIoContext(), "127.0.0.1");
+      // connected, reads once started
+      LateReader reader("Reader", pool.getIoContext(), "127.0.0.1");
+      REQUIRE(reader.proxy().handshake());
+      const uint32_t nbMessages = 4000;
+      for(uint32_t i = 0; i < nbMessages; ++i) {
+        c1.sendMessage(i, i, "Reader", content);
+      }
+      std::this_thread::sleep_for(std::chrono::seconds{1});
+      // Agent1 is no longer read: nothing is dropped and the queue stays within its limits
+      REQUIRE(metric(as, "oef_paused_reads_total") >= 1);
+      REQUIRE(metric(as, "oef_outbound_dropped_total") == 0);
+      REQUIRE(metric(as, "oef_outbound_queued_messages") <= limits.messages);
+      REQUIRE(reader.messages() == 0);
+      REQUIRE(c1.dialogueErrors() == 0);
+      REQUIRE(as.nbAgents() == 2);
+      reader.start();
+      for(int i = 0; i < 100 && reader.messages() < nbMessages; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds{100});
+      }
+      // and is read again as the queue drains
+      REQUIRE(reader.messages() == nbMessages);
+      REQUIRE(c1.dialogueErrors() == 0);
+      REQUIRE(metric(as, "oef_outbound_queued_messages") == 0);
+      c1.stop();
+      reader.proxy().stop();
+      pool.stop();
+    }
+    as.stop();
+  }
+}
+
+TEST_CASE("testing handshake timeout", "[Server]") {
+  fetch::oef::Server as;
+  as.run();
+  std::this_thread::sleep_for(std::chrono::seconds{1});
+  {
+    // connects and never sends its id
+    asio::io_context io_context;
+    tcp::socket socket{io_context};
+    tcp::resolver resolver{io_context};
+    asio::connect(socket, resolver.resolve("127.0.0.1", std::to_string(static_cast<int>(Ports::Agents))));
+    auto start = std::chrono::steady_clock::now();
+    uint32_t len;
+    std::error_code ec;
+    asio::read(socket, asio::buffer(&len, sizeof(len)), ec);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    REQUIRE(ec == asio::error::eof);
+    REQUIRE(elapsed >= std::chrono::seconds{5});
+    REQUIRE(elapsed < std::chrono::seconds{7});
+  }
+  as.stop();
+}
+
+TEST_CASE("testing idle sessions", "[Server]") {
+  SessionLimits limits;
+  limits.idleTimeout = 2;
+  fetch::oef::Server as{4, 256, 0, limits};
+  as.run();
+  std::this_thread::sleep_for(std::chrono::seconds{1});
+  {
+    IoContextPool pool(2);
+    pool.run();
+    SimpleAgent c1("Agent1", pool.getIoContext(), "127.0.0.1");
+    // registers a service, then never answers
+    OEFCoreNetworkProxy gone{"Gone", pool.getIoContext(), "127.0.0.1"};
+    REQUIRE(gone.handshake());
+    Attribute name{"name", Type::String, true};
+    DataModel model{"idle", {name}, "Idle agents."};
+    gone.registerService(1, Instance{model, {{"name", VariantType{std::string{"gone"}}}}});
+    QueryModel query{{ConstraintExpr{Constraint{name.name(), Relation{Relation::Op::Eq, std::string{"gone"}}}}}, model};
+    std::this_thread::sleep_for(std::chrono::milliseconds{500});
+    c1.searchServices(1, query);
+    std::this_thread::sleep_for(std::chrono::milliseconds{500});
+    REQUIRE(c1.results() == std::vector<std::string>({"Gone"}));
+    REQUIRE(as.nbAgents() == 2);
+    std::this_thread::sleep_for(std::chrono::seconds{4});
+    // Agent1 answered the pings and stays
+    REQUIRE(as.nbAgents() == 1);
+    REQUIRE(metric(as, "oef_idle_evictions_total") == 1);
+    REQUIRE(metric(as, "oef_pings_total") >= 2);
+    c1.searchServices(2, query);
+    std::this_thread::sleep_for(std::chrono::milliseconds{500});
+    REQUIRE(c1.results().empty());
+    c1.stop();
+    pool.stop();
+  }
+  as.stop();
+}
+
+TEST_CASE("testing idle sessions under backpressure", "[Server]") {
+  SessionLimits limits;
+  limits.bytes = 64 * 1024;
+  limits.messages = 16;
+  limits.overflow = SessionLimits::Overflow::Pause;
+  limits.idleTimeout = 2;
+  const std::string content(4096, 'x');
+  fetch::oef::Server as{4, 256, 0, limits};
+  as.run();
+  std::this_thread::sleep_for(std::chrono::seconds{1});
+  {
+    IoContextPool pool(2);
+    pool.run();
+    SimpleAgent c1("Agent1", pool.getIoContext(), "127.0.0.1");
+    LateReader reader("Reader", pool.getIoContext(), "127.0.0.1");
+    REQUIRE(reader.proxy().handshake());
+    const uint32_t nbMessages = 4000;
+    for(uint32_t i = 0; i < nbMessages; ++i) {
+      c1.sendMessage(i, i, "Reader", content);
+    }
+    // The node stops reading Agent1, and soon Reader too, for longer than the idle timeout: neither is idle.
+    QueryModel query{{ConstraintExpr{Constraint{"name", Relation{Relation::Op::Eq, std::string{"none"}}}}}};
+    for(int i = 0; i < 6; ++i) {
+      reader.proxy().searchAgents(uint32_t(i), query);
+      std::this_thread::sleep_for(std::chrono::milliseconds{500});
+    }
+    REQUIRE(metric(as, "oef_paused_reads_total") >= 1);
+    REQUIRE(metric(as, "oef_idle_evictions_total") == 0);
+    REQUIRE(as.nbAgents() == 2);
+    reader.start();
+    for(int i = 0; i < 100 && reader.messages() < nbMessages; ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds{100});
+    }
+    REQUIRE(reader.messages() == nbMessages);
+    REQUIRE(c1.dialogueErrors() == 0);
+    REQUIRE(metric(as, "oef_idle_evictions_total") == 0);
+    c1.stop();
+    reader.proxy().stop();
+    pool.stop();
+  }
+  as.stop();
+}
+
 TEST_CASE("local testing register", "[ServiceDiscovery]") {
   // spdlog::set_level(spdlog::level::level_enum::trace);
   fetch::oef::SchedulerPB scheduler;
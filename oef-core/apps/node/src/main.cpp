@@ -17,21 +17,65 @@
 //------------------------------------------------------------------------------
 
 #include <iostream>
+#include "clara.hpp"
 #include "server.hpp"
+#include "trace.hpp"
 
 int main(int argc, char* argv[])
 {
+  bool showHelp = false;
+  std::vector<std::string> logLevels;
+  uint16_t metricsPort = static_cast<uint16_t>(Ports::Metrics);
+  std::string traceFile;
+  fetch::oef::SessionLimits limits;
+  std::string overflow = "drop";
+  auto parser = clara::Help(showHelp)
+    | clara::Opt(logLevels, "[section=]level")["--log-level"]["-l"]
+      ("Log level of all sections, or of one: trace, debug, info, warning, error, critical or off. "
+       "Applied in order, can be repeated. Default: info")
+    | clara::Opt(metricsPort, "port")["--metrics-port"]
+      ("Local port serving the metrics in the Prometheus text format, 0 for none. Default: 3334")
+    | clara::Opt(traceFile, "file")["--trace-file"]
+      ("Appends the traces of the sampled messages the node forwards to file.")
+    | clara::Opt(limits.bytes, "bytes")["--max-queued-bytes"]
+      ("Bytes waiting to be sent to an agent from which its queue is full. Default: 4194304")
+    | clara::Opt(limits.messages, "n")["--max-queued-messages"]
+      ("Messages waiting to be sent to an agent from which its queue is full. Default: 1024")
+    | clara::Opt(overflow, "drop|pause|disconnect")["--overflow"]
+      ("What to do with a message to an agent whose queue is full: drop it and send a dialogue error back, "
+       "stop reading its sender until the queue drains, or disconnect the agent. Default: drop")
+    | clara::Opt(limits.writeTimeout, "seconds")["--write-timeout"]
+      ("Time after which an agent that does not take a message is disconnected, 0 for none. Default: 30")
+    | clara::Opt(limits.idleTimeout, "seconds")["--idle-timeout"]
+      ("Time after which an agent not heard from is disconnected, 0 for never. It is pinged after half. "
+       "Agents built before pings were added do not answer them. Default: 0");
+  auto result = parser.parse(clara::Args(argc, argv));
+  if(!result || showHelp) {
+    if(!result) {
+      std::cerr << "Error: " << result.errorMessage() << "\n";
+    }
+    std::cerr << parser << std::endl;
+    return showHelp ? 0 : 1;
+  }
+  if(!fetch::oef::SessionLimits::parse(overflow, limits.overflow)) {
+    std::cerr << "Unknown overflow policy " << overflow << "\n" << parser << std::endl;
+    return 1;
+  }
   spdlog::set_pattern("[%Y-%m-%d %H:%M:%S.%e] [thread %t] [%n] [%l] %v");
-  spdlog::set_level(spdlog::level::level_enum::trace);
-  try
-  {
-    if (argc != 1)
-    {
-      std::cerr << "Usage: node\n";
+  fetch::oef::Logger::level("info");
+  for(auto &level : logLevels) {
+    if(!fetch::oef::Logger::configure(level)) {
+      std::cerr << "Unknown log section or level " << level << "\n" << parser << std::endl;
       return 1;
     }
-
-    fetch::oef::Server s;
+  }
+  if(!traceFile.empty() && !fetch::oef::Tracer::instance().configure(0, traceFile)) {
+    std::cerr << "Cannot open " << traceFile << std::endl;
+    return 1;
+  }
+  try
+  {
+    fetch::oef::Server s{4, 256, metricsPort, limits};
     s.run_in_thread();
 
   } catch (std::exception& e)
@@ -0,0 +1,190 @@
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include <hayai.hpp>
+#include "agentdirectory.hpp"
+#include "servicedirectory.hpp"
+
+#include <cmath>
+#include <memory>
+#include <random>
+
+using namespace fetch::oef;
+
+namespace {
+  enum Kind { Equality, RangeQuery, In, Near, Tree };
+
+  // Directory of size synthetic sensors, with skewed values: levels and kinds mostly small, temperatures
+  // normally distributed, positions clustered around a few cities. Services are registered by agents of
+  // 100 instances each and, when first needed, descriptions by one agent each.
+  class Synthetic {
+  public:
+    const size_t size;
+    DataModel model{"sensor", {Attribute{"kind", Type::String, true},
+                               Attribute{"level", Type::Int, true},
+                               Attribute{"temperature", Type::Double, false},
+                               Attribute{"position", Type::Location, true},
+                               Attribute{"active", Type::Bool, false}}};
+    std::vector<Instance> instances;
+    ServiceDirectory services;
+    AgentDirectory agents;
+    std::vector<QueryModel> queries;
+
+    explicit Synthetic(size_t n) : size{n} {
+      std::mt19937 gen{42};
+      std::uniform_real_distribution<double> uniform{0.0, 1.0};
+      std::normal_distribution<double> temperature{15.0, 8.0}, spread{0.0, 1.0};
+      const std::vector<Location> cities{{2.35, 48.85}, {-0.13, 51.51}, {13.40, 52.52}, {-3.70, 40.42},
+                                         {12.50, 41.90}, {-74.0, 40.71}, {139.69, 35.69}, {151.21, -33.87}};
+      instances.reserve(size);
+      for(size_t i = 0; i < size; ++i) {
+        auto &city = cities[size_t(std::pow(uniform(gen), 2.0) * cities.size())];
+        std::unordered_map<std::string,VariantType> values{
+          {"kind", VariantType{"kind" + std::to_string(int(std::pow(uniform(gen), 3.0) * 20))}},
+          {"level", VariantType{int(std::pow(uniform(gen), 3.0) * 1000)}},
+          {"position", VariantType{Location{city.lon + spread(gen), city.lat + spread(gen)}}}};
+        if(i % 4 != 0) {
+          values["temperature"] = VariantType{temperature(gen)};
+        }
+        if(i % 3 != 0) {
+          values["active"] = VariantType{i % 2 == 0};
+        }
+        instances.emplace_back(model, values);
+      }
+      for(size_t i = 0; i < size; i += 100) {
+        std::vector<Instance> batch(instances.begin() + i, instances.begin() + std::min(size, i + 100));
+        services.registerAgent(batch, "Agent" + std::to_string(i / 100));
+      }
+      ConstraintExpr equality{Constraint{"kind", Relation{Relation::Op::Eq, std::string{"kind3"}}}};
+      ConstraintExpr range{Constraint{"level", Range{std::make_pair(100, 200)}}};
+      ConstraintExpr in{Constraint{"kind", Set{Set::Op::In, Set::ValueType{
+                std::unordered_set<std::string>{"kind1", "kind5", "kind9", "kind13"}}}}};
+      ConstraintExpr near{Constraint{"position", Distance{cities[0], 50.0}}};
+      ConstraintExpr tree = (Constraint{"level", Relation{Relation::Op::Lt, 50}} && !equality)
+        || (Constraint{"temperature", Relation{Relation::Op::Gt, 30.0}} && Constraint{"position", Distance{cities[1], 200.0}})
+        || !(Constraint{"active", Relation{Relation::Op::Eq, true}} || range);
+      for(auto &c : {equality, range, in, near, tree}) {
+        // as the node answers them
+        queries.emplace_back(QueryModel{{c}, model});
+        services.optimise(queries.back(), &model);
+      }
+    }
+    void describe() {
+      if(agents.size() > 0) {
+        return;
+      }
+      for(size_t i = 0; i < size; ++i) {
+        auto id = "Agent" + std::to_string(i);
+        agents.add(id, nullptr);
+        agents.registerDescription(id, instances[i]);
+      }
+    }
+    // Keeps the last directory only: the largest ones take most of the memory.
+    static Synthetic &get(size_t size) {
+      static std::unique_ptr<Synthetic> current;
+      if(!current || current->size != size) {
+        current.reset();
+        current = std::make_unique<Synthetic>(size);
+      }
+      return *current;
+    }
+  };
+
+  template <size_t Size>
+  class Directory : public ::hayai::Fixture {
+  protected:
+    Synthetic *data = nullptr;
+  public:
+    void SetUp() override {
+      data = &Synthetic::get(Size);
+    }
+  };
+  template <size_t Size>
+  class Descriptions : public Directory<Size> {
+  public:
+    void SetUp() override {
+      Directory<Size>::SetUp();
+      this->data->describe();
+    }
+  };
+  using Directory1k = Directory<1000>;
+  using Directory10k = Directory<10000>;
+  using Directory100k = Directory<100000>;
+  using Directory1M = Directory<1000000>;
+  using Descriptions1k = Descriptions<1000>;
+  using Descriptions100k = Descriptions<100000>;
+
+  size_t sink = 0;
+}
+
+// Each iteration checks the 10^4 instances: evaluations per second are 10^4 times the iterations per second.
+BENCHMARK_P_F(Directory10k, Check, 5, 10, (int kind))
+{
+  const auto &query = data->queries[size_t(kind)];
+  for(auto &instance : data->instances) {
+    sink += query.check(instance);
+  }
+}
+BENCHMARK_P_INSTANCE(Directory10k, Check, (Equality));
+BENCHMARK_P_INSTANCE(Directory10k, Check, (RangeQuery));
+BENCHMARK_P_INSTANCE(Directory10k, Check, (In));
+BENCHMARK_P_INSTANCE(Directory10k, Check, (Near));
+BENCHMARK_P_INSTANCE(Directory10k, Check, (Tree));
+
+BENCHMARK_P_F(Directory1k, Services, 10, 100, (int kind))
+{
+  sink += data->services.query(data->queries[size_t(kind)]).size();
+}
+BENCHMARK_P_INSTANCE(Directory1k, Services, (Equality));
+BENCHMARK_P_INSTANCE(Directory1k, Services, (RangeQuery));
+BENCHMARK_P_INSTANCE(Directory1k, Services, (In));
+BENCHMARK_P_INSTANCE(Directory1k, Services, (Near));
+BENCHMARK_P_INSTANCE(Directory1k, Services, (Tree));
+
+BENCHMARK_P_F(Descriptions1k, Agents, 10, 100, (int kind))
+{
+  sink += data->agents.search(data->queries[size_t(kind)]).size();
+}
+BENCHMARK_P_INSTANCE(Descriptions1k, Agents, (Equality));
+BENCHMARK_P_INSTANCE(Descriptions1k, Agents, (Tree));
+
+BENCHMARK_P_F(Directory100k, Services, 5, 10, (int kind))
+{
+  sink += data->services.query(data->queries[size_t(kind)]).size();
+}
+BENCHMARK_P_INSTANCE(Directory100k, Services, (Equality));
+BENCHMARK_P_INSTANCE(Directory100k, Services, (RangeQuery));
+BENCHMARK_P_INSTANCE(Directory100k, Services, (In));
+BENCHMARK_P_INSTANCE(Directory100k, Services, (Near));
+BENCHMARK_P_INSTANCE(Directory100k, Services, (Tree));
+
+BENCHMARK_P_F(Descriptions100k, Agents, 5, 10, (int kind))
+{
+  sink += data->agents.search(data->queries[size_t(kind)]).size();
+}
+BENCHMARK_P_INSTANCE(Descriptions100k, Agents, (Equality));
+BENCHMARK_P_INSTANCE(Descriptions100k, Agents, (Tree));
+
+BENCHMARK_P_F(Directory1M, Services, 3, 3, (int kind))
+{
+  sink += data->services.query(data->queries[size_t(kind)]).size();
+}
+BENCHMARK_P_INSTANCE(Directory1M, Services, (Equality));
+BENCHMARK_P_INSTANCE(Directory1M, Services, (RangeQuery));
+BENCHMARK_P_INSTANCE(Directory1M, Services, (Near));
+BENCHMARK_P_INSTANCE(Directory1M, Services, (Tree));
@@ -19,6 +19,7 @@
 
 #include "logger.hpp"
 #include "schema.hpp"
+#include "servicedirectory.hpp"
 #include <memory>
 
 namespace fetch {
@@ -29,31 +30,75 @@ namespace fetch {
         private:
             mutable std::mutex lock_;
             std::unordered_map<std::string,std::shared_ptr<AgentSession>> sessions_;
+            std::unordered_map<std::string,Instance> descriptions_;
+            ServiceDirectory descriptionDirectory_;
 
             static fetch::oef::Logger logger;
 
+            void unregisterDescription_(const std::string &id) {
+                auto iter = descriptions_.find(id);
+                if(iter != descriptions_.end()) {
+                    descriptionDirectory_.unregisterAgent(iter->second, id);
+                    descriptions_.erase(iter);
+                }
+            }
         public:
             AgentDirectory() = default;
             AgentDirectory(const AgentDirectory &) = delete;
             AgentDirectory operator=(const AgentDirectory &) = delete;
             bool exist(const std::string &id) const {
+                std::lock_guard<std::mutex> lock(lock_);
                 return sessions_.find(id) != sessions_.end();
             }
             bool add(const std::string &id, std::shared_ptr<AgentSession> session) {
                 std::lock_guard<std::mutex> lock(lock_);
-                if(exist(id))
+                if(sessions_.find(id) != sessions_.end())
                     return false;
                 sessions_[id] = std::move(session);
                 return true;
             }
             bool remove(const std::string &id) {
                 std::lock_guard<std::mutex> lock(lock_);
+                unregisterDescription_(id);
                 return sessions_.erase(id) == 1;
             }
             void clear() {
                 std::lock_guard<std::mutex> lock(lock_);
+                for(auto &d : descriptions_) {
+                    descriptionDirectory_.unregisterAgent(d.second, d.first);
+                }
+                descriptions_.clear();
                 sessions_.clear();
             }
+            bool registerDescription(const std::string &id, const Instance &description) {
+                std::lock_guard<std::mutex> lock(lock_);
+                if(sessions_.find(id) == sessions_.end())
+                    return false;
+                unregisterDescription_(id);
+                descriptions_.emplace(id, description);
+                return descriptionDirectory_.registerAgent(description, id);
+            }
+            // Throws std::invalid_argument if the update does not fit the data model of the description.
+            bool updateDescription(const std::string &id,
+                                   const google::protobuf::RepeatedPtrField<fetch::oef::pb::Query_KeyValue> &values,
+                                   const google::protobuf::RepeatedPtrField<std::string> &removed) {
+                std::lock_guard<std::mutex> lock(lock_);
+                auto iter = descriptions_.find(id);
+                if(iter == descriptions_.end())
+                    return false;
+                auto updated = descriptionDirectory_.update(iter->second, id, values, removed);
+                if(!updated)
+                    return false;
+                iter->second = std::move(*updated);
+                return true;
+            }
+            bool unregisterDescription(const std::string &id) {
+                std::lock_guard<std::mutex> lock(lock_);
+                if(descriptions_.find(id) == descriptions_.end())
+                    return false;
+                unregisterDescription_(id);
+                return true;
+            }
             std::shared_ptr<AgentSession> session(const std::string &id) const {
                 std::lock_guard<std::mutex> lock(lock_);
                 auto iter = sessions_.find(id);
@@ -66,7 +111,15 @@ namespace fetch {
                 std::lock_guard<std::mutex> lock(lock_);
                 return sessions_.size();
             }
-            const std::vector<std::string> search(const QueryModel &query) const;
+            void optimise(QueryModel &query, const DataModel *model = nullptr) const {
+                descriptionDirectory_.optimise(query, model);
+            }
+            std::string statistics() const {
+                return descriptionDirectory_.statistics();
+            }
+            std::vector<std::string> search(const QueryModel &query) const {
+                return descriptionDirectory_.query(query);
+            }
         };
     }
 }
@@ -27,11 +27,11 @@ namespace fetch {
     private:
       fetch::oef::pb::Envelope envelope_;
     public:
-      explicit Register(uint32_t msgId, const Instance &instance) {
+      explicit Register(uint32_t msgId, const Instance &instance, bool modelRef = false) {
         envelope_.set_msg_id(msgId);
         auto *reg = envelope_.mutable_register_service();
         auto *inst = reg->mutable_description();
-        inst->CopyFrom(instance.handle());
+        instance.copyTo(*inst, modelRef);
       }
       const fetch::oef::pb::Envelope &handle() const { return envelope_; }
     };
@@ -40,15 +40,87 @@ namespace fetch {
     private:
       fetch::oef::pb::Envelope envelope_;
     public:
-      explicit Unregister(uint32_t msgId, const Instance &instance) {
+      explicit Unregister(uint32_t msgId, const Instance &instance, bool modelRef = false) {
         envelope_.set_msg_id(msgId);
         auto *reg = envelope_.mutable_unregister_service();
         auto *inst = reg->mutable_description();
-        inst->CopyFrom(instance.handle());
+        instance.copyTo(*inst, modelRef);
       }
       const fetch::oef::pb::Envelope &handle() const { return envelope_; }
     };
     
+    class RegisterServices {
+    private:
+      fetch::oef::pb::Envelope envelope_;
+    public:
+      // modelRef(instance) tells whether instance's data model can be sent as a reference.
+      template <typename ModelRef>
+      explicit RegisterServices(uint32_t msgId, const std::vector<Instance> &instances, ModelRef &&modelRef) {
+        envelope_.set_msg_id(msgId);
+        auto *descs = envelope_.mutable_register_services()->mutable_descriptions();
+        descs->Reserve(instances.size());
+        for(auto &instance : instances) {
+          instance.copyTo(*descs->Add(), modelRef(instance));
+        }
+      }
+      const fetch::oef::pb::Envelope &handle() const { return envelope_; }
+    };
+
+    class UnregisterServices {
+    private:
+      fetch::oef::pb::Envelope envelope_;
+    public:
+      template <typename ModelRef>
+      explicit UnregisterServices(uint32_t msgId, const std::vector<Instance> &instances, ModelRef &&modelRef) {
+        envelope_.set_msg_id(msgId);
+        auto *descs = envelope_.mutable_unregister_services()->mutable_descriptions();
+        descs->Reserve(instances.size());
+        for(auto &instance : instances) {
+          instance.copyTo(*descs->Add(), modelRef(instance));
+        }
+      }
+      const fetch::oef::pb::Envelope &handle() const { return envelope_; }
+    };
+
+    // Per item status of a bulk (un)registration, sent back as a bitmap.
+    class RegistrationStatus {
+    private:
+      static std::string bits(const std::vector<bool> &items) {
+        std::string res((items.size() + 7) / 8, '\0');
+        for(size_t i = 0; i < items.size(); ++i) {
+          if(items[i]) {
+            res[i / 8] |= char(1 << (i % 8));
+          }
+        }
+        return res;
+      }
+      static std::vector<bool> items(size_t count, const std::string &bits) {
+        std::vector<bool> res(count);
+        for(size_t i = 0; i < res.size() && i / 8 < bits.size(); ++i) {
+          res[i] = (uint8_t(bits[i / 8]) >> (i % 8)) & 1;
+        }
+        return res;
+      }
+    public:
+      // unknown, if not empty, has the items that referred to a data model the node does not keep.
+      static void encode(fetch::oef::pb::Server_AgentMessage_OEFError_Operation operation, const std::vector<bool> &status,
+                         fetch::oef::pb::Server_AgentMessage_RegistrationStatus &msg,
+                         const std::vector<bool> &unknown = {}) {
+        msg.set_operation(operation);
+        msg.set_count(status.size());
+        msg.set_status(bits(status));
+        if(std::find(unknown.begin(), unknown.end(), true) != unknown.end()) {
+          msg.set_unknown_models(bits(unknown));
+        }
+      }
+      static std::vector<bool> decode(const fetch::oef::pb::Server_AgentMessage_RegistrationStatus &msg) {
+        return items(msg.count(), msg.status());
+      }
+      static std::vector<bool> unknownModels(const fetch::oef::pb::Server_AgentMessage_RegistrationStatus &msg) {
+        return items(msg.count(), msg.unknown_models());
+      }
+    };
+
     class UnregisterDescription {
     private:
       fetch::oef::pb::Envelope envelope_;
@@ -60,6 +132,57 @@ namespace fetch {
       const fetch::oef::pb::Envelope &handle() const { return envelope_; }
     };
     
+    class UpdateDescription {
+    private:
+      fetch::oef::pb::Envelope envelope_;
+    public:
+      explicit UpdateDescription(uint32_t msgId, const std::unordered_map<std::string,VariantType> &values,
+                                 const std::vector<std::string> &removed) {
+        envelope_.set_msg_id(msgId);
+        fill(*envelope_.mutable_update_description(), values, removed);
+      }
+      static void fill(fetch::oef::pb::AgentUpdate &update, const std::unordered_map<std::string,VariantType> &values,
+                       const std::vector<std::string> &removed) {
+        auto *vals = update.mutable_values();
+        vals->Reserve(values.size());
+        for(auto &v : values) {
+          auto *kv = vals->Add();
+          kv->set_key(v.first);
+          Instance::encode(v.second, *kv->mutable_value());
+        }
+        for(auto &name : removed) {
+          update.add_removed(name);
+        }
+      }
+      fetch::oef::pb::Envelope &handle() { return envelope_; }
+    };
+
+    class UpdateService {
+    private:
+      fetch::oef::pb::Envelope envelope_;
+    public:
+      explicit UpdateService(uint32_t msgId, const Instance &instance, const std::unordered_map<std::string,VariantType> &values,
+                             const std::vector<std::string> &removed) {
+        envelope_.set_msg_id(msgId);
+        auto *update = envelope_.mutable_update_service();
+        const auto &model = instance.dataModel();
+        auto *ref = update->mutable_model();
+        ref->set_name(model.name());
+        ref->set_hi(model.fingerprint().hi());
+        ref->set_lo(model.fingerprint().lo());
+        update->set_service_hi(instance.fingerprint().hi());
+        update->set_service_lo(instance.fingerprint().lo());
+        UpdateDescription::fill(*update, values, removed);
+      }
+      fetch::oef::pb::Envelope &handle() { return envelope_; }
+      // instance with the update applied. Throws std::invalid_argument if the update does not fit its data model.
+      Instance apply(const Instance &instance) const {
+        Instance updated{instance};
+        updated.update(envelope_.update_service().values(), envelope_.update_service().removed());
+        return updated;
+      }
+    };
+
     class SearchServices {
     private:
       fetch::oef::pb::Envelope envelope_;
@@ -84,7 +207,7 @@ namespace fetch {
         message->set_destination(dest);
         message->set_content(msg);
       }
-      const fetch::oef::pb::Envelope &handle() const { return envelope_; }
+      fetch::oef::pb::Envelope &handle() { return envelope_; }
     };
     
     class CFP {
@@ -127,7 +250,7 @@ namespace fetch {
                           objs->Reserve(instances.size());
                           for(auto &instance: instances) {
                             auto *inst = objs->Add();
-                            inst->CopyFrom(instance.handle());
+                            instance.copyTo(*inst);
                           }
                         });
       }
@@ -184,11 +307,11 @@ namespace fetch {
     private:
       fetch::oef::pb::Envelope envelope_;
     public:
-      explicit Description(uint32_t msgId, const Instance &instance) {
+      explicit Description(uint32_t msgId, const Instance &instance, bool modelRef = false) {
         envelope_.set_msg_id(msgId);
         auto *desc = envelope_.mutable_register_description();
         auto *inst = desc->mutable_description();
-        inst->CopyFrom(instance.handle());
+        instance.copyTo(*inst, modelRef);
       }
       const fetch::oef::pb::Envelope &handle() const { return envelope_; }
     };
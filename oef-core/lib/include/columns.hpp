@@ -0,0 +1,474 @@
+#pragma once
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include "schema.hpp"
+
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+namespace fetch {
+  namespace oef {
+    // One bit per row.
+    class Bitmap {
+    private:
+      size_t size_;
+      std::vector<uint64_t> words_;
+
+      void trim() {
+        if(size_ % 64) {
+          words_.back() &= (uint64_t(1) << (size_ % 64)) - 1;
+        }
+      }
+    public:
+      Bitmap() : size_{0} {}
+      explicit Bitmap(size_t size, bool value = false)
+        : size_{size}, words_((size + 63) / 64, value ? ~uint64_t(0) : 0) {
+        trim();
+      }
+      size_t size() const { return size_; }
+      uint64_t *data() { return words_.data(); }
+      const uint64_t *data() const { return words_.data(); }
+      void resize(size_t size) {
+        size_ = size;
+        words_.resize((size + 63) / 64, 0);
+        trim();
+      }
+      bool test(size_t i) const { return (words_[i / 64] >> (i % 64)) & 1; }
+      void set(size_t i, bool value = true) {
+        if(value) {
+          words_[i / 64] |= uint64_t(1) << (i % 64);
+        } else {
+          words_[i / 64] &= ~(uint64_t(1) << (i % 64));
+        }
+      }
+      Bitmap &operator&=(const Bitmap &other) {
+        for(size_t i = 0; i < words_.size(); ++i) {
+          words_[i] &= other.words_[i];
+        }
+        return *this;
+      }
+      Bitmap &operator|=(const Bitmap &other) {
+        for(size_t i = 0; i < words_.size(); ++i) {
+          words_[i] |= other.words_[i];
+        }
+        return *this;
+      }
+      Bitmap &flip() {
+        for(auto &w : words_) {
+          w = ~w;
+        }
+        trim();
+        return *this;
+      }
+      bool none() const {
+        for(auto w : words_) {
+          if(w) {
+            return false;
+          }
+        }
+        return true;
+      }
+      size_t count() const {
+        size_t res = 0;
+        for(auto w : words_) {
+          res += __builtin_popcountll(w);
+        }
+        return res;
+      }
+      template <typename F>
+      void forEach(F &&f) const {
+        for(size_t i = 0; i < words_.size(); ++i) {
+          uint64_t w = words_[i];
+          while(w) {
+            f(i * 64 + __builtin_ctzll(w));
+            w &= w - 1;
+          }
+        }
+      }
+    };
+
+    // Batch evaluation of numeric constraints over columns, writing one bit per row in out,
+    // which holds at least (n + 63) / 64 words.
+    // Built with AVX2 when the compiler targets it (see ENABLE_AVX2), SSE2 otherwise, and scalar elsewhere.
+    namespace kernels {
+      enum class Cmp { Eq, NotEq, Lt, LtEq, Gt, GtEq };
+      const char *isa();
+      void compare(const int32_t *values, size_t n, Cmp op, int32_t v, uint64_t *out);
+      void compare(const double *values, size_t n, Cmp op, double v, uint64_t *out);
+      // lo <= values[i] <= hi
+      void between(const int32_t *values, size_t n, int32_t lo, int32_t hi, uint64_t *out);
+      void between(const double *values, size_t n, double lo, double hi, uint64_t *out);
+      // Haversine of the angle between each point and a center, from the sines and cosines of the latitudes
+      // and longitudes, compared to threshold: inside if below threshold - margin, maybe if below threshold + margin.
+      void within(const double *sinLat, const double *cosLat, const double *sinLon, const double *cosLon, size_t n,
+                  const Location &center, double threshold, double margin, uint64_t *inside, uint64_t *maybe);
+    }
+
+    // Values of the rows of a ServiceDirectory table, one column per attribute and value type.
+    // Numeric relations, ranges and distances are evaluated over whole columns by the kernels;
+    // other constraints fall back to checking the instances of the rows that hold a value.
+    // A query is evaluated into a bitmap, combining Or, And and Not as bitmap operations.
+    template <typename Entry>
+    class Columns {
+    private:
+      struct Column {
+        Bitmap ints, doubles, locations, others; // rows holding a value of each type
+        size_t nbInts = 0, nbDoubles = 0, nbLocations = 0, nbOthers = 0; // of the rows in each bitmap
+        // Sized to the rows only while some row holds a value of their type, as of the last resize: an
+        // attribute of one type costs one of them.
+        std::vector<int32_t> intValues;
+        std::vector<double> doubleValues;
+        std::vector<double> lon, lat, sinLat, cosLat, sinLon, cosLon;
+        size_t size = 0;
+
+        std::array<std::vector<double>*,6> locationValues() {
+          return {&lon, &lat, &sinLat, &cosLat, &sinLon, &cosLon};
+        }
+        template <typename T>
+        static void resize(std::vector<T> &v, size_t count, size_t n) {
+          if(count) {
+            v.resize(n);
+          } else {
+            std::vector<T>{}.swap(v);
+          }
+        }
+        void resize(size_t n) {
+          size = n;
+          for(auto *b : {&ints, &doubles, &locations, &others}) {
+            b->resize(n);
+          }
+          resize(intValues, nbInts, n);
+          resize(doubleValues, nbDoubles, n);
+          for(auto *v : locationValues()) {
+            resize(*v, nbLocations, n);
+          }
+        }
+        void clear(size_t row) {
+          if(ints.test(row)) {
+            ints.set(row, false);
+            --nbInts;
+          }
+          if(doubles.test(row)) {
+            doubles.set(row, false);
+            --nbDoubles;
+          }
+          if(locations.test(row)) {
+            locations.set(row, false);
+            --nbLocations;
+          }
+          if(others.test(row)) {
+            others.set(row, false);
+            --nbOthers;
+          }
+        }
+        // to was cleared, and from is about to be cut off by resize: the counts do not change.
+        void move(size_t from, size_t to) {
+          if(ints.test(from)) {
+            ints.set(to);
+            intValues[to] = intValues[from];
+          }
+          if(doubles.test(from)) {
+            doubles.set(to);
+            doubleValues[to] = doubleValues[from];
+          }
+          if(locations.test(from)) {
+            locations.set(to);
+            for(auto *v : locationValues()) {
+              (*v)[to] = (*v)[from];
+            }
+          }
+          if(others.test(from)) {
+            others.set(to);
+          }
+        }
+        void set(size_t row, const fetch::oef::pb::Query_Value &value) {
+          clear(row);
+          switch(value.value_case()) {
+          case fetch::oef::pb::Query_Value::kI:
+            resize(intValues, ++nbInts, size);
+            ints.set(row);
+            intValues[row] = int(value.i()); // as Instance::value does
+            break;
+          case fetch::oef::pb::Query_Value::kD:
+            resize(doubleValues, ++nbDoubles, size);
+            doubles.set(row);
+            doubleValues[row] = value.d();
+            break;
+          case fetch::oef::pb::Query_Value::kL: {
+            ++nbLocations;
+            for(auto *v : locationValues()) {
+              resize(*v, nbLocations, size);
+            }
+            locations.set(row);
+            lon[row] = value.l().lon();
+            lat[row] = value.l().lat();
+            double latRad = degree_to_radian(lat[row]);
+            double lonRad = degree_to_radian(lon[row]);
+            sinLat[row] = std::sin(latRad);
+            cosLat[row] = std::cos(latRad);
+            sinLon[row] = std::sin(lonRad);
+            cosLon[row] = std::cos(lonRad);
+            break;
+          }
+          case fetch::oef::pb::Query_Value::kS:
+          case fetch::oef::pb::Query_Value::kB:
+            ++nbOthers;
+            others.set(row);
+            break;
+          case fetch::oef::pb::Query_Value::VALUE_NOT_SET:
+            break;
+          }
+        }
+        bool empty() const {
+          return nbInts + nbDoubles + nbLocations + nbOthers == 0;
+        }
+        Bitmap present() const {
+          Bitmap res = ints;
+          res |= doubles;
+          res |= locations;
+          res |= others;
+          return res;
+        }
+      };
+      std::vector<const Entry*> rows_;
+      std::unordered_map<const Entry*,size_t> row_;
+      std::unordered_map<std::string,Column> columns_;
+
+      static kernels::Cmp cmp(fetch::oef::pb::Query_Relation_Operator op) {
+        switch(op) {
+        case fetch::oef::pb::Query_Relation_Operator_EQ: return kernels::Cmp::Eq;
+        case fetch::oef::pb::Query_Relation_Operator_NOTEQ: return kernels::Cmp::NotEq;
+        case fetch::oef::pb::Query_Relation_Operator_LT: return kernels::Cmp::Lt;
+        case fetch::oef::pb::Query_Relation_Operator_LTEQ: return kernels::Cmp::LtEq;
+        case fetch::oef::pb::Query_Relation_Operator_GT: return kernels::Cmp::Gt;
+        case fetch::oef::pb::Query_Relation_Operator_GTEQ: return kernels::Cmp::GtEq;
+        }
+        return kernels::Cmp::Eq;
+      }
+      // Checks the instances of rows one by one.
+      void scalar(const fetch::oef::pb::Query_ConstraintExpr_Constraint &constraint, const Bitmap &rows,
+                  const Lookups *lookups, Bitmap &res) const {
+        rows.forEach([&](size_t i) {
+            if(Constraint::check(constraint, rows_[i]->first, lookups)) {
+              res.set(i);
+            }
+          });
+      }
+      void ranges(const fetch::oef::pb::Query_Range &range, const Column &column, Bitmap &res) const {
+        size_t n = rows_.size();
+        Bitmap tmp{n};
+        const auto &ip = range.i();
+        if(column.nbInts && ip.first() <= std::numeric_limits<int32_t>::max()
+           && ip.second() >= std::numeric_limits<int32_t>::min()) {
+          auto lo = int32_t(std::max<int64_t>(ip.first(), std::numeric_limits<int32_t>::min()));
+          auto hi = int32_t(std::min<int64_t>(ip.second(), std::numeric_limits<int32_t>::max()));
+          kernels::between(column.intValues.data(), n, lo, hi, tmp.data());
+          tmp &= column.ints;
+          res |= tmp;
+        }
+        if(column.nbDoubles) {
+          kernels::between(column.doubleValues.data(), n, range.d().first(), range.d().second(), tmp.data());
+          tmp &= column.doubles;
+          res |= tmp;
+        }
+      }
+      void distances(const fetch::oef::pb::Query_Distance &distance, const Column &column, Bitmap &res) const {
+        if(!column.nbLocations) {
+          return;
+        }
+        size_t n = rows_.size();
+        Location center{distance.center().lon(), distance.center().lat()};
+        // distance <= d  <=>  haversine of the angle <= sin^2(d / 2R), up to rounding: rows close to the
+        // threshold are checked exactly.
+        double half = distance.distance() / (2 * EarthRadiusKm);
+        double threshold = half < 0 ? -1.0 : half >= M_PI / 2 ? 2.0 : std::sin(half) * std::sin(half);
+        Bitmap inside{n}, maybe{n};
+        kernels::within(column.sinLat.data(), column.cosLat.data(), column.sinLon.data(), column.cosLon.data(), n,
+                        center, threshold, 1e-12, inside.data(), maybe.data());
+        inside &= column.locations;
+        maybe &= column.locations;
+        res |= inside;
+        maybe.forEach([&](size_t i) {
+            if(!inside.test(i) && center.distance(Location{column.lon[i], column.lat[i]}) <= distance.distance()) {
+              res.set(i);
+            }
+          });
+      }
+      Bitmap evaluate(const fetch::oef::pb::Query_ConstraintExpr_Constraint &constraint, const Lookups *lookups) const {
+        size_t n = rows_.size();
+        Bitmap res{n};
+        auto iter = columns_.find(constraint.attribute_name());
+        if(iter == columns_.end()) { // no row has this attribute
+          return res;
+        }
+        const auto &column = iter->second;
+        switch(constraint.constraint_case()) {
+        case fetch::oef::pb::Query_ConstraintExpr_Constraint::kRelation: {
+          const auto &rel = constraint.relation();
+          Bitmap tmp{n};
+          if(column.nbInts) {
+            kernels::compare(column.intValues.data(), n, cmp(rel.op()), int32_t(rel.val().i()), tmp.data());
+            tmp &= column.ints;
+            res |= tmp;
+          }
+          if(column.nbDoubles) {
+            kernels::compare(column.doubleValues.data(), n, cmp(rel.op()), rel.val().d(), tmp.data());
+            tmp &= column.doubles;
+            res |= tmp;
+          }
+          Bitmap rest = column.locations;
+          rest |= column.others;
+          scalar(constraint, rest, lookups, res);
+          break;
+        }
+        case fetch::oef::pb::Query_ConstraintExpr_Constraint::kRange: {
+          ranges(constraint.range_(), column, res);
+          Bitmap rest = column.locations;
+          rest |= column.others;
+          scalar(constraint, rest, lookups, res);
+          break;
+        }
+        case fetch::oef::pb::Query_ConstraintExpr_Constraint::kDistance:
+          distances(constraint.distance(), column, res); // never true for other types
+          break;
+        default:
+          scalar(constraint, column.present(), lookups, res);
+          break;
+        }
+        return res;
+      }
+    public:
+      void add(const Entry &entry) {
+        size_t row = rows_.size();
+        rows_.push_back(&entry);
+        row_[&entry] = row;
+        for(auto &c : columns_) {
+          c.second.resize(row + 1);
+        }
+        // same order as the instance, so that the last of duplicated keys wins.
+        for(auto &kv : entry.first.valuesHandle().values()) {
+          if(kv.value().value_case() == fetch::oef::pb::Query_Value::VALUE_NOT_SET) {
+            continue;
+          }
+          auto iter = columns_.find(kv.key());
+          if(iter == columns_.end()) {
+            iter = columns_.emplace(kv.key(), Column{}).first;
+            iter->second.resize(row + 1);
+          }
+          iter->second.set(row, kv.value());
+        }
+      }
+      // The last row takes the place of the removed one.
+      void remove(const Entry &entry) {
+        auto iter = row_.find(&entry);
+        if(iter == row_.end()) {
+          return;
+        }
+        size_t row = iter->second;
+        size_t last = rows_.size() - 1;
+        row_.erase(iter);
+        if(row != last) {
+          rows_[row] = rows_[last];
+          row_[rows_[row]] = row;
+        }
+        rows_.pop_back();
+        for(auto c = columns_.begin(); c != columns_.end();) {
+          c->second.clear(row);
+          if(row != last) {
+            c->second.move(last, row);
+          }
+          c->second.resize(last);
+          if(c->second.empty()) {
+            c = columns_.erase(c);
+          } else {
+            ++c;
+          }
+        }
+      }
+      // entry was updated in place: only the columns of the attributes in changed are rewritten.
+      void update(const Entry &entry, const std::set<std::string> &changed) {
+        auto iter = row_.find(&entry);
+        if(iter == row_.end()) {
+          return;
+        }
+        size_t row = iter->second;
+        for(auto &name : changed) {
+          const auto *value = entry.first.valueHandle(name);
+          auto c = columns_.find(name);
+          if(!value) {
+            if(c != columns_.end()) {
+              c->second.clear(row);
+              if(c->second.empty()) {
+                columns_.erase(c);
+              }
+            }
+            continue;
+          }
+          if(c == columns_.end()) {
+            c = columns_.emplace(name, Column{}).first;
+            c->second.resize(rows_.size());
+          }
+          c->second.set(row, *value);
+        }
+      }
+      size_t size() const { return rows_.size(); }
+      const Entry &row(size_t i) const { return *rows_[i]; }
+      Bitmap evaluate(const fetch::oef::pb::Query_ConstraintExpr &expr, const Lookups *lookups) const {
+        switch(expr.expression_case()) {
+        case fetch::oef::pb::Query_ConstraintExpr::kOr: {
+          Bitmap res{rows_.size()};
+          for(auto &c : expr.or_().expr()) {
+            res |= evaluate(c, lookups);
+          }
+          return res;
+        }
+        case fetch::oef::pb::Query_ConstraintExpr::kAnd: {
+          Bitmap res{rows_.size(), true};
+          for(auto &c : expr.and_().expr()) {
+            res &= evaluate(c, lookups);
+          }
+          return res;
+        }
+        case fetch::oef::pb::Query_ConstraintExpr::kNot:
+          return evaluate(expr.not_().expr(), lookups).flip();
+        case fetch::oef::pb::Query_ConstraintExpr::kConstraint:
+          return evaluate(expr.constraint(), lookups);
+        case fetch::oef::pb::Query_ConstraintExpr::EXPRESSION_NOT_SET:
+          break;
+        }
+        return Bitmap{rows_.size()};
+      }
+      // Rows matching all the constraints of query. The caller selects the table by the query's data model.
+      Bitmap evaluate(const QueryModel &query) const {
+        Bitmap res{rows_.size(), true};
+        for(auto &c : query.handle().constraints()) {
+          if(res.none()) {
+            break;
+          }
+          res &= evaluate(c, &query.lookups());
+        }
+        return res;
+      }
+    };
+  }
+}
@@ -24,7 +24,7 @@
 #include <thread>
 
 enum class Ports {
-  ServiceDiscovery = 2222, Agents = 3333
+  ServiceDiscovery = 2222, Agents = 3333, Metrics = 3334
 };
 
 using asio::ip::tcp;
@@ -53,7 +53,12 @@ T deserialize(const Buffer &buffer) {
   return t;
 }
 
+// Messages are a 32 bit length followed by the bytes. An operation not done within timeout seconds (0 for no
+// limit) shuts the socket down and fails with asio::error::timed_out.
 void asyncReadBuffer(asio::ip::tcp::socket &socket, uint32_t timeout, std::function<void(std::error_code,std::shared_ptr<Buffer>)> handler);
+// Also calls progress when only part of the message has arrived, the handler being called on the rest.
+void asyncReadBuffer(asio::ip::tcp::socket &socket, uint32_t timeout, std::function<void(std::error_code,std::shared_ptr<Buffer>)> handler,
+                     std::function<void()> progress);
 void asyncWriteBuffer(asio::ip::tcp::socket &socket, std::shared_ptr<Buffer> s, uint32_t timeout);
 void asyncWriteBuffer(asio::ip::tcp::socket &socket, std::shared_ptr<Buffer> s, uint32_t timeout, std::function<void(std::error_code, std::size_t length)> handler);
 
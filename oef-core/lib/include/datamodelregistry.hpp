@@ -0,0 +1,115 @@
+#pragma once
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include "schema.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+namespace fetch {
+  namespace oef {
+    // Thrown when an instance refers to a data model the node does not keep: the agent has to send it in full.
+    class UnknownDataModel : public std::invalid_argument {
+    public:
+      explicit UnknownDataModel(const std::string &name) : std::invalid_argument{"Unknown data model " + name} {}
+    };
+
+    // Node side intern table of data models, keyed by name and fingerprint.
+    // Instances resolved through it share one schema object per data model, and later
+    // registrations can refer to a model by Query.DataModelRef instead of sending it again.
+    // Models are stored as versions in a SchemaDirectory: lookups never wait on lock_, and read snapshots that
+    // writers swap atomically.
+    // A model is interned once an instance of it has been registered, never on a failed resolution. Models no
+    // registered instance uses any more are swept whenever the table doubles since the last sweep: an agent
+    // referring to one of them gets an UnknownDataModel error and has to send the full model again.
+    class DataModelRegistry {
+    public:
+      static constexpr size_t minSweep = 64; // no sweep below that many models
+    private:
+      std::mutex lock_; // serialises interning and sweeping, so that a model is only added once.
+      SchemaDirectory schemas_;
+      std::atomic<size_t> size_{0};
+      size_t sweepAt_ = minSweep;
+
+      // lock_ must be held. A model only this table refers to is not used by any instance.
+      void sweep() {
+        size_ -= schemas_.erase([](const Schema &s) { return !s.schema().shared(); });
+        sweepAt_ = std::max(size_t(minSweep), 2 * size_);
+      }
+
+    public:
+      explicit DataModelRegistry() = default;
+      DataModelRegistry(const DataModelRegistry &) = delete;
+      DataModelRegistry operator=(const DataModelRegistry &) = delete;
+      // Called once an instance of model has been registered.
+      void intern(const DataModel &model) {
+        if(schemas_.find(model.handle().name(), model.fingerprint())) {
+          return;
+        }
+        std::lock_guard<std::mutex> lock(lock_);
+        if(schemas_.find(model.handle().name(), model.fingerprint())) {
+          return;
+        }
+        schemas_.add(model.handle().name(), model);
+        if(++size_ >= sweepAt_) {
+          sweep();
+        }
+      }
+      stde::optional<DataModel> find(const fetch::oef::pb::Query_DataModelRef &ref) const {
+        auto s = schemas_.find(ref.name(), Fingerprint{ref.hi(), ref.lo()});
+        if(s) {
+          return s->schema();
+        }
+        return stde::nullopt;
+      }
+      // The registered copy of model, if the node has seen it.
+      stde::optional<DataModel> find(const fetch::oef::pb::Query_DataModel &model) const {
+        auto s = schemas_.find(model.name(), DataModel::fingerprint(model));
+        if(s) {
+          return s->schema();
+        }
+        return stde::nullopt;
+      }
+      // The instance, on the registered copy of its model if there is one. Does not intern a new model.
+      // Throws UnknownDataModel if the instance refers to a model this registry does not know, and
+      // std::invalid_argument if it does not fit its model.
+      Instance resolve(const fetch::oef::pb::Query_Instance &instance) const {
+        if(instance.has_model()) {
+          auto m = find(instance.model());
+          return Instance{instance, m ? *m : DataModel{instance.model()}};
+        }
+        if(instance.has_model_ref()) {
+          auto m = find(instance.model_ref());
+          if(m) {
+            return Instance{instance, *m};
+          }
+          throw UnknownDataModel(instance.model_ref().name());
+        }
+        throw std::invalid_argument("Instance without data model.");
+      }
+      const SchemaDirectory &schemas() const { return schemas_; }
+      size_t size() const {
+        return size_;
+      }
+    };
+  }
+}
@@ -31,7 +31,13 @@ enum class LogLevel {trace = spdlog::level::level_enum::trace,
 };
 
 
-#ifdef TRACE_ON
+// Levels below OEF_LOG_ACTIVE_LEVEL (one of the SPDLOG_LEVEL_* values) are compiled out, arguments included
+// for the macros below. Every level is kept by default: the run time level then decides.
+#ifndef OEF_LOG_ACTIVE_LEVEL
+#define OEF_LOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#endif
+
+#if defined(TRACE_ON) && OEF_LOG_ACTIVE_LEVEL <= SPDLOG_LEVEL_TRACE
 #define STR_H(x) #x
 #define STR_HELPER(x) SPDLOG_STR_H(x)
 #define TRACE(logger, ...) logger.trace("[" __FILE__ " line #" SPDLOG_STR_HELPER(__LINE__) "] " __VA_ARGS__)
@@ -41,8 +47,9 @@ enum class LogLevel {trace = spdlog::level::level_enum::trace,
 #else
 #define TRACE(logger, ...)
 #endif
-#ifdef DEBUG_ON
-#define DEBUG(logger, ...) logger.debug(__VA_ARGS__)
+// The arguments are only evaluated when the debug level of logger's section is on.
+#if OEF_LOG_ACTIVE_LEVEL <= SPDLOG_LEVEL_DEBUG
+#define DEBUG(logger, ...) do { if((logger).enabled(LogLevel::debug)) (logger).debug(__VA_ARGS__); } while(false)
 //#define DEBUG_IF(logger, flag, ...) logger.debug_if(flag, __VA_ARGS__)
 #else
 #define DEBUG(logger, ...)
@@ -50,8 +57,9 @@ enum class LogLevel {trace = spdlog::level::level_enum::trace,
 
 namespace fetch {
   namespace oef {
+    // Each section logs through its own spdlog logger, named after it: all of them share the sinks, which
+    // are written by a background thread, so logging a message only costs queueing it.
     class Logger {
-      static constexpr const char * const logger_name = "fetch::oef::logger";
     private:
       std::string section_{""};
       std::shared_ptr<spdlog::logger> logger_{nullptr};
@@ -59,12 +67,18 @@ namespace fetch {
       explicit Logger(std::string section);
       
       std::string section() const noexcept { return section_; }
-      
+
+      // Checked before anything is formatted.
+      bool enabled(const LogLevel level) const noexcept {
+        return static_cast<int>(level) >= OEF_LOG_ACTIVE_LEVEL
+          && logger_->should_log(static_cast<spdlog::level::level_enum>(level));
+      }
+
       template <typename Arg1, typename... Args>
       void log(const LogLevel level, const char *fmt, const Arg1 &arg1, const Args &... args) {
-        auto new_fmt = "[{}] " + std::string(fmt);
-        logger_->log(static_cast<spdlog::level::level_enum>(level), new_fmt.c_str(), section(),
-                     arg1, args...);
+        if(enabled(level)) {
+          logger_->log(static_cast<spdlog::level::level_enum>(level), fmt, arg1, args...);
+        }
       }
 
       template <typename Arg1, typename... Args>
@@ -130,6 +144,13 @@ namespace fetch {
       static void level(const LogLevel level) noexcept {
         spdlog::set_level(static_cast<spdlog::level::level_enum>(level));
       }
+      // Sets the level of all sections by name (trace, debug, info, warning, error, critical or off).
+      // Returns false, leaving the level as it is, if name is not a level.
+      static bool level(const std::string &name);
+      // Same, for one section only: false if there is no such section.
+      static bool level(const std::string &section, const std::string &name);
+      // Applies "level" or "section=level".
+      static bool configure(const std::string &spec);
 
     };
   } // namespace oef
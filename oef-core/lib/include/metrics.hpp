@@ -0,0 +1,204 @@
+#pragma once
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include "common.hpp"
+#include "logger.hpp"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace fetch {
+  namespace oef {
+    // Monotonic counter. Each thread adds to its own cache line, so updates never contend; reading sums them.
+    class Counter {
+    public:
+      static constexpr size_t slots = 16;
+    private:
+      struct Slot {
+        std::atomic<uint64_t> value{0};
+        char padding[64 - sizeof(std::atomic<uint64_t>)];
+      };
+      std::array<Slot,slots> slots_;
+
+      static size_t slot() {
+        static std::atomic<size_t> next{0};
+        static thread_local size_t index = next++ % slots;
+        return index;
+      }
+    public:
+      void add(uint64_t n = 1) {
+        slots_[slot()].value.fetch_add(n, std::memory_order_relaxed);
+      }
+      uint64_t value() const {
+        uint64_t res = 0;
+        for(auto &s : slots_) {
+          res += s.value.load(std::memory_order_relaxed);
+        }
+        return res;
+      }
+    };
+
+    class Gauge {
+    private:
+      std::atomic<int64_t> value_{0};
+    public:
+      void set(int64_t v) { value_.store(v, std::memory_order_relaxed); }
+      void add(int64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+      int64_t value() const { return value_.load(std::memory_order_relaxed); }
+    };
+
+    // Log-linear histogram of non-negative integers, as in HDR histograms: values below 8 are exact, above
+    // each power of two is split in 8 buckets, so quantiles are within 1/16 of the true value over the whole
+    // 64 bit range, in a fixed 4KB.
+    class LatencyHistogram {
+    public:
+      static constexpr size_t subBits = 3;
+      static constexpr size_t sub = size_t(1) << subBits;
+      static constexpr size_t buckets = sub + (64 - subBits) * sub;
+    private:
+      std::array<std::atomic<uint64_t>,buckets> counts_{};
+      std::atomic<uint64_t> count_{0};
+      std::atomic<uint64_t> sum_{0};
+    public:
+      static size_t bucket(uint64_t v) {
+        if(v < sub) {
+          return size_t(v);
+        }
+        size_t e = size_t(63 - __builtin_clzll(v));
+        return sub + (e - subBits) * sub + size_t((v >> (e - subBits)) & (sub - 1));
+      }
+      // Smallest value of bucket i.
+      static uint64_t lower(size_t i) {
+        if(i < sub) {
+          return i;
+        }
+        size_t e = (i - sub) / sub + subBits;
+        return uint64_t(sub + (i - sub) % sub) << (e - subBits);
+      }
+      static uint64_t upper(size_t i) {
+        return i + 1 < buckets ? lower(i + 1) - 1 : std::numeric_limits<uint64_t>::max();
+      }
+      void record(uint64_t v) {
+        counts_[bucket(v)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(v, std::memory_order_relaxed);
+      }
+      uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+      uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+      // Middle of the bucket holding the q-quantile (q in [0, 1]), 0 if nothing was recorded.
+      double quantile(double q) const {
+        uint64_t total = 0;
+        for(auto &c : counts_) {
+          total += c.load(std::memory_order_relaxed);
+        }
+        if(total == 0) {
+          return 0.0;
+        }
+        auto rank = uint64_t(q * (total - 1)) + 1;
+        uint64_t seen = 0;
+        for(size_t i = 0; i < buckets; ++i) {
+          seen += counts_[i].load(std::memory_order_relaxed);
+          if(seen >= rank) {
+            return (double(lower(i)) + double(upper(i))) / 2.0;
+          }
+        }
+        return double(lower(buckets - 1));
+      }
+    };
+
+    // Records the time between its construction and its destruction in nanoseconds.
+    class Stopwatch {
+    private:
+      LatencyHistogram &histogram_;
+      std::chrono::steady_clock::time_point start_ = std::chrono::steady_clock::now();
+    public:
+      explicit Stopwatch(LatencyHistogram &histogram) : histogram_{histogram} {}
+      Stopwatch(const Stopwatch &) = delete;
+      Stopwatch operator=(const Stopwatch &) = delete;
+      ~Stopwatch() {
+        auto elapsed = std::chrono::steady_clock::now() - start_;
+        histogram_.record(uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+      }
+    };
+
+    // Named metrics, rendered in the Prometheus text format. Registering takes a lock and returns a reference
+    // that stays valid as long as the registry: callers keep it and update it without any lock.
+    class Metrics {
+    private:
+      struct Series {
+        std::string labels; // name="value",... as in the exposition format
+        std::unique_ptr<Counter> counter;
+        std::unique_ptr<Gauge> gauge;
+        std::unique_ptr<LatencyHistogram> histogram;
+        std::function<double()> read;
+      };
+      struct Family {
+        std::string help;
+        std::string type;
+        double scale = 1.0; // of histogram values
+        std::vector<std::unique_ptr<Series>> series;
+      };
+      mutable std::mutex lock_;
+      std::map<std::string,Family> families_;
+
+      // Called with lock_ held.
+      Series &series(const std::string &name, const std::string &help, const std::string &type,
+                     const std::string &labels, double scale = 1.0);
+    public:
+      // labels is the inside of the label set, e.g. operation="search_agents", and may be empty.
+      Counter &counter(const std::string &name, const std::string &help, const std::string &labels = "");
+      Gauge &gauge(const std::string &name, const std::string &help, const std::string &labels = "");
+      // Gauge read when rendered.
+      void gauge(const std::string &name, const std::string &help, std::function<double()> read,
+                 const std::string &labels = "");
+      // Rendered as a summary; recorded values are multiplied by scale, e.g. 1e-9 for nanoseconds in seconds.
+      LatencyHistogram &histogram(const std::string &name, const std::string &help, double scale = 1.0,
+                                  const std::string &labels = "");
+      std::string prometheus() const;
+    };
+
+    // Answers any HTTP request on a local port with the metrics.
+    class MetricsEndpoint {
+    private:
+      static constexpr uint32_t requestTimeout = 5; // seconds for a scraper to send its request
+      tcp::acceptor acceptor_;
+      asio::steady_timer retry_; // of accepts, after an error such as running out of file descriptors
+      const Metrics &metrics_;
+      std::function<std::string()> statistics_; // JSON, served on /statistics
+
+      static fetch::oef::Logger logger;
+
+      void do_accept();
+    public:
+      MetricsEndpoint(asio::io_context &io_context, const Metrics &metrics, uint16_t port,
+                      std::function<std::string()> statistics = nullptr);
+      MetricsEndpoint(const MetricsEndpoint &) = delete;
+      MetricsEndpoint operator=(const MetricsEndpoint &) = delete;
+      void start() { do_accept(); }
+    };
+  }
+}
@@ -19,12 +19,17 @@
 
 #include "agent.pb.h"
 #include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <experimental/optional>
 #include <iostream>
 #include <limits>
+#include <memory>
 #include "mapbox/variant.hpp"
 #include <mutex>
+#include <set>
 #include <stdexcept>
 #include <typeinfo>
 #include <unordered_map>
@@ -78,6 +83,14 @@ namespace fetch {
         return 2 * EarthRadiusKm * computation;
       }
     };
+    // A location in radians with the cosine of its latitude, computed once for distance checks.
+    struct GeoPoint {
+      double lat;
+      double lon;
+      double cosLat;
+      explicit GeoPoint(double lonDegrees, double latDegrees)
+        : lat{degree_to_radian(latDegrees)}, lon{degree_to_radian(lonDegrees)}, cosLat{std::cos(lat)} {}
+    };
     enum class Type {
                      Double = fetch::oef::pb::Query_Attribute_Type_DOUBLE,
                      Int = fetch::oef::pb::Query_Attribute_Type_INT,
@@ -352,7 +365,46 @@ namespace fetch {
       bool check(const VariantType &v) const {
         return check(set_, v);
       }
+      // Hash sets of the values of a large string, int or double set, built once per query:
+      // membership is then a probe instead of a scan of the repeated field for every instance.
+      class Lookup {
+      private:
+        std::unordered_set<int64_t> ints_;
+        std::unordered_set<double> doubles_;
+        std::unordered_set<std::string> strings_;
+      public:
+        static constexpr int threshold = 16; // below, scanning is as fast.
+        explicit Lookup(const fetch::oef::pb::Query_Set &set) {
+          const auto &vals = set.vals();
+          ints_.insert(vals.i().vals().begin(), vals.i().vals().end());
+          doubles_.insert(vals.d().vals().begin(), vals.d().vals().end());
+          strings_.insert(vals.s().vals().begin(), vals.s().vals().end());
+        }
+        static bool worth(const fetch::oef::pb::Query_Set &set) {
+          const auto &vals = set.vals();
+          return vals.i().vals_size() >= threshold || vals.d().vals_size() >= threshold || vals.s().vals_size() >= threshold;
+        }
+        bool contains(const VariantType &v) const {
+          bool res = false;
+          v.match(
+                  [this,&res](int i) { res = ints_.find(i) != ints_.end(); },
+                  [this,&res](double d) { res = doubles_.find(d) != doubles_.end(); },
+                  [this,&res](const std::string &st) { res = strings_.find(st) != strings_.end(); },
+                  [](bool) {},
+                  [](const Location &) {});
+          return res;
+        }
+      };
+      static bool check(const fetch::oef::pb::Query_Set &set, const VariantType &v, const Lookup &lookup) {
+        bool res = lookup.contains(v);
+        if(set.op() == fetch::oef::pb::Query_Set_Operator_NOTIN) {
+          return !res;
+        }
+        return res;
+      }
     };
+    // Lookups of the large sets of a query, by set.
+    using SetLookups = std::unordered_map<const fetch::oef::pb::Query_Set*,Set::Lookup>;
 
     class Distance {
     private:
@@ -364,6 +416,55 @@ namespace fetch {
         location->set_lat(center.lat);
         distance_.set_distance(distance);
       }
+      // The center of a query in radians, with a bounding box to cull far locations before the haversine.
+      // Gives the same answers as Location::distance: both compute the same haversine, and locations
+      // within rounding of the distance are decided by the same final formula.
+      class Lookup {
+      private:
+        GeoPoint center_;
+        double distance_;
+        double threshold_; // haversine of the angle at distance_
+        double dLat_;      // half sizes of the bounding box, in radians
+        double dLon_;      // more than pi when all longitudes are in
+      public:
+        explicit Lookup(const fetch::oef::pb::Query_Distance &distance)
+          : center_{distance.center().lon(), distance.center().lat()}, distance_{distance.distance()} {
+          double angle = distance_ / EarthRadiusKm;
+          double half = angle / 2;
+          threshold_ = half < 0 ? -1.0 : half >= M_PI / 2 ? 2.0 : std::sin(half) * std::sin(half);
+          if(std::isnan(half)) {
+            threshold_ = half;
+          }
+          const double margin = 1e-9;
+          dLat_ = angle + margin;
+          if(angle < M_PI / 2 && center_.lat + angle < M_PI / 2 && center_.lat - angle > -M_PI / 2) {
+            dLon_ = std::asin(std::sin(angle) / center_.cosLat) + margin;
+          } else { // a pole is in
+            dLon_ = 2 * M_PI;
+          }
+        }
+        bool check(const GeoPoint &p) const {
+          double diffLa = p.lat - center_.lat;
+          if(std::abs(diffLa) > dLat_) {
+            return false;
+          }
+          double diffLo = p.lon - center_.lon;
+          double dLon = std::abs(diffLo);
+          if(dLon > M_PI) {
+            dLon = 2 * M_PI - dLon;
+          }
+          if(dLon > dLon_) {
+            return false;
+          }
+          double sinLa = std::sin(diffLa / 2);
+          double sinLo = std::sin(diffLo / 2);
+          double h = sinLa * sinLa + center_.cosLat * p.cosLat * sinLo * sinLo;
+          if(std::abs(h - threshold_) > 1e-12) {
+            return h < threshold_;
+          }
+          return 2 * EarthRadiusKm * std::asin(std::sqrt(h)) <= distance_;
+        }
+      };
       const fetch::oef::pb::Query_Distance &handle() const { return distance_; }
       static bool valid(const fetch::oef::pb::Query_Distance &dist, const fetch::oef::pb::Query_Attribute_Type &t) {
         return t == fetch::oef::pb::Query_Attribute_Type_LOCATION;
@@ -386,6 +487,14 @@ namespace fetch {
       }
     };
 
+    // Lookups of the distances of a query, by distance.
+    using DistanceLookups = std::unordered_map<const fetch::oef::pb::Query_Distance*,Distance::Lookup>;
+    // What a query precomputes from its constraints, keyed by the constraint messages it was built from.
+    struct Lookups {
+      SetLookups sets;
+      DistanceLookups distances;
+    };
+
     class Range {
     public:
       using ValueType = var::variant<std::pair<int,int>,std::pair<double,double>,std::pair<std::string,std::string>>;
@@ -463,11 +572,87 @@ namespace fetch {
       }
     };
     
-    class DataModel {
+    // 128 bits digest of a byte stream: two FNV-1a style lanes with distinct seeds and multipliers.
+    // Collisions are unlikely enough for an equality pre-check, but callers still have to confirm a match.
+    class Fingerprint {
     private:
-      fetch::oef::pb::Query_DataModel model_;
+      uint64_t hi_ = 0x6c62272e07bb0142ULL;
+      uint64_t lo_ = 0xcbf29ce484222325ULL;
+
+      static uint64_t mix(uint64_t x) {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        return x;
+      }
     public:
-      explicit DataModel(const std::string &name, const std::vector<Attribute> &attributes) {
+      Fingerprint() = default;
+      explicit Fingerprint(uint64_t hi, uint64_t lo) : hi_{hi}, lo_{lo} {}
+      void add(const void *data, size_t size) {
+        const auto *bytes = static_cast<const unsigned char *>(data);
+        for(size_t i = 0; i < size; ++i) {
+          lo_ = (lo_ ^ bytes[i]) * 0x100000001b3ULL;
+          hi_ = (hi_ ^ bytes[i]) * 0x880355f21e6d1965ULL;
+        }
+      }
+      void add(const std::string &s) {
+        add(uint64_t(s.size()));
+        add(s.data(), s.size());
+      }
+      void add(uint64_t v) { add(&v, sizeof(v)); }
+      void add(int64_t v) { add(uint64_t(v)); }
+      void add(bool b) { add(uint64_t(b)); }
+      void add(double d) {
+        if(d == 0.0) { // -0.0 == 0.0
+          d = 0.0;
+        }
+        uint64_t bits;
+        std::memcpy(&bits, &d, sizeof(bits));
+        add(bits);
+      }
+      void add(const fetch::oef::pb::Query_Value &value) {
+        add(uint64_t(value.value_case()));
+        switch(value.value_case()) {
+        case fetch::oef::pb::Query_Value::kS:
+          add(value.s());
+          break;
+        case fetch::oef::pb::Query_Value::kD:
+          add(value.d());
+          break;
+        case fetch::oef::pb::Query_Value::kB:
+          add(value.b());
+          break;
+        case fetch::oef::pb::Query_Value::kI:
+          add(int64_t(value.i()));
+          break;
+        case fetch::oef::pb::Query_Value::kL:
+          add(value.l().lon());
+          add(value.l().lat());
+          break;
+        case fetch::oef::pb::Query_Value::VALUE_NOT_SET:
+          break;
+        }
+      }
+      uint64_t hi() const { return hi_; }
+      uint64_t lo() const { return lo_; }
+      std::size_t hash() const { return std::size_t(mix(hi_ ^ mix(lo_))); }
+      bool operator==(const Fingerprint &other) const { return hi_ == other.hi_ && lo_ == other.lo_; }
+      bool operator!=(const Fingerprint &other) const { return !(*this == other); }
+    };
+
+    // Immutable once built: copies share one schema object, which is what the node keeps per registered instance.
+    class DataModel {
+    private:
+      struct Shared {
+        fetch::oef::pb::Query_DataModel model;
+        Fingerprint fingerprint;
+        std::unordered_map<std::string,int> index; // attribute name -> position in model.attributes()
+      };
+      std::shared_ptr<const Shared> shared_;
+
+      static fetch::oef::pb::Query_DataModel build(const std::string &name, const std::vector<Attribute> &attributes) {
         std::unordered_set<std::string> att_set;
         for(auto &a : attributes) {
           auto pair = att_set.insert(a.name());
@@ -475,22 +660,67 @@ namespace fetch {
             throw std::invalid_argument("Duplicate attribute name");
           }
         }
-        model_.set_name(name);
-        auto *atts = model_.mutable_attributes();
+        fetch::oef::pb::Query_DataModel model;
+        model.set_name(name);
+        auto *atts = model.mutable_attributes();
         for(auto &a : attributes) {
           auto *att = atts->Add();
           att->CopyFrom(a.handle());
         }
+        return model;
+      }
+      void share(fetch::oef::pb::Query_DataModel &&model) {
+        auto shared = std::make_shared<Shared>();
+        shared->model.Swap(&model);
+        shared->fingerprint = fingerprint(shared->model);
+        const auto &attributes = shared->model.attributes();
+        shared->index.reserve(attributes.size());
+        for(int i = 0; i < attributes.size(); ++i) {
+          shared->index.emplace(attributes.Get(i).name(), i);
+        }
+        shared_ = std::move(shared);
       }
-      explicit DataModel(const std::string &name, const std::vector<Attribute> &attributes, const std::string &description)
-        : DataModel{name, attributes} {
-        model_.set_description(description);
+    public:
+      explicit DataModel(const std::string &name, const std::vector<Attribute> &attributes) {
+        share(build(name, attributes));
+      }
+      explicit DataModel(const std::string &name, const std::vector<Attribute> &attributes, const std::string &description) {
+        auto model = build(name, attributes);
+        model.set_description(description);
+        share(std::move(model));
+      }
+      explicit DataModel(const fetch::oef::pb::Query_DataModel &model) {
+        share(fetch::oef::pb::Query_DataModel{model});
+      }
+      const fetch::oef::pb::Query_DataModel &handle() const { return shared_->model; }
+      const Fingerprint &fingerprint() const { return shared_->fingerprint; }
+      // Whether another copy shares this one's schema object.
+      bool shared() const { return shared_.use_count() > 1; }
+      static Fingerprint fingerprint(const fetch::oef::pb::Query_DataModel &model) {
+        Fingerprint fp;
+        fp.add(model.name());
+        fp.add(model.description());
+        fp.add(uint64_t(model.attributes_size()));
+        for(auto &a : model.attributes()) {
+          fp.add(a.name());
+          fp.add(uint64_t(a.type()));
+          fp.add(a.required());
+          fp.add(a.description());
+        }
+        return fp;
       }
-      const fetch::oef::pb::Query_DataModel &handle() const { return model_; }
       bool operator==(const DataModel &other) const
       {
-        return model_.name() == other.model_.name();
-        // TODO: should check more.
+        return shared_ == other.shared_ || (handle().name() == other.handle().name() && fingerprint() == other.fingerprint());
+      }
+      // nullptr if the model has no such attribute.
+      const fetch::oef::pb::Query_Attribute *attribute(const std::string &name) const {
+        const auto &index = shared_->index;
+        auto iter = index.find(name);
+        if(iter == index.end()) {
+          return nullptr;
+        }
+        return &handle().attributes(iter->second);
       }
       static stde::optional<fetch::oef::pb::Query_Attribute> attribute(const fetch::oef::pb::Query_DataModel &model,
                                                                        const std::string &name) {
@@ -501,7 +731,7 @@ namespace fetch {
         }
         return stde::nullopt;
       }
-      std::string name() const { return model_.name(); }
+      std::string name() const { return handle().name(); }
       static std::vector<std::pair<std::string,std::string>>
       instantiate(const fetch::oef::pb::Query_DataModel &model, const std::unordered_map<std::string,VariantType> &values) {
         std::vector<std::pair<std::string,std::string>> res;
@@ -514,10 +744,139 @@ namespace fetch {
     
     class Instance {
     private:
+      DataModel model_;
+      // Only the values: the model is shared through model_.
       fetch::oef::pb::Query_Instance instance_;
-      std::unordered_map<std::string,VariantType> values_;
+      // Positions in instance_.values() sorted by key. Values are only decoded when they are asked for.
+      std::vector<int> order_;
+      // Computed once over the model name and the key/values in key order.
+      Fingerprint fingerprint_;
+      // Location values in radians, by position in instance_.values().
+      std::vector<std::pair<int,GeoPoint>> points_;
+
+      static stde::optional<VariantType> decode(const fetch::oef::pb::Query_Value &value) {
+        switch(value.value_case()) {
+        case fetch::oef::pb::Query_Value::kS:
+          return VariantType{value.s()};
+        case fetch::oef::pb::Query_Value::kD:
+          return VariantType{value.d()};
+        case fetch::oef::pb::Query_Value::kB:
+          return VariantType{value.b()};
+        case fetch::oef::pb::Query_Value::kI:
+          return VariantType{int(value.i())};
+        case fetch::oef::pb::Query_Value::kL:
+          return VariantType{Location{value.l().lon(), value.l().lat()}};
+        case fetch::oef::pb::Query_Value::VALUE_NOT_SET:
+          break;
+        }
+        return stde::nullopt;
+      }
+      static bool equal(const fetch::oef::pb::Query_Value &lhs, const fetch::oef::pb::Query_Value &rhs) {
+        if(lhs.value_case() != rhs.value_case()) {
+          return false;
+        }
+        switch(lhs.value_case()) {
+        case fetch::oef::pb::Query_Value::kS:
+          return lhs.s() == rhs.s();
+        case fetch::oef::pb::Query_Value::kD:
+          return lhs.d() == rhs.d();
+        case fetch::oef::pb::Query_Value::kB:
+          return lhs.b() == rhs.b();
+        case fetch::oef::pb::Query_Value::kI:
+          return lhs.i() == rhs.i();
+        case fetch::oef::pb::Query_Value::kL:
+          return lhs.l().lon() == rhs.l().lon() && lhs.l().lat() == rhs.l().lat();
+        case fetch::oef::pb::Query_Value::VALUE_NOT_SET:
+          break;
+        }
+        return true;
+      }
+      static const fetch::oef::pb::Query_Instance &checked(const fetch::oef::pb::Query_Instance &instance) {
+        if(!instance.has_model()) {
+          throw std::invalid_argument("Instance without data model.");
+        }
+        return instance;
+      }
+      void index() {
+        const auto &values = instance_.values();
+        order_.clear();
+        order_.reserve(values.size());
+        for(int i = 0; i < values.size(); ++i) {
+          if(values.Get(i).value().value_case() != fetch::oef::pb::Query_Value::VALUE_NOT_SET) {
+            order_.push_back(i);
+          }
+        }
+        std::stable_sort(order_.begin(), order_.end(), [&values](int lhs, int rhs) {
+            return values.Get(lhs).key() < values.Get(rhs).key();
+          });
+        // on duplicated keys, the last value wins.
+        auto last = std::unique(order_.rbegin(), order_.rend(), [&values](int lhs, int rhs) {
+            return values.Get(lhs).key() == values.Get(rhs).key();
+          });
+        order_.erase(order_.begin(), last.base());
+        points_.clear();
+        for(int i : order_) {
+          const auto &value = values.Get(i).value();
+          if(value.has_l()) {
+            points_.emplace_back(i, GeoPoint{value.l().lon(), value.l().lat()});
+          }
+        }
+        Fingerprint fp;
+        fp.add(model_.fingerprint().hi());
+        fp.add(model_.fingerprint().lo());
+        fp.add(uint64_t(order_.size()));
+        for(int i : order_) {
+          const auto &kv = values.Get(i);
+          fp.add(kv.key());
+          fp.add(kv.value());
+        }
+        fingerprint_ = fp;
+      }
+      // Position of the value of name in instance_.values(), or -1.
+      int position(const std::string &name) const {
+        const auto &values = instance_.values();
+        auto iter = std::lower_bound(order_.begin(), order_.end(), name, [&values](int i, const std::string &key) {
+            return values.Get(i).key() < key;
+          });
+        if(iter == order_.end() || values.Get(*iter).key() != name) {
+          return -1;
+        }
+        return *iter;
+      }
+      const fetch::oef::pb::Query_KeyValue *find(const std::string &name) const {
+        int i = position(name);
+        return i < 0 ? nullptr : &instance_.values().Get(i);
+      }
+      // Throws if value is not of the type of attribute.
+      static void check(const fetch::oef::pb::Query_Attribute &attribute, const fetch::oef::pb::Query_Value &value) {
+        auto type = attribute.type();
+        switch(value.value_case()) {
+        case fetch::oef::pb::Query_Value::kI:
+          if(type != fetch::oef::pb::Query_Attribute_Type_INT)
+            throw std::invalid_argument("Attribute is not an int in data model.");
+          break;
+        case fetch::oef::pb::Query_Value::kD:
+          if(type != fetch::oef::pb::Query_Attribute_Type_DOUBLE)
+            throw std::invalid_argument("Attribute is not a double in data model.");
+          break;
+        case fetch::oef::pb::Query_Value::kS:
+          if(type != fetch::oef::pb::Query_Attribute_Type_STRING)
+            throw std::invalid_argument("Attribute is not a string in data model.");
+          break;
+        case fetch::oef::pb::Query_Value::kL:
+          if(type != fetch::oef::pb::Query_Attribute_Type_LOCATION)
+            throw std::invalid_argument("Attribute is not a location in data model.");
+          break;
+        case fetch::oef::pb::Query_Value::kB:
+          if(type != fetch::oef::pb::Query_Attribute_Type_BOOL)
+            throw std::invalid_argument("Attribute is not a bool in data model.");
+          break;
+        case fetch::oef::pb::Query_Value::VALUE_NOT_SET:
+          throw std::invalid_argument("Attribute without value.");
+        }
+      }
     public:
-      explicit Instance(const DataModel &model, const std::unordered_map<std::string,VariantType> &values) : values_{values} {
+      explicit Instance(const DataModel &model, const std::unordered_map<std::string,VariantType> &values) : model_{model} {
         if(values.size() > size_t(model.handle().attributes_size())) {
           throw std::invalid_argument("Too many attributes");
         }
@@ -529,135 +888,176 @@ namespace fetch {
         if(values.size() < nb_required) {
           throw std::invalid_argument("Not enough attributes");
         }
-        auto *mod = instance_.mutable_model();
-        mod->CopyFrom(model.handle());
         auto *vals = instance_.mutable_values();
         for(auto &v : values) {
-          const auto iter = std::find_if(model.handle().attributes().begin(), model.handle().attributes().end(),
-                                         [&v](const fetch::oef::pb::Query_Attribute &a) {
-                                           return v.first == a.name();
-                                         });
-          if(iter == model.handle().attributes().end()) {
+          const auto *iter = model.attribute(v.first);
+          if(!iter) {
             // attribute does not exist in datamodel
             throw std::invalid_argument("Attribute does not exist in data model.");
           }
-          auto att_type = iter->type();
           if(iter->required())
             --nb_required;
           auto *val = vals->Add();
           val->set_key(v.first);
-          auto *value = val->mutable_value();
-          v.second.match(
-                         [att_type, value](int i) {
-                           if(att_type != fetch::oef::pb::Query_Attribute_Type_INT) {
-                             throw std::invalid_argument("Attribute is not an int in data model.");
-                           }
-                           value->set_i(i);
-                         },
-                         [att_type, value](double d) {
-                           if(att_type != fetch::oef::pb::Query_Attribute_Type_DOUBLE) {
-                             throw std::invalid_argument("Attribute is not a double in data model.");
-                           }
-                           value->set_d(d);
-                         },
-                         [att_type, value](const std::string &s) {
-                           if(att_type != fetch::oef::pb::Query_Attribute_Type_STRING) {
-                             throw std::invalid_argument("Attribute is not a string in data model.");
-                           }
-                           value->set_s(s);
-                         },
-                         [att_type, value](const Location &l) {
-                           if(att_type != fetch::oef::pb::Query_Attribute_Type_LOCATION) {
-                             throw std::invalid_argument("Attribute is not a location in data model.");
-                           }
-                           auto *loc = value->mutable_l();
-                           loc->set_lon(l.lon);
-                           loc->set_lat(l.lat);
-                         },
-                         [att_type, value](bool b) {
-                           if(att_type != fetch::oef::pb::Query_Attribute_Type_BOOL) {
-                             throw std::invalid_argument("Attribute is not a bool in data model.");
-                           }
-                           value->set_b(b);
-                         });
+          encode(v.second, *val->mutable_value());
+          check(*iter, val->value());
         }
         if(nb_required > 0) {
           throw std::invalid_argument("Not enough attributes.");
         }
-      }
-      explicit Instance(const fetch::oef::pb::Query_Instance &instance) : instance_{instance}
-      {
-        const auto &values = instance_.values();
-        for(auto &v : values) {
-          switch(v.value().value_case()) {
-          case fetch::oef::pb::Query_Value::kS:
-            values_[v.key()] = VariantType{v.value().s()};
-            break;
-          case fetch::oef::pb::Query_Value::kD:
-            values_[v.key()] = VariantType{v.value().d()};
-            break;
-          case fetch::oef::pb::Query_Value::kB:
-            values_[v.key()] = VariantType{v.value().b()};
-            break;
-          case fetch::oef::pb::Query_Value::kI:
-            values_[v.key()] = VariantType{int(v.value().i())};
-            break;
-          case fetch::oef::pb::Query_Value::kL:
-            values_[v.key()] = VariantType{Location{v.value().l().lon(), v.value().l().lat()}};
-            break;
-          case fetch::oef::pb::Query_Value::VALUE_NOT_SET:
-          default:
-            break;
+        index();
+      }
+      explicit Instance(const fetch::oef::pb::Query_Instance &instance) : model_{checked(instance).model()} {
+        *instance_.mutable_values() = instance.values();
+        index();
+      }
+      // The node resolves the model through its DataModelRegistry, so that all its instances share it.
+      explicit Instance(const fetch::oef::pb::Query_Instance &instance, DataModel model) : model_{std::move(model)} {
+        *instance_.mutable_values() = instance.values();
+        index();
+      }
+      // Writes the full model, or only a reference to it when the receiver is known to have it already.
+      void copyTo(fetch::oef::pb::Query_Instance &instance, bool modelRef = false) const {
+        instance.Clear();
+        if(modelRef) {
+          auto *ref = instance.mutable_model_ref();
+          ref->set_name(model_.name());
+          ref->set_hi(model_.fingerprint().hi());
+          ref->set_lo(model_.fingerprint().lo());
+        } else {
+          instance.mutable_model()->CopyFrom(model_.handle());
+        }
+        *instance.mutable_values() = instance_.values();
+      }
+      const fetch::oef::pb::Query_Instance &valuesHandle() const { return instance_; }
+      const fetch::oef::pb::Query_Value *valueHandle(const std::string &name) const {
+        const auto *kv = find(name);
+        return kv ? &kv->value() : nullptr;
+      }
+      static void encode(const VariantType &v, fetch::oef::pb::Query_Value &value) {
+        v.match([&value](int i) { value.set_i(i); },
+                [&value](double d) { value.set_d(d); },
+                [&value](const std::string &s) { value.set_s(s); },
+                [&value](const Location &l) {
+                  auto *loc = value.mutable_l();
+                  loc->set_lon(l.lon);
+                  loc->set_lat(l.lat);
+                },
+                [&value](bool b) { value.set_b(b); });
+      }
+      // Sets the given values and removes the removed attributes, as checked against the data model: nothing
+      // changes if the update does not fit it. Returns the names of the attributes whose value changed.
+      std::set<std::string> update(const google::protobuf::RepeatedPtrField<fetch::oef::pb::Query_KeyValue> &values,
+                                   const google::protobuf::RepeatedPtrField<std::string> &removed) {
+        std::set<std::string> changed;
+        std::unordered_map<std::string,const fetch::oef::pb::Query_Value*> set;
+        for(auto &kv : values) {
+          const auto *attribute = model_.attribute(kv.key());
+          if(!attribute) {
+            throw std::invalid_argument("Attribute does not exist in data model.");
           }
+          check(*attribute, kv.value());
+          set[kv.key()] = &kv.value(); // the last value wins.
         }
+        for(auto &name : removed) {
+          const auto *attribute = model_.attribute(name);
+          if(!attribute) {
+            throw std::invalid_argument("Attribute does not exist in data model.");
+          }
+          if(attribute->required()) {
+            throw std::invalid_argument("Cannot remove a required attribute.");
+          }
+          if(set.find(name) != set.end()) {
+            throw std::invalid_argument("Attribute both set and removed.");
+          }
+          if(find(name)) {
+            changed.insert(name);
+          }
+        }
+        for(auto &kv : set) {
+          const auto *current = find(kv.first);
+          if(!current || !equal(current->value(), *kv.second)) {
+            changed.insert(kv.first);
+          }
+        }
+        if(changed.empty()) {
+          return changed;
+        }
+        google::protobuf::RepeatedPtrField<fetch::oef::pb::Query_KeyValue> res;
+        res.Reserve(instance_.values_size() + int(set.size()));
+        for(auto &kv : instance_.values()) {
+          if(changed.find(kv.key()) == changed.end()) {
+            *res.Add() = kv;
+          }
+        }
+        for(auto &name : changed) {
+          auto iter = set.find(name);
+          if(iter != set.end()) {
+            auto *kv = res.Add();
+            kv->set_key(name);
+            *kv->mutable_value() = *iter->second;
+          }
+        }
+        instance_.mutable_values()->Swap(&res);
+        index();
+        return changed;
       }
-      const fetch::oef::pb::Query_Instance &handle() const { return instance_; }
       bool operator==(const Instance &other) const
       {
-        if(!(instance_.model().name() == other.instance_.model().name())) {
+        if(fingerprint_ != other.fingerprint_ || order_.size() != other.order_.size()) {
           return false;
         }
-        for(const auto &p : values_) {
-          const auto &iter = other.values_.find(p.first);
-          if(iter == other.values_.end()) {
-            return false;
-          }
-          if(iter->second != p.second) {
+        if(!(model_ == other.model_)) {
+          return false;
+        }
+        const auto &values = instance_.values();
+        const auto &other_values = other.instance_.values();
+        for(size_t i = 0; i < order_.size(); ++i) {
+          const auto &kv = values.Get(order_[i]);
+          const auto &other_kv = other_values.Get(other.order_[i]);
+          if(kv.key() != other_kv.key() || !equal(kv.value(), other_kv.value())) {
             return false;
           }
         }
         return true;
       }
-      std::size_t hash() const {
-        std::size_t h = std::hash<std::string>{}(instance_.model().name());
-        for(const auto &p : values_) {
-          std::size_t hs = std::hash<std::string>{}(p.first);
-          h = hs ^ (h << 1);
-          p.second.match([&hs](int i) { hs = std::hash<int>{}(i);},
-                         [&hs](double d) { hs = std::hash<double>{}(d);},
-                         [&hs](const std::string &s) { hs = std::hash<std::string>{}(s);},
-                         [&hs](const Location &l) {
-                           std::size_t h1 = std::hash<double>{}(l.lon);
-                           hs = h1 ^ (std::hash<double>{}(l.lat) << 1);},
-                         [&hs](bool b) { hs = std::hash<bool>{}(b);});
-          h = hs ^ (h << 2);
-        }
-        return h;
+      std::size_t hash() const { return fingerprint_.hash(); }
+      const Fingerprint &fingerprint() const { return fingerprint_; }
+      std::unordered_map<std::string,VariantType> values() const {
+        std::unordered_map<std::string,VariantType> res;
+        for(int i : order_) {
+          const auto &kv = instance_.values(i);
+          res.emplace(kv.key(), *decode(kv.value()));
+        }
+        return res;
       }
-      
       std::vector<std::pair<std::string,std::string>>
       instantiate() const {
-        return DataModel::instantiate(instance_.model(), values_);
+        return DataModel::instantiate(model_.handle(), values());
       }
       const fetch::oef::pb::Query_DataModel &model() const {
-        return instance_.model();
+        return model_.handle();
+      }
+      const DataModel &dataModel() const { return model_; }
+      // The value of name in radians, if it is a location.
+      const GeoPoint *point(const std::string &name) const {
+        if(points_.empty()) {
+          return nullptr;
+        }
+        int i = position(name);
+        for(auto &p : points_) {
+          if(p.first == i) {
+            return &p.second;
+          }
+        }
+        return nullptr;
       }
       stde::optional<VariantType> value(const std::string &name) const {
-        auto iter = values_.find(name);
-        if(iter == values_.end()) {
+        const auto *kv = find(name);
+        if(!kv) {
           return stde::nullopt;
         }
-        return stde::optional<VariantType>{iter->second};
+        return decode(kv->value());
       }
     };
 
@@ -686,15 +1086,22 @@ namespace fetch {
       }
       explicit Constraint(std::string attribute_name, const Distance &distance) : attribute_name_{std::move(attribute_name)} {
         constraint_.set_attribute_name(attribute_name_);
-        auto *s = constraint_.mutable_set_();
-        s->CopyFrom(distance.handle());
+        auto *d = constraint_.mutable_distance();
+        d->CopyFrom(distance.handle());
       }
       operator ConstraintExpr() const;
       const fetch::oef::pb::Query_ConstraintExpr_Constraint &handle() const { return constraint_; }
-      static bool check(const fetch::oef::pb::Query_ConstraintExpr_Constraint &constraint, const VariantType &v) {
+      static bool check(const fetch::oef::pb::Query_ConstraintExpr_Constraint &constraint, const VariantType &v,
+                        const Lookups *lookups = nullptr) {
         auto constraint_case = constraint.constraint_case();
         switch(constraint_case) {
         case fetch::oef::pb::Query_ConstraintExpr_Constraint::kSet:
+          if(lookups) {
+            auto iter = lookups->sets.find(&constraint.set_());
+            if(iter != lookups->sets.end()) {
+              return Set::check(constraint.set_(), v, iter->second);
+            }
+          }
           return Set::check(constraint.set_(), v);
         case fetch::oef::pb::Query_ConstraintExpr_Constraint::kRange:
           return Range::check(constraint.range_(), v);
@@ -707,14 +1114,10 @@ namespace fetch {
         }
         return false;
       }
-      static bool valid(const fetch::oef::pb::Query_ConstraintExpr_Constraint &constraint, const fetch::oef::pb::Query_DataModel &dm) {
+      static bool valid(const fetch::oef::pb::Query_ConstraintExpr_Constraint &constraint, const DataModel &dm) {
         auto constraint_case = constraint.constraint_case();
-        const auto &att_name = constraint.attribute_name();
-        const auto iter = std::find_if(dm.attributes().begin(), dm.attributes().end(),
-                                    [&att_name](const fetch::oef::pb::Query_Attribute &a) {
-                                      return att_name == a.name();
-                                    });
-        if(iter == dm.attributes().end()) {
+        const auto *iter = dm.attribute(constraint.attribute_name());
+        if(!iter) {
           // attribute does not exist in datamodel
           return false;
         }
@@ -732,15 +1135,17 @@ namespace fetch {
         }
         return false;
       }
-      static bool check(const fetch::oef::pb::Query_ConstraintExpr_Constraint &constraint, const Instance &i) {
+      static bool check(const fetch::oef::pb::Query_ConstraintExpr_Constraint &constraint, const Instance &i,
+                        const Lookups *lookups = nullptr) {
         auto &attribute_name = constraint.attribute_name();
-        auto attr = DataModel::attribute(i.model(), attribute_name);
-        if(attr) {
-          // Need to check attr->type with the constraint admissible types -> tricky
-          // if(attr->type() != attribute.type()) {
-          //   return false;
-          // }
+        if(lookups && constraint.has_distance()) {
+          auto iter = lookups->distances.find(&constraint.distance());
+          if(iter != lookups->distances.end()) {
+            const auto *p = i.point(attribute_name);
+            return p && iter->second.check(*p);
+          }
         }
+        // Need to check the attribute type with the constraint admissible types -> tricky
         auto v = i.value(attribute_name);
         if(!v) {
           // if(attribute.required()) {
@@ -748,7 +1153,7 @@ namespace fetch {
           // }
           return false;
         }
-        return check(constraint, *v);
+        return check(constraint, *v, lookups);
       }
       bool check(const VariantType &v) const {
         return check(constraint_, v);
@@ -771,8 +1176,8 @@ namespace fetch {
       explicit ConstraintExpr(const Constraint &constraint);
       const fetch::oef::pb::Query_ConstraintExpr &handle() const { return constraint_; }
       static bool check(const fetch::oef::pb::Query_ConstraintExpr &constraint, const VariantType &v);
-      static bool check(const fetch::oef::pb::Query_ConstraintExpr &constraint, const Instance &i);
-      static bool valid(const fetch::oef::pb::Query_ConstraintExpr &constraint, const fetch::oef::pb::Query_DataModel &dm);
+      static bool check(const fetch::oef::pb::Query_ConstraintExpr &constraint, const Instance &i, const Lookups *lookups = nullptr);
+      static bool valid(const fetch::oef::pb::Query_ConstraintExpr &constraint, const DataModel &dm);
       bool check(const VariantType &v) const {
         return check(constraint_, v);
       }
@@ -801,15 +1206,15 @@ namespace fetch {
         }
         return false;
       }
-      static bool check(const fetch::oef::pb::Query_ConstraintExpr_Or &expr, const Instance &i) {
+      static bool check(const fetch::oef::pb::Query_ConstraintExpr_Or &expr, const Instance &i, const Lookups *lookups = nullptr) {
         for(auto &c : expr.expr()) {
-          if(ConstraintExpr::check(c, i)) {
+          if(ConstraintExpr::check(c, i, lookups)) {
             return true;
           }
         }
         return false;
       }
-      static bool valid(const fetch::oef::pb::Query_ConstraintExpr_Or &expr, const fetch::oef::pb::Query_DataModel &dm) {
+      static bool valid(const fetch::oef::pb::Query_ConstraintExpr_Or &expr, const DataModel &dm) {
         for(auto &c : expr.expr()) {
           if(!ConstraintExpr::valid(c, dm)) {
             return false;
@@ -843,15 +1248,15 @@ namespace fetch {
         }
         return true;
       }
-      static bool check(const fetch::oef::pb::Query_ConstraintExpr_And &expr, const Instance &i) {
+      static bool check(const fetch::oef::pb::Query_ConstraintExpr_And &expr, const Instance &i, const Lookups *lookups = nullptr) {
         for(auto &c : expr.expr()) {
-          if(!ConstraintExpr::check(c, i)) {
+          if(!ConstraintExpr::check(c, i, lookups)) {
             return false;
           }
         }
         return true;
       }
-      static bool valid(const fetch::oef::pb::Query_ConstraintExpr_And &expr, const fetch::oef::pb::Query_DataModel &dm) {
+      static bool valid(const fetch::oef::pb::Query_ConstraintExpr_And &expr, const DataModel &dm) {
         for(auto &c : expr.expr()) {
           if(!ConstraintExpr::valid(c, dm)) {
             return false;
@@ -874,10 +1279,10 @@ namespace fetch {
       static bool check(const fetch::oef::pb::Query_ConstraintExpr_Not &expr, const VariantType &v) {
         return !ConstraintExpr::check(expr.expr(), v);
       }
-      static bool check(const fetch::oef::pb::Query_ConstraintExpr_Not &expr, const Instance &i) {
-        return !ConstraintExpr::check(expr.expr(), i);
+      static bool check(const fetch::oef::pb::Query_ConstraintExpr_Not &expr, const Instance &i, const Lookups *lookups = nullptr) {
+        return !ConstraintExpr::check(expr.expr(), i, lookups);
       }
-      static bool valid(const fetch::oef::pb::Query_ConstraintExpr_Not &expr, const fetch::oef::pb::Query_DataModel &dm) {
+      static bool valid(const fetch::oef::pb::Query_ConstraintExpr_Not &expr, const DataModel &dm) {
         return ConstraintExpr::valid(expr.expr(), dm);
       }
     };
@@ -886,9 +1291,78 @@ namespace fetch {
     ConstraintExpr operator&&(const ConstraintExpr &lhs, const ConstraintExpr &rhs);
     ConstraintExpr operator||(const ConstraintExpr &lhs, const ConstraintExpr &rhs);
 
+    // Rewrites the constraints of a query into an equivalent form that is cheaper to check:
+    // nested And/Or are flattened, Not is pushed down to the constraints (De Morgan), duplicates are removed,
+    // x && !x and x || !x are folded, ranges on the same attribute are intersected (And) or merged (Or),
+    // and children are ordered so that cheap and selective ones short-circuit first.
+    // A false expression is an empty Or, a true one an empty And.
+    // With a data model, a range that cannot hold any value of its attribute's type is folded to false.
+    // With statistics of the instances to search, selectivities are estimated from them.
+    class DataModelStatistics;
+    class QueryOptimiser {
+    private:
+      using Expr = fetch::oef::pb::Query_ConstraintExpr;
+      const DataModel *model_;
+      const DataModelStatistics *statistics_;
+
+      static Expr always(bool value);
+      static bool is(const Expr &expr, bool value);
+      bool empty(const fetch::oef::pb::Query_ConstraintExpr_Constraint &constraint) const;
+      Expr normalise(const Expr &expr, bool negate) const;
+      Expr combine(bool conjunction, std::vector<Expr> children) const;
+      bool fold(bool conjunction, std::vector<Expr> &children) const;
+      void order(bool conjunction, std::vector<Expr> &children) const;
+    public:
+      explicit QueryOptimiser(const DataModel *model = nullptr, const DataModelStatistics *statistics = nullptr)
+        : model_{model}, statistics_{statistics} {}
+      // Relative cost of checking expr against an instance.
+      double cost(const Expr &expr) const;
+      // Estimated fraction of instances matching expr.
+      double selectivity(const Expr &expr) const;
+      // constraints are and-ed together, as in Query.Model.
+      void optimise(google::protobuf::RepeatedPtrField<Expr> &constraints) const;
+    };
+
     class QueryModel {
     private:
       fetch::oef::pb::Query_Model model_;
+      // Keyed by the constraints inside model_: rebuilt whenever model_ is copied.
+      Lookups lookups_;
+
+      void materialise(const fetch::oef::pb::Query_ConstraintExpr &expr) {
+        switch(expr.expression_case()) {
+        case fetch::oef::pb::Query_ConstraintExpr::kOr:
+          for(auto &c : expr.or_().expr()) {
+            materialise(c);
+          }
+          break;
+        case fetch::oef::pb::Query_ConstraintExpr::kAnd:
+          for(auto &c : expr.and_().expr()) {
+            materialise(c);
+          }
+          break;
+        case fetch::oef::pb::Query_ConstraintExpr::kNot:
+          materialise(expr.not_().expr());
+          break;
+        case fetch::oef::pb::Query_ConstraintExpr::kConstraint:
+          if(expr.constraint().has_set_() && Set::Lookup::worth(expr.constraint().set_())) {
+            lookups_.sets.emplace(&expr.constraint().set_(), Set::Lookup{expr.constraint().set_()});
+          }
+          if(expr.constraint().has_distance()) {
+            lookups_.distances.emplace(&expr.constraint().distance(), Distance::Lookup{expr.constraint().distance()});
+          }
+          break;
+        case fetch::oef::pb::Query_ConstraintExpr::EXPRESSION_NOT_SET:
+          break;
+        }
+      }
+      void materialise() {
+        lookups_.sets.clear();
+        lookups_.distances.clear();
+        for(auto &c : model_.constraints()) {
+          materialise(c);
+        }
+      }
     public:
       explicit QueryModel(const std::vector<ConstraintExpr> &constraints) {
         if(constraints.size() < 1) {
@@ -899,18 +1373,36 @@ namespace fetch {
           auto *ct = cts->Add();
           ct->CopyFrom(c.handle());
         }
+        materialise();
       }
       explicit QueryModel(const std::vector<ConstraintExpr> &constraints, const DataModel &model) : QueryModel{constraints} {
         auto *m = model_.mutable_model();
         m->CopyFrom(model.handle());
         for(auto &c : model_.constraints()) {
-          if(!ConstraintExpr::valid(c, model_.model())) {
+          if(!ConstraintExpr::valid(c, model)) {
             throw std::invalid_argument("Mismatch between constraints in data model.");
           }
         }
       }
-      explicit QueryModel(const fetch::oef::pb::Query_Model &model) : model_{model} {}
+      explicit QueryModel(const fetch::oef::pb::Query_Model &model) : model_{model} {
+        materialise();
+      }
+      QueryModel(const QueryModel &other) : model_{other.model_} {
+        materialise();
+      }
+      QueryModel &operator=(const QueryModel &other) {
+        model_ = other.model_;
+        materialise();
+        return *this;
+      }
       const fetch::oef::pb::Query_Model &handle() const { return model_; }
+      const SetLookups &sets() const { return lookups_.sets; }
+      const Lookups &lookups() const { return lookups_; }
+      // To be called once the query is known to be valid: see QueryOptimiser.
+      void optimise(const DataModel *model = nullptr, const DataModelStatistics *statistics = nullptr) {
+        QueryOptimiser{model, statistics}.optimise(*model_.mutable_constraints());
+        materialise();
+      }
       template <typename T>
       bool check_value(const T &v) const {
         for(auto &c : model_.constraints()) {
@@ -921,15 +1413,20 @@ namespace fetch {
         return true;
       }
       bool valid() const {
+        if(!model_.has_model()) { // no model, so we cannot check.
+          // Empty expression is not valid
+          return model_.constraints_size() > 0;
+        }
+        return valid(DataModel{model_.model()});
+      }
+      // Checks the constraints against model: the node passes its own copy of the query's data model.
+      bool valid(const DataModel &model) const {
         // Empty expression is not valid
         if(model_.constraints_size() < 1) {
           return false;
         }
-        if(!model_.has_model()) { // no model, so we cannot check.
-          return true;
-        }
         for(auto &c : model_.constraints()) {
-          if(!ConstraintExpr::valid(c, model_.model())) {
+          if(!ConstraintExpr::valid(c, model)) {
             return false;
           }
         }
@@ -943,7 +1440,7 @@ namespace fetch {
           // TODO: more to compare ?
         }
         for(auto &c : model_.constraints()) {
-          if(!ConstraintExpr::check(c, i)) {
+          if(!ConstraintExpr::check(c, i, &lookups_)) {
             return false;
           }
         }
@@ -968,54 +1465,144 @@ namespace fetch {
     public:
       explicit Schema(uint32_t version, const DataModel &schema) : version_{version}, schema_{schema} {}
       uint32_t version() const { return version_; }
-      DataModel schema() const { return schema_; }
+      const DataModel &schema() const { return schema_; }
     };
     
+    // Versions of one schema, sorted by version.
+    // Readers work on an immutable snapshot and never wait for writers, which serialise on lock_ and publish a new
+    // snapshot. This is not lock-free: atomic_load and atomic_store on a shared_ptr take one of the standard
+    // library's spinlocks, held only for the copy of the pointer.
     class Schemas {
     private:
+      using Snapshot = std::vector<Schema>;
       mutable std::mutex lock_;
-      std::vector<Schema> schemas_;
+      std::shared_ptr<const Snapshot> snapshot_ = std::make_shared<const Snapshot>();
+
+      std::shared_ptr<const Snapshot> snapshot() const { return std::atomic_load(&snapshot_); }
     public:
       explicit Schemas() = default;
+      Schemas(const Schemas &) = delete;
+      Schemas operator=(const Schemas &) = delete;
       uint32_t add(uint32_t version, const DataModel &schema) {
         std::lock_guard<std::mutex> lock(lock_);
+        auto next = std::make_shared<Snapshot>(*snapshot());
         if(version == std::numeric_limits<uint32_t>::max()) {
-          version = schemas_.size() + 1;
+          version = next->empty() ? 1 : next->back().version() + 1;
         }
-        schemas_.emplace_back(Schema(version, schema));
+        auto pos = std::upper_bound(next->begin(), next->end(), version,
+                                    [](uint32_t v, const Schema &p) { return v < p.version(); });
+        next->insert(pos, Schema(version, schema));
+        std::atomic_store(&snapshot_, std::shared_ptr<const Snapshot>{std::move(next)});
         return version;
       }
+      // First schema whose version is at least version, or the latest one.
       stde::optional<Schema> get(uint32_t version) const {
-        std::lock_guard<std::mutex> lock(lock_);
-        if(schemas_.empty()) {
+        auto schemas = snapshot();
+        if(schemas->empty()) {
           return stde::nullopt;
         }
-        if(version == std::numeric_limits<uint32_t>::max()) {
-          return schemas_.back();
+        auto iter = std::lower_bound(schemas->begin(), schemas->end(), version,
+                                     [](const Schema &p, uint32_t v) { return p.version() < v; });
+        if(iter == schemas->end()) {
+          return schemas->back();
         }
-        for(auto &p : schemas_) { // TODO: binary search
-          if(p.version() >= version) {
+        return *iter;
+      }
+      stde::optional<Schema> find(const Fingerprint &fingerprint) const {
+        auto schemas = snapshot();
+        for(auto &p : *schemas) { // a handful of versions at most
+          if(p.schema().fingerprint() == fingerprint) {
             return p;
           }
         }
-        return schemas_.back();
+        return stde::nullopt;
       }
+      // Removes the versions for which remove returns true, and returns how many were removed.
+      template <typename Predicate>
+      size_t erase(Predicate remove) {
+        std::lock_guard<std::mutex> lock(lock_);
+        auto current = snapshot();
+        auto next = std::make_shared<Snapshot>();
+        for(auto &p : *current) {
+          if(!remove(p)) {
+            next->push_back(p);
+          }
+        }
+        size_t removed = current->size() - next->size();
+        if(removed) {
+          std::atomic_store(&snapshot_, std::shared_ptr<const Snapshot>{std::move(next)});
+        }
+        return removed;
+      }
+      bool empty() const { return snapshot()->empty(); }
     };
     
+    // Schemas by key, published as Schemas publishes its versions: readers never block on lock_.
     class SchemaDirectory {
     private:
-      std::unordered_map<std::string, Schemas> schemas_;
+      using Snapshot = std::unordered_map<std::string, std::shared_ptr<Schemas>>;
+      mutable std::mutex lock_;
+      std::shared_ptr<const Snapshot> snapshot_ = std::make_shared<const Snapshot>();
+
+      std::shared_ptr<const Schemas> schemas(const std::string &key) const {
+        auto snapshot = std::atomic_load(&snapshot_);
+        const auto &iter = snapshot->find(key);
+        if(iter != snapshot->end()) {
+          return iter->second;
+        }
+        return nullptr;
+      }
     public:
       explicit SchemaDirectory() = default;
+      SchemaDirectory(const SchemaDirectory &) = delete;
+      SchemaDirectory operator=(const SchemaDirectory &) = delete;
       stde::optional<Schema> get(const std::string &key, uint32_t version = std::numeric_limits<uint32_t>::max()) const {
-        const auto &iter = schemas_.find(key);
-        if(iter != schemas_.end()) {
-          return iter->second.get(version);
+        auto s = schemas(key);
+        if(s) {
+          return s->get(version);
+        }
+        return stde::nullopt;
+      }
+      stde::optional<Schema> find(const std::string &key, const Fingerprint &fingerprint) const {
+        auto s = schemas(key);
+        if(s) {
+          return s->find(fingerprint);
         }
         return stde::nullopt;
       }
       uint32_t add(const std::string &key, const DataModel &schema, uint32_t version = std::numeric_limits<uint32_t>::max()) {
-        return schemas_[key].add(version, schema);
+        std::shared_ptr<Schemas> s;
+        {
+          std::lock_guard<std::mutex> lock(lock_);
+          auto current = std::atomic_load(&snapshot_);
+          const auto &iter = current->find(key);
+          if(iter != current->end()) {
+            s = iter->second;
+          } else {
+            auto next = std::make_shared<Snapshot>(*current);
+            s = std::make_shared<Schemas>();
+            next->emplace(key, s);
+            std::atomic_store(&snapshot_, std::shared_ptr<const Snapshot>{std::move(next)});
+          }
+        }
+        return s->add(version, schema);
+      }
+      // Removes the versions for which remove returns true, and the keys left without any. Callers must not add
+      // concurrently: a version added to a key being dropped would be lost.
+      template <typename Predicate>
+      size_t erase(Predicate remove) {
+        std::lock_guard<std::mutex> lock(lock_);
+        auto current = std::atomic_load(&snapshot_);
+        auto next = std::make_shared<Snapshot>();
+        size_t removed = 0;
+        for(auto &kv : *current) {
+          removed += kv.second->erase(remove);
+          if(!kv.second->empty()) {
+            next->emplace(kv);
+          }
+        }
+        std::atomic_store(&snapshot_, std::shared_ptr<const Snapshot>{std::move(next)});
+        return removed;
       }
     };
     
@@ -23,13 +23,60 @@
 #include "servicedirectory.hpp"
 #include "logger.hpp"
 #include "agentdirectory.hpp"
+#include "datamodelregistry.hpp"
+#include "metrics.hpp"
 
 namespace fetch {
   namespace oef {
+    // The node's metrics, registered once and updated by every session without taking any lock.
+    struct NodeMetrics {
+      std::vector<Counter*> requests; // indexed by Envelope payload case
+      std::vector<LatencyHistogram*> durations;
+      LatencyHistogram &agentsFound;
+      LatencyHistogram &servicesFound;
+      LatencyHistogram &handshakes;
+      Counter &connections;
+      Counter &bytesReceived;
+      Counter &bytesSent;
+      Counter &oefErrors;
+      Counter &dialogueErrors;
+      Gauge &queuedBytes;
+      Gauge &queuedMessages;
+      Counter &dropped;
+      Counter &paused;
+      Counter &disconnected;
+      Counter &pings;
+      Counter &evictions;
+
+      explicit NodeMetrics(Metrics &metrics);
+      Counter &request(fetch::oef::pb::Envelope::PayloadCase c) { return *requests[size_t(c)]; }
+      LatencyHistogram &duration(fetch::oef::pb::Envelope::PayloadCase c) { return *durations[size_t(c)]; }
+    };
+
+    // Bounds of the messages waiting to be sent to each agent. A message for an agent whose queue is full is
+    // dropped, and its sender gets a dialogue error, or the sender is not read until the queue drains to half
+    // its limits, or the agent is disconnected. Answers to an agent's own requests are never dropped: an
+    // agent whose queue is full is not read until it drains. An agent that does not take a message within
+    // writeTimeout seconds (0 for no limit) is disconnected. An agent not heard from for half idleTimeout
+    // seconds is pinged, and disconnected after the whole (0 for never, the default: agents built before
+    // pings do not answer them).
+    struct SessionLimits {
+      enum class Overflow { Drop, Pause, Disconnect };
+      size_t bytes = size_t(4) << 20;
+      size_t messages = 1024;
+      Overflow overflow = Overflow::Drop;
+      uint32_t writeTimeout = 30;
+      uint32_t idleTimeout = 0;
+
+      // Sets overflow from drop, pause or disconnect.
+      static bool parse(const std::string &name, Overflow &overflow);
+    };
+
     class Server {
     private:
       struct Context {
         tcp::socket socket_;
+        std::chrono::steady_clock::time_point start_ = std::chrono::steady_clock::now();
       explicit Context(tcp::socket socket) : socket_{std::move(socket)} {}
       };
       
@@ -39,6 +86,11 @@ namespace fetch {
       tcp::acceptor acceptor_;
       AgentDirectory agentDirectory_;
       ServiceDirectory serviceDirectory_;
+      DataModelRegistry dataModels_;
+      Metrics metrics_;
+      NodeMetrics nodeMetrics_;
+      const SessionLimits limits_;
+      std::unique_ptr<MetricsEndpoint> metricsEndpoint_;
 
       static fetch::oef::Logger logger;
 
@@ -46,11 +98,9 @@ namespace fetch {
       void newSession(tcp::socket socket);
       void do_accept();
     public:
-      explicit Server(uint32_t nbThreads = 4, uint32_t backlog = 256) :
-      acceptor_(io_context_, tcp::endpoint(tcp::v4(), static_cast<int>(Ports::Agents))) {
-        acceptor_.listen(backlog); // pending connections
-        threads_.resize(nbThreads);
-      }
+      // metricsPort is the local port the metrics are served on, 0 for none.
+      explicit Server(uint32_t nbThreads = 4, uint32_t backlog = 256, uint16_t metricsPort = 0,
+                      const SessionLimits &limits = SessionLimits{});
 
       Server(const Server &) = delete;
       Server operator=(const Server &) = delete;
@@ -58,6 +108,11 @@ namespace fetch {
       void run();
       void run_in_thread();
       size_t nbAgents() const { return agentDirectory_.size(); }
+      // JSON statistics of the registered descriptions and services, per data model and attribute.
+      std::string statistics() const {
+        return "{\"agents\":" + agentDirectory_.statistics() + ",\"services\":" + serviceDirectory_.statistics() + "}";
+      }
+      const Metrics &metrics() const { return metrics_; }
       void stop();
     };
   }
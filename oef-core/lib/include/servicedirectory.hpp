@@ -18,10 +18,13 @@
 //------------------------------------------------------------------------------
 
 #include "schema.hpp"
+#include "columns.hpp"
+#include "statistics.hpp"
 
 #include <unordered_map>
 #include <set>
 #include <unordered_set>
+#include <memory>
 #include <mutex>
 
 namespace fetch {
@@ -44,6 +47,9 @@ namespace fetch {
       bool erase(const std::string &agent) {
         return agents_.erase(agent) == 1;
       }
+      bool contains(const std::string &agent) const {
+        return agents_.find(agent) != agents_.end();
+      }
       size_t size() const {
         return agents_.size();
       }
@@ -52,48 +58,409 @@ namespace fetch {
       }
     };
 
+    // Instances of a data model by value of their string and int attributes.
+    // A top level IN or = constraint on such an attribute is answered by probing it for each value
+    // of the constraint (a hash join) instead of checking every instance of the model.
+    template <typename Entry>
+    class ValueIndex {
+    private:
+      using Entries = std::unordered_set<const Entry*>;
+      // attribute -> value key -> entries
+      std::unordered_map<std::string,std::unordered_map<std::string,Entries>> attributes_;
+
+      static std::string key(const std::string &s) { return "s" + s; }
+      static std::string key(int64_t i) { return "i" + std::to_string(i); }
+      static stde::optional<std::string> key(const fetch::oef::pb::Query_Value &value) {
+        switch(value.value_case()) {
+        case fetch::oef::pb::Query_Value::kS:
+          return key(value.s());
+        case fetch::oef::pb::Query_Value::kI:
+          return key(value.i());
+        default:
+          return stde::nullopt;
+        }
+      }
+      // Keys of the values a top level constraint accepts, if they can be probed.
+      static bool keys(const fetch::oef::pb::Query_ConstraintExpr_Constraint &constraint, std::vector<std::string> &res) {
+        if(constraint.has_set_() && constraint.set_().op() == fetch::oef::pb::Query_Set_Operator_IN) {
+          const auto &vals = constraint.set_().vals();
+          if(vals.has_s()) {
+            for(auto &v : vals.s().vals()) {
+              res.emplace_back(key(v));
+            }
+            return true;
+          }
+          if(vals.has_i()) {
+            for(auto v : vals.i().vals()) {
+              res.emplace_back(key(v));
+            }
+            return true;
+          }
+        }
+        if(constraint.has_relation() && constraint.relation().op() == fetch::oef::pb::Query_Relation_Operator_EQ) {
+          auto k = key(constraint.relation().val());
+          if(k) {
+            res.emplace_back(std::move(*k));
+            return true;
+          }
+        }
+        return false;
+      }
+      void add(const Entry &entry, const fetch::oef::pb::Query_KeyValue &kv) {
+        auto k = key(kv.value());
+        if(k) {
+          attributes_[kv.key()][*k].insert(&entry);
+        }
+      }
+      void remove(const Entry &entry, const fetch::oef::pb::Query_KeyValue &kv) {
+        auto k = key(kv.value());
+        if(!k) {
+          return;
+        }
+        auto att = attributes_.find(kv.key());
+        if(att == attributes_.end()) {
+          return;
+        }
+        auto values = att->second.find(*k);
+        if(values != att->second.end()) {
+          values->second.erase(&entry);
+          if(values->second.empty()) {
+            att->second.erase(values);
+            if(att->second.empty()) {
+              attributes_.erase(att);
+            }
+          }
+        }
+      }
+    public:
+      void add(const Entry &entry) {
+        for(auto &kv : entry.first.valuesHandle().values()) {
+          add(entry, kv);
+        }
+      }
+      void remove(const Entry &entry) {
+        for(auto &kv : entry.first.valuesHandle().values()) {
+          remove(entry, kv);
+        }
+      }
+      // entry was updated in place from before: only the attributes in changed are re-indexed.
+      void update(const Entry &entry, const Instance &before, const std::set<std::string> &changed) {
+        for(auto &kv : before.valuesHandle().values()) {
+          if(changed.count(kv.key())) {
+            remove(entry, kv);
+          }
+        }
+        for(auto &kv : entry.first.valuesHandle().values()) {
+          if(changed.count(kv.key())) {
+            add(entry, kv);
+          }
+        }
+      }
+      // Candidates for query, a superset of the matching entries, from its most selective probeable constraint.
+      // Returns false when no constraint gives fewer than limit candidates: scanning is then as good.
+      bool probe(const QueryModel &query, size_t limit, Entries &res) const {
+        std::vector<const Entries*> best, current;
+        size_t best_size = limit;
+        bool found = false;
+        std::vector<std::string> ks;
+        for(auto &c : query.handle().constraints()) {
+          ks.clear();
+          if(!c.has_constraint() || !keys(c.constraint(), ks)) {
+            continue;
+          }
+          current.clear();
+          size_t size = 0;
+          auto att = attributes_.find(c.constraint().attribute_name());
+          if(att != attributes_.end()) {
+            for(auto &k : ks) {
+              auto values = att->second.find(k);
+              if(values != att->second.end()) {
+                current.push_back(&values->second);
+                size += values->second.size();
+              }
+            }
+          }
+          if(size < best_size) {
+            best.swap(current);
+            best_size = size;
+            found = true;
+          }
+        }
+        if(!found) {
+          return false;
+        }
+        res.reserve(best_size);
+        for(auto *entries : best) {
+          res.insert(entries->begin(), entries->end());
+        }
+        return true;
+      }
+    };
+
     class ServiceDirectory {
     private:
+      // An instance and the agents that registered it. A row stays where it is until it is removed, as the
+      // indexes point to it: an update re-keys it in place instead of replacing it.
+      struct Row {
+        Instance first;
+        Agents second;
+      };
+      // Rows are keyed by their instance; an update finds its row by the instance's fingerprint alone.
+      struct Key {
+        const Fingerprint *fingerprint;
+        const Instance *instance; // nullptr for a lookup by fingerprint
+        explicit Key(const Instance &i) : fingerprint{&i.fingerprint()}, instance{&i} {}
+        explicit Key(const Fingerprint &f) : fingerprint{&f}, instance{nullptr} {}
+        bool operator==(const Key &other) const {
+          return instance && other.instance ? *instance == *other.instance : *fingerprint == *other.fingerprint;
+        }
+      };
+      struct KeyHash {
+        size_t operator()(const Key &key) const { return key.fingerprint->hash(); }
+      };
+      using Instances = std::unordered_map<Key,std::unique_ptr<Row>,KeyHash>;
+      struct Table {
+        Instances instances;
+        ValueIndex<Row> index;
+        Columns<Row> columns;
+        DataModelStatistics statistics;
+
+        void add(const Row &entry) {
+          index.add(entry);
+          columns.add(entry);
+          statistics.add(entry.first);
+        }
+        void remove(const Row &entry) {
+          index.remove(entry);
+          columns.remove(entry);
+          statistics.remove(entry.first);
+        }
+        // To be called once entries have been added to or removed from instances.
+        void refresh() {
+          if(statistics.stale()) {
+            statistics.rebuild(instances.begin(), instances.end(),
+                               [](const Instances::value_type &e) -> const Instance& { return e.second->first; });
+          }
+        }
+      };
       mutable std::mutex lock_;
-      std::unordered_map<Instance,Agents> data_;
+      // instances are partitioned by data model name, so that a query on a model only visits that model.
+      std::unordered_map<std::string,Table> data_;
+      size_t size_ = 0;
+
+      // Neither lock nor refresh table: left to the callers, which may batch several calls.
+      bool add(Table &table, const Instance &instance, const std::string &agent) {
+        auto iter = table.instances.find(Key{instance});
+        if(iter == table.instances.end()) {
+          std::unique_ptr<Row> row{new Row{instance, Agents{}}};
+          Key key{row->first};
+          iter = table.instances.emplace(key, std::move(row)).first;
+          table.add(*iter->second);
+          ++size_;
+        }
+        return iter->second->second.insert(agent);
+      }
+      bool remove(Table &table, const Instance &instance, const std::string &agent) {
+        auto &instances = table.instances;
+        auto iter = instances.find(Key{instance});
+        if(iter == instances.end())
+          return false;
+        bool res = iter->second->second.erase(agent);
+        if(iter->second->second.size() == 0) {
+          table.remove(*iter->second);
+          instances.erase(iter);
+          --size_;
+        }
+        return res;
+      }
+      void query(const Table &table, const QueryModel &query, std::unordered_set<std::string> &res) const {
+        std::unordered_set<const Row*> candidates;
+        if(table.index.probe(query, table.instances.size(), candidates)) {
+          for(auto *d : candidates) {
+            if(query.check(d->first)) {
+              d->second.copy(res);
+            }
+          }
+          return;
+        }
+        auto &columns = table.columns;
+        columns.evaluate(query).forEach([&columns,&res](size_t i) {
+            columns.row(i).second.copy(res);
+          });
+      }
     public:
       explicit ServiceDirectory() = default;
+      ServiceDirectory(const ServiceDirectory &) = delete;
+      ServiceDirectory operator=(const ServiceDirectory &) = delete;
       bool registerAgent(const Instance &instance, const std::string &agent) {
         std::lock_guard<std::mutex> lock(lock_);
-        return data_[instance].insert(agent);
+        auto &table = data_[instance.model().name()];
+        bool res = add(table, instance, agent);
+        table.refresh();
+        return res;
       }
       bool unregisterAgent(const Instance &instance, const std::string &agent) {
         std::lock_guard<std::mutex> lock(lock_);
-        auto iter = data_.find(instance);
-        if(iter == data_.end())
+        auto table = data_.find(instance.model().name());
+        if(table == data_.end())
           return false;
-        bool res = iter->second.erase(agent);
-        if(iter->second.size() == 0) {
-          data_.erase(instance);
+        bool res = remove(table->second, instance, agent);
+        if(table->second.instances.empty()) {
+          data_.erase(table);
+        } else {
+          table->second.refresh();
+        }
+        return res;
+      }
+      // Bulk versions of the above: a single lock acquisition, and the statistics of each data model
+      // are refreshed once for the whole batch. Item i of the result is the result for instances[i].
+      std::vector<bool> registerAgent(const std::vector<Instance> &instances, const std::string &agent) {
+        std::vector<bool> res;
+        res.reserve(instances.size());
+        std::unordered_set<Table*> tables;
+        std::lock_guard<std::mutex> lock(lock_);
+        for(auto &instance : instances) {
+          auto &table = data_[instance.model().name()];
+          res.push_back(add(table, instance, agent));
+          tables.insert(&table);
+        }
+        for(auto *table : tables) {
+          table->refresh();
         }
         return res;
       }
+      std::vector<bool> unregisterAgent(const std::vector<Instance> &instances, const std::string &agent) {
+        std::vector<bool> res;
+        res.reserve(instances.size());
+        std::unordered_set<std::string> tables;
+        std::lock_guard<std::mutex> lock(lock_);
+        for(auto &instance : instances) {
+          auto table = data_.find(instance.model().name());
+          if(table == data_.end()) {
+            res.push_back(false);
+            continue;
+          }
+          res.push_back(remove(table->second, instance, agent));
+          tables.insert(table->first);
+        }
+        for(auto &name : tables) {
+          auto table = data_.find(name);
+          if(table->second.instances.empty()) {
+            data_.erase(table);
+          } else {
+            table->second.refresh();
+          }
+        }
+        return res;
+      }
+      // Sets values and removes the removed attributes of the service of data model model, with fingerprint service,
+      // that agent registered, re-indexing only the attributes whose value changed. Returns the updated instance,
+      // or nullopt if agent did not register such a service. Throws std::invalid_argument, and changes nothing,
+      // if the update does not fit the data model.
+      // The service is only known by its fingerprint: on a collision, the update may find a row of another agent,
+      // and fails.
+      stde::optional<Instance> update(const std::string &model, const Fingerprint &modelFingerprint,
+                                      const Fingerprint &service, const std::string &agent,
+                                      const google::protobuf::RepeatedPtrField<fetch::oef::pb::Query_KeyValue> &values,
+                                      const google::protobuf::RepeatedPtrField<std::string> &removed) {
+        std::lock_guard<std::mutex> lock(lock_);
+        auto table = data_.find(model);
+        if(table == data_.end())
+          return stde::nullopt;
+        auto &instances = table->second.instances;
+        auto iter = instances.find(Key{service});
+        if(iter == instances.end() || iter->second->first.dataModel().fingerprint() != modelFingerprint
+           || !iter->second->second.contains(agent))
+          return stde::nullopt;
+        Instance updated = iter->second->first;
+        auto changed = updated.update(values, removed);
+        if(changed.empty())
+          return updated;
+        if(iter->second->second.size() > 1 || instances.find(Key{updated}) != instances.end()) {
+          // other agents keep the current instance, or agent already has the updated one.
+          remove(table->second, iter->second->first, agent);
+          add(table->second, updated, agent);
+          table->second.refresh();
+          return updated;
+        }
+        auto row = std::move(iter->second);
+        instances.erase(iter);
+        std::swap(row->first, updated); // updated now holds the previous values.
+        table->second.index.update(*row, updated, changed);
+        table->second.columns.update(*row, changed);
+        table->second.statistics.update(updated, row->first, changed);
+        const Instance &res = row->first;
+        instances.emplace(Key{res}, std::move(row));
+        table->second.refresh();
+        return res;
+      }
+      stde::optional<Instance> update(const Instance &instance, const std::string &agent,
+                                      const google::protobuf::RepeatedPtrField<fetch::oef::pb::Query_KeyValue> &values,
+                                      const google::protobuf::RepeatedPtrField<std::string> &removed) {
+        return update(instance.model().name(), instance.dataModel().fingerprint(), instance.fingerprint(), agent, values,
+                      removed);
+      }
       void unregisterAll(const std::string &agent) {
         std::lock_guard<std::mutex> lock(lock_);
-        for(auto iter = data_.begin(); iter != data_.end();) {
-          iter->second.erase(agent);
-          if(iter->second.size() == 0) {
-            iter = data_.erase(iter);
+        for(auto table = data_.begin(); table != data_.end();) {
+          auto &instances = table->second.instances;
+          for(auto iter = instances.begin(); iter != instances.end();) {
+            iter->second->second.erase(agent);
+            if(iter->second->second.size() == 0) {
+              table->second.remove(*iter->second);
+              iter = instances.erase(iter);
+              --size_;
+            } else {
+              ++iter;
+            }
+          }
+          if(instances.empty()) {
+            table = data_.erase(table);
           } else {
-            ++iter;
+            table->second.refresh();
+            ++table;
           }
         }
       }
       size_t size() const {
         std::lock_guard<std::mutex> lock(lock_);
-        return data_.size();
+        return size_;
+      }
+      // Optimises a valid query, with the statistics of the instances of its data model if it has one.
+      void optimise(QueryModel &query, const DataModel *model = nullptr) const {
+        std::lock_guard<std::mutex> lock(lock_);
+        const DataModelStatistics *statistics = nullptr;
+        if(query.handle().has_model()) {
+          auto table = data_.find(query.handle().model().name());
+          if(table != data_.end()) {
+            statistics = &table->second.statistics;
+          }
+        }
+        query.optimise(model, statistics);
+      }
+      // JSON object of the statistics of each data model.
+      std::string statistics() const {
+        std::lock_guard<std::mutex> lock(lock_);
+        std::string res = "{";
+        for(auto &table : data_) {
+          if(res.size() > 1) {
+            res += ",";
+          }
+          res += DataModelStatistics::quoted(table.first) + ":" + table.second.statistics.json();
+        }
+        return res + "}";
       }
       std::vector<std::string> query(const QueryModel &query) const {
         std::lock_guard<std::mutex> lock(lock_);
         std::unordered_set<std::string> res;
-        for(auto &d : data_) {
-          if(query.check(d.first)) {
-            d.second.copy(res);
+        if(query.handle().has_model()) {
+          auto table = data_.find(query.handle().model().name());
+          if(table != data_.end()) {
+            this->query(table->second, query, res);
+          }
+        } else {
+          for(auto &table : data_) {
+            this->query(table.second, query, res);
           }
         }
         return std::vector<std::string>(res.begin(), res.end());
@@ -0,0 +1,389 @@
+#pragma once
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include "schema.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <set>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+
+namespace fetch {
+  namespace oef {
+    // Distinct count sketch: 2^10 registers, about 3% standard error.
+    class HyperLogLog {
+    private:
+      static constexpr size_t bits = 10;
+      static constexpr size_t m = size_t(1) << bits;
+      std::array<uint8_t,m> registers_{};
+    public:
+      void add(uint64_t hash) {
+        size_t index = hash >> (64 - bits);
+        uint64_t rest = hash << bits;
+        auto rank = uint8_t(rest ? __builtin_clzll(rest) + 1 : 64 - bits + 1);
+        registers_[index] = std::max(registers_[index], rank);
+      }
+      double estimate() const {
+        double sum = 0.0;
+        size_t zeros = 0;
+        for(auto r : registers_) {
+          sum += std::ldexp(1.0, -int(r));
+          zeros += r == 0;
+        }
+        double e = 0.7213 / (1.0 + 1.079 / m) * m * m / sum;
+        if(e <= 2.5 * m && zeros > 0) { // small range correction: linear counting.
+          e = m * std::log(double(m) / zeros);
+        }
+        return e;
+      }
+      void clear() {
+        registers_.fill(0);
+      }
+    };
+
+    // Equi-depth histogram: bounds are chosen when built, and counts are kept up to date in between.
+    class Histogram {
+    private:
+      std::vector<double> bounds_; // bucket i is [bounds_[i], bounds_[i + 1]]
+      std::vector<size_t> counts_;
+      size_t total_ = 0;
+
+      size_t bucket(double v) const {
+        auto iter = std::upper_bound(bounds_.begin(), bounds_.end(), v);
+        size_t i = iter == bounds_.begin() ? 0 : size_t(iter - bounds_.begin()) - 1;
+        return std::min(i, counts_.size() - 1);
+      }
+    public:
+      static constexpr size_t buckets = 32;
+      void build(std::vector<double> values) {
+        bounds_.clear();
+        counts_.clear();
+        total_ = 0;
+        values.erase(std::remove_if(values.begin(), values.end(), [](double v) { return std::isnan(v); }), values.end());
+        if(values.empty()) {
+          return;
+        }
+        std::sort(values.begin(), values.end());
+        size_t n = values.size() < buckets ? values.size() : buckets;
+        bounds_.push_back(values.front());
+        size_t begin = 0;
+        for(size_t i = 1; i <= n; ++i) {
+          size_t end = i * values.size() / n;
+          bounds_.push_back(values[end - 1]);
+          counts_.push_back(end - begin);
+          begin = end;
+        }
+        total_ = values.size();
+      }
+      void add(double v) {
+        if(counts_.empty() || std::isnan(v)) {
+          return;
+        }
+        bounds_.front() = std::min(bounds_.front(), v);
+        bounds_.back() = std::max(bounds_.back(), v);
+        ++counts_[bucket(v)];
+        ++total_;
+      }
+      void remove(double v) {
+        if(counts_.empty() || std::isnan(v)) {
+          return;
+        }
+        auto &c = counts_[bucket(v)];
+        if(c > 0) {
+          --c;
+          --total_;
+        }
+      }
+      bool empty() const { return total_ == 0; }
+      // Estimated fraction of the values in [lo, hi], interpolating linearly inside buckets.
+      double fraction(double lo, double hi) const {
+        if(total_ == 0 || !(lo <= hi)) {
+          return 0.0;
+        }
+        double res = 0.0;
+        for(size_t i = 0; i < counts_.size(); ++i) {
+          double b = bounds_[i], e = bounds_[i + 1];
+          if(hi < b || lo > e) {
+            continue;
+          }
+          double width = e - b;
+          double covered = width > 0 ? (std::min(hi, e) - std::max(lo, b)) / width : 1.0;
+          res += counts_[i] * covered;
+        }
+        return std::min(res / total_, 1.0);
+      }
+      const std::vector<double> &bounds() const { return bounds_; }
+    };
+
+    // Statistics of the instances of one data model: null fraction, distinct count and, for numeric
+    // attributes, value distribution of each attribute. Updated on every add and remove; distinct counts
+    // cannot forget removed values and bounds drift, so the owner rebuilds them from its instances once
+    // stale(), which amortises to a constant cost per update.
+    class DataModelStatistics {
+    private:
+      struct Attribute {
+        size_t present = 0;
+        HyperLogLog distinct;
+        Histogram histogram;
+        std::vector<double> values; // only while rebuilding
+      };
+      size_t rows_ = 0;
+      size_t changes_ = 0;
+      bool rebuilding_ = false;
+      std::unordered_map<std::string,Attribute> attributes_;
+
+      static bool numeric(const fetch::oef::pb::Query_Value &value, double &v) {
+        switch(value.value_case()) {
+        case fetch::oef::pb::Query_Value::kI:
+          v = double(value.i());
+          return true;
+        case fetch::oef::pb::Query_Value::kD:
+          v = value.d();
+          return true;
+        default:
+          return false;
+        }
+      }
+      static uint64_t hash(const fetch::oef::pb::Query_Value &value) {
+        Fingerprint fp;
+        fp.add(value);
+        return fp.hash();
+      }
+      void add(const fetch::oef::pb::Query_KeyValue &kv) {
+        if(kv.value().value_case() == fetch::oef::pb::Query_Value::VALUE_NOT_SET) {
+          return;
+        }
+        auto &a = attributes_[kv.key()];
+        ++a.present;
+        a.distinct.add(hash(kv.value()));
+        double v;
+        if(numeric(kv.value(), v)) {
+          if(rebuilding_) {
+            a.values.push_back(v);
+          } else {
+            a.histogram.add(v);
+          }
+        }
+      }
+      void remove(const fetch::oef::pb::Query_KeyValue &kv) {
+        auto iter = attributes_.find(kv.key());
+        if(iter == attributes_.end() || kv.value().value_case() == fetch::oef::pb::Query_Value::VALUE_NOT_SET) {
+          return;
+        }
+        auto &a = iter->second;
+        if(a.present > 0) {
+          --a.present;
+        }
+        double v;
+        if(numeric(kv.value(), v)) {
+          a.histogram.remove(v);
+        }
+        if(a.present == 0) {
+          attributes_.erase(iter);
+        }
+      }
+      const Attribute *attribute(const std::string &name) const {
+        auto iter = attributes_.find(name);
+        return iter == attributes_.end() ? nullptr : &iter->second;
+      }
+      // Fraction of the rows whose attribute value is in [lo, hi].
+      double between(const Attribute &a, double lo, double hi, double otherwise) const {
+        double present = double(a.present) / rows_;
+        if(a.histogram.empty()) {
+          return present * otherwise;
+        }
+        return present * a.histogram.fraction(lo, hi);
+      }
+    public:
+      // s as a JSON string (RFC 8259): quotes, backslashes and control characters are escaped.
+      static std::string quoted(const std::string &s) {
+        static const char *hex = "0123456789abcdef";
+        std::string res = "\"";
+        for(char c : s) {
+          switch(c) {
+          case '"': res += "\\\""; break;
+          case '\\': res += "\\\\"; break;
+          case '\b': res += "\\b"; break;
+          case '\f': res += "\\f"; break;
+          case '\n': res += "\\n"; break;
+          case '\r': res += "\\r"; break;
+          case '\t': res += "\\t"; break;
+          default:
+            if(static_cast<unsigned char>(c) < 0x20) {
+              res += "\\u00";
+              res += hex[c >> 4];
+              res += hex[c & 0xf];
+            } else {
+              res += c;
+            }
+          }
+        }
+        return res + "\"";
+      }
+      // v as a JSON number, or null as JSON has no infinities nor NaN.
+      static std::string number(double v) {
+        if(!std::isfinite(v)) {
+          return "null";
+        }
+        std::ostringstream os;
+        os << v;
+        return os.str();
+      }
+      void add(const Instance &instance) {
+        ++rows_;
+        ++changes_;
+        for(auto &kv : instance.valuesHandle().values()) {
+          add(kv);
+        }
+      }
+      void remove(const Instance &instance) {
+        if(rows_ == 0) {
+          return;
+        }
+        --rows_;
+        ++changes_;
+        for(auto &kv : instance.valuesHandle().values()) {
+          remove(kv);
+        }
+      }
+      // An instance was updated from before to after: only the attributes in changed differ.
+      void update(const Instance &before, const Instance &after, const std::set<std::string> &changed) {
+        ++changes_;
+        for(auto &kv : before.valuesHandle().values()) {
+          if(changed.count(kv.key())) {
+            remove(kv);
+          }
+        }
+        for(auto &kv : after.valuesHandle().values()) {
+          if(changed.count(kv.key())) {
+            add(kv);
+          }
+        }
+      }
+      bool stale() const {
+        return changes_ > std::max<size_t>(16, rows_);
+      }
+      // instance(*iter) is the Instance of each element of [begin, end).
+      template <typename Iterator, typename Get>
+      void rebuild(Iterator begin, Iterator end, Get &&instance) {
+        attributes_.clear();
+        rows_ = 0;
+        rebuilding_ = true;
+        for(auto iter = begin; iter != end; ++iter) {
+          add(instance(*iter));
+        }
+        rebuilding_ = false;
+        for(auto &a : attributes_) {
+          a.second.histogram.build(std::move(a.second.values));
+          a.second.values = {};
+        }
+        changes_ = 0;
+      }
+      size_t rows() const { return rows_; }
+      double nullFraction(const std::string &name) const {
+        if(rows_ == 0) {
+          return 0.0;
+        }
+        const auto *a = attribute(name);
+        return a ? 1.0 - double(a->present) / rows_ : 1.0;
+      }
+      double distinct(const std::string &name) const {
+        const auto *a = attribute(name);
+        if(!a) {
+          return 0.0;
+        }
+        return std::max(1.0, std::min(a->distinct.estimate(), double(a->present)));
+      }
+      // Estimated fraction of the rows matching constraint.
+      double selectivity(const fetch::oef::pb::Query_ConstraintExpr_Constraint &constraint) const {
+        const auto *a = attribute(constraint.attribute_name());
+        if(rows_ == 0 || !a) {
+          return 0.0;
+        }
+        double present = double(a->present) / rows_;
+        double eq = present / distinct(constraint.attribute_name());
+        const double inf = std::numeric_limits<double>::infinity();
+        switch(constraint.constraint_case()) {
+        case fetch::oef::pb::Query_ConstraintExpr_Constraint::kRelation: {
+          const auto &rel = constraint.relation();
+          double v;
+          bool num = numeric(rel.val(), v);
+          switch(rel.op()) {
+          case fetch::oef::pb::Query_Relation_Operator_EQ: return eq;
+          case fetch::oef::pb::Query_Relation_Operator_NOTEQ: return present - eq;
+          case fetch::oef::pb::Query_Relation_Operator_LT:
+          case fetch::oef::pb::Query_Relation_Operator_LTEQ:
+            return num ? between(*a, -inf, v, 0.35) : present * 0.35;
+          case fetch::oef::pb::Query_Relation_Operator_GT:
+          case fetch::oef::pb::Query_Relation_Operator_GTEQ:
+            return num ? between(*a, v, inf, 0.35) : present * 0.35;
+          }
+          return present * 0.35;
+        }
+        case fetch::oef::pb::Query_ConstraintExpr_Constraint::kRange: {
+          const auto &range = constraint.range_();
+          if(range.has_i()) {
+            return between(*a, double(range.i().first()), double(range.i().second()), 0.25);
+          }
+          if(range.has_d()) {
+            return between(*a, range.d().first(), range.d().second(), 0.25);
+          }
+          return present * 0.25;
+        }
+        case fetch::oef::pb::Query_ConstraintExpr_Constraint::kSet: {
+          const auto &v = constraint.set_().vals();
+          size_t n = v.i().vals_size() + v.d().vals_size() + v.s().vals_size() + v.b().vals_size() + v.l().vals_size();
+          double in = std::min(present, n * eq);
+          return constraint.set_().op() == fetch::oef::pb::Query_Set_Operator_IN ? in : present - in;
+        }
+        case fetch::oef::pb::Query_ConstraintExpr_Constraint::kDistance:
+          return present * 0.2;
+        default:
+          return present * 0.5;
+        }
+      }
+      // JSON object, for the node's statistics.
+      std::string json() const {
+        std::ostringstream os;
+        os << "{\"rows\":" << rows_ << ",\"attributes\":{";
+        bool first = true;
+        for(auto &a : attributes_) {
+          os << (first ? "" : ",") << quoted(a.first) << ":{\"null_fraction\":" << nullFraction(a.first)
+             << ",\"distinct\":" << std::llround(distinct(a.first));
+          if(!a.second.histogram.empty()) {
+            os << ",\"histogram\":[";
+            const auto &bounds = a.second.histogram.bounds();
+            for(size_t i = 0; i < bounds.size(); ++i) {
+              os << (i ? "," : "") << number(bounds[i]);
+            }
+            os << "]";
+          }
+          os << "}";
+          first = false;
+        }
+        os << "}}";
+        return os.str();
+      }
+    };
+  }
+}
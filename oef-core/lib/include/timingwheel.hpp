@@ -0,0 +1,88 @@
+#pragma once
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+
+#include "asio.hpp"
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace fetch {
+  namespace oef {
+    // Deadlines of an io_context's operations, in a hashed timing wheel: starting and completing one takes an
+    // uncontended lock and no asio timer, and a single timer ticks, only while deadlines are pending. Completed
+    // deadlines are dropped when the wheel reaches their slot, so they cost nothing to cancel.
+    // One per io_context: asio::use_service<TimingWheel>(io_context).
+    class TimingWheel : public asio::io_context::service {
+    public:
+      static constexpr std::chrono::milliseconds tick{250};
+      static constexpr size_t slots = 256; // a turn of 64s
+
+      class Deadline {
+      private:
+        enum class State { Pending, Done, Expired };
+        std::mutex lock_;
+        State state_ = State::Pending;
+        std::function<void()> expire_;
+        size_t rounds_; // turns of the wheel left
+        friend class TimingWheel;
+      public:
+        Deadline(std::function<void()> expire, size_t rounds) : expire_{std::move(expire)}, rounds_{rounds} {}
+        // Returns false if the deadline expired first.
+        bool complete() {
+          std::lock_guard<std::mutex> lock(lock_);
+          if(state_ == State::Expired) {
+            return false;
+          }
+          state_ = State::Done;
+          expire_ = nullptr;
+          return true;
+        }
+      };
+
+      static asio::io_context::id id;
+
+      explicit TimingWheel(asio::io_context &io_context);
+      TimingWheel(const TimingWheel &) = delete;
+      TimingWheel operator=(const TimingWheel &) = delete;
+      // Calls expire on one of the io_context's threads once seconds have elapsed (up to a tick later), unless
+      // the deadline is completed first. expire runs with the deadline locked: completing it waits for expire.
+      std::shared_ptr<Deadline> start(uint32_t seconds, std::function<void()> expire);
+      size_t size() const {
+        std::lock_guard<std::mutex> lock(lock_);
+        return size_;
+      }
+    private:
+      mutable std::mutex lock_;
+      asio::steady_timer timer_;
+      std::chrono::steady_clock::time_point next_;
+      std::vector<std::vector<std::shared_ptr<Deadline>>> wheel_;
+      size_t cursor_ = 0;
+      size_t size_ = 0; // deadlines in the wheel, including completed ones
+      bool ticking_ = false;
+
+      void shutdown() override;
+      void schedule(); // called with lock_ held
+      void advance();
+    };
+  }
+}
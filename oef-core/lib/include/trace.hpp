@@ -0,0 +1,71 @@
+#pragma once
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include "agent.pb.h"
+#include "logger.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <string>
+
+namespace fetch {
+  namespace oef {
+    // Samples the messages this process sends and writes the traces it sees, one JSON object per line.
+    // Off until configured: checking whether to sample is then a single relaxed load.
+    class Tracer {
+    private:
+      std::atomic<uint32_t> period_{0};
+      std::atomic<uint64_t> count_{0};
+      uint64_t prefix_; // high bits of the ids, random per process
+      std::mutex lock_;
+      std::ofstream file_;
+
+      static fetch::oef::Logger logger;
+
+      Tracer();
+    public:
+      static Tracer &instance();
+      static uint64_t now() {
+        return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+      }
+      // Traces one in period messages sent from this process (0 for none) and appends the traces it
+      // completes or forwards to path (empty for none). Returns false if path cannot be opened.
+      bool configure(uint32_t period, const std::string &path);
+      // Starts a trace on env if it is a message and is sampled.
+      void start(fetch::oef::pb::Envelope &env) {
+        auto period = period_.load(std::memory_order_relaxed);
+        if(period == 0 || !env.has_send_message()) {
+          return;
+        }
+        auto n = count_.fetch_add(1, std::memory_order_relaxed);
+        if(n % period != 0) {
+          return;
+        }
+        auto *trace = env.mutable_trace();
+        trace->set_id(prefix_ | (n & 0xffffffffu));
+        trace->set_client_send(now());
+      }
+      // Writes trace, as seen by hop (node or agent name).
+      void write(const fetch::oef::pb::Trace &trace, const std::string &hop);
+    };
+  }
+}
@@ -0,0 +1,258 @@
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include "columns.hpp"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace fetch {
+  namespace oef {
+    namespace kernels {
+      namespace {
+        template <typename T>
+        bool compare1(T x, Cmp op, T v) {
+          switch(op) {
+          case Cmp::Eq: return x == v;
+          case Cmp::NotEq: return x != v;
+          case Cmp::Lt: return x < v;
+          case Cmp::LtEq: return x <= v;
+          case Cmp::Gt: return x > v;
+          case Cmp::GtEq: return x >= v;
+          }
+          return false;
+        }
+        // Rows from begin to n one by one, begin being a multiple of 64.
+        template <typename F>
+        void tail(size_t begin, size_t n, uint64_t *out, F &&f) {
+          for(size_t w = begin / 64; w * 64 < n; ++w) {
+            uint64_t bits = 0;
+            for(size_t i = w * 64; i < n && i < (w + 1) * 64; ++i) {
+              bits |= uint64_t(f(i)) << (i - w * 64);
+            }
+            out[w] = bits;
+          }
+        }
+
+#if defined(__AVX2__)
+        constexpr size_t ints = 8, doubles = 4;
+        using IVec = __m256i;
+        using DVec = __m256d;
+        inline IVec iload(const int32_t *p) { return _mm256_loadu_si256(reinterpret_cast<const IVec*>(p)); }
+        inline IVec iset(int32_t v) { return _mm256_set1_epi32(v); }
+        inline IVec igt(IVec a, IVec b) { return _mm256_cmpgt_epi32(a, b); }
+        inline IVec ieq(IVec a, IVec b) { return _mm256_cmpeq_epi32(a, b); }
+        inline IVec ior(IVec a, IVec b) { return _mm256_or_si256(a, b); }
+        inline IVec iandnot(IVec a, IVec b) { return _mm256_andnot_si256(a, b); } // ~a & b
+        inline uint64_t imask(IVec m) { return uint64_t(_mm256_movemask_ps(_mm256_castsi256_ps(m))); }
+        inline DVec dload(const double *p) { return _mm256_loadu_pd(p); }
+        inline DVec dset(double v) { return _mm256_set1_pd(v); }
+        inline DVec dadd(DVec a, DVec b) { return _mm256_add_pd(a, b); }
+        inline DVec dsub(DVec a, DVec b) { return _mm256_sub_pd(a, b); }
+        inline DVec dmul(DVec a, DVec b) { return _mm256_mul_pd(a, b); }
+        inline DVec dand(DVec a, DVec b) { return _mm256_and_pd(a, b); }
+        inline DVec dcmp(DVec a, Cmp op, DVec b) {
+          switch(op) {
+          case Cmp::Eq: return _mm256_cmp_pd(a, b, _CMP_EQ_OQ);
+          case Cmp::NotEq: return _mm256_cmp_pd(a, b, _CMP_NEQ_UQ);
+          case Cmp::Lt: return _mm256_cmp_pd(a, b, _CMP_LT_OQ);
+          case Cmp::LtEq: return _mm256_cmp_pd(a, b, _CMP_LE_OQ);
+          case Cmp::Gt: return _mm256_cmp_pd(a, b, _CMP_GT_OQ);
+          case Cmp::GtEq: return _mm256_cmp_pd(a, b, _CMP_GE_OQ);
+          }
+          return _mm256_setzero_pd();
+        }
+        inline uint64_t dmask(DVec m) { return uint64_t(_mm256_movemask_pd(m)); }
+#define OEF_SIMD_KERNELS 1
+        const char *const name = "avx2";
+#elif defined(__SSE2__)
+        constexpr size_t ints = 4, doubles = 2;
+        using IVec = __m128i;
+        using DVec = __m128d;
+        inline IVec iload(const int32_t *p) { return _mm_loadu_si128(reinterpret_cast<const IVec*>(p)); }
+        inline IVec iset(int32_t v) { return _mm_set1_epi32(v); }
+        inline IVec igt(IVec a, IVec b) { return _mm_cmpgt_epi32(a, b); }
+        inline IVec ieq(IVec a, IVec b) { return _mm_cmpeq_epi32(a, b); }
+        inline IVec ior(IVec a, IVec b) { return _mm_or_si128(a, b); }
+        inline IVec iandnot(IVec a, IVec b) { return _mm_andnot_si128(a, b); } // ~a & b
+        inline uint64_t imask(IVec m) { return uint64_t(_mm_movemask_ps(_mm_castsi128_ps(m))); }
+        inline DVec dload(const double *p) { return _mm_loadu_pd(p); }
+        inline DVec dset(double v) { return _mm_set1_pd(v); }
+        inline DVec dadd(DVec a, DVec b) { return _mm_add_pd(a, b); }
+        inline DVec dsub(DVec a, DVec b) { return _mm_sub_pd(a, b); }
+        inline DVec dmul(DVec a, DVec b) { return _mm_mul_pd(a, b); }
+        inline DVec dand(DVec a, DVec b) { return _mm_and_pd(a, b); }
+        inline DVec dcmp(DVec a, Cmp op, DVec b) {
+          switch(op) {
+          case Cmp::Eq: return _mm_cmpeq_pd(a, b);
+          case Cmp::NotEq: return _mm_cmpneq_pd(a, b);
+          case Cmp::Lt: return _mm_cmplt_pd(a, b);
+          case Cmp::LtEq: return _mm_cmple_pd(a, b);
+          case Cmp::Gt: return _mm_cmpgt_pd(a, b);
+          case Cmp::GtEq: return _mm_cmpge_pd(a, b);
+          }
+          return _mm_setzero_pd();
+        }
+        inline uint64_t dmask(DVec m) { return uint64_t(_mm_movemask_pd(m)); }
+#define OEF_SIMD_KERNELS 1
+        const char *const name = "sse2";
+#else
+        const char *const name = "scalar";
+#endif
+
+#ifdef OEF_SIMD_KERNELS
+        // Full words of 64 rows; returns the number of rows done.
+        template <typename F>
+        size_t words(size_t n, size_t width, uint64_t *out, F &&f) {
+          size_t full = n / 64;
+          for(size_t w = 0; w < full; ++w) {
+            uint64_t bits = 0;
+            for(size_t i = 0; i < 64; i += width) {
+              bits |= f(w * 64 + i) << i;
+            }
+            out[w] = bits;
+          }
+          return full * 64;
+        }
+        // Signed 32 bit compare of a lane against v, built from greater-than and equal.
+        inline IVec icmp(IVec x, Cmp op, IVec v) {
+          switch(op) {
+          case Cmp::Eq: return ieq(x, v);
+          case Cmp::NotEq: return iandnot(ieq(x, v), iset(-1));
+          case Cmp::Lt: return igt(v, x);
+          case Cmp::LtEq: return iandnot(igt(x, v), iset(-1));
+          case Cmp::Gt: return igt(x, v);
+          case Cmp::GtEq: return iandnot(igt(v, x), iset(-1));
+          }
+          return iset(0);
+        }
+#endif
+      }
+
+      const char *isa() {
+        return name;
+      }
+
+      namespace {
+        // op is a template parameter so that the compare in the loop folds to a single instruction.
+        template <Cmp op>
+        void compareAs(const int32_t *values, size_t n, int32_t v, uint64_t *out) {
+          size_t done = 0;
+#ifdef OEF_SIMD_KERNELS
+          IVec vv = iset(v);
+          done = words(n, ints, out, [&](size_t i) { return imask(icmp(iload(values + i), op, vv)); });
+#endif
+          tail(done, n, out, [&](size_t i) { return compare1(values[i], op, v); });
+        }
+        template <Cmp op>
+        void compareAs(const double *values, size_t n, double v, uint64_t *out) {
+          size_t done = 0;
+#ifdef OEF_SIMD_KERNELS
+          DVec vv = dset(v);
+          done = words(n, doubles, out, [&](size_t i) { return dmask(dcmp(dload(values + i), op, vv)); });
+#endif
+          tail(done, n, out, [&](size_t i) { return compare1(values[i], op, v); });
+        }
+        template <typename T>
+        void dispatch(const T *values, size_t n, Cmp op, T v, uint64_t *out) {
+          switch(op) {
+          case Cmp::Eq: compareAs<Cmp::Eq>(values, n, v, out); break;
+          case Cmp::NotEq: compareAs<Cmp::NotEq>(values, n, v, out); break;
+          case Cmp::Lt: compareAs<Cmp::Lt>(values, n, v, out); break;
+          case Cmp::LtEq: compareAs<Cmp::LtEq>(values, n, v, out); break;
+          case Cmp::Gt: compareAs<Cmp::Gt>(values, n, v, out); break;
+          case Cmp::GtEq: compareAs<Cmp::GtEq>(values, n, v, out); break;
+          }
+        }
+      }
+
+      void compare(const int32_t *values, size_t n, Cmp op, int32_t v, uint64_t *out) {
+        dispatch(values, n, op, v, out);
+      }
+
+      void compare(const double *values, size_t n, Cmp op, double v, uint64_t *out) {
+        dispatch(values, n, op, v, out);
+      }
+
+      void between(const int32_t *values, size_t n, int32_t lo, int32_t hi, uint64_t *out) {
+        size_t done = 0;
+#ifdef OEF_SIMD_KERNELS
+        IVec vlo = iset(lo), vhi = iset(hi);
+        done = words(n, ints, out, [&](size_t i) {
+            IVec x = iload(values + i);
+            return imask(iandnot(ior(igt(vlo, x), igt(x, vhi)), iset(-1)));
+          });
+#endif
+        tail(done, n, out, [&](size_t i) { return values[i] >= lo && values[i] <= hi; });
+      }
+
+      void between(const double *values, size_t n, double lo, double hi, uint64_t *out) {
+        size_t done = 0;
+#ifdef OEF_SIMD_KERNELS
+        DVec vlo = dset(lo), vhi = dset(hi);
+        done = words(n, doubles, out, [&](size_t i) {
+            DVec x = dload(values + i);
+            return dmask(dand(dcmp(x, Cmp::GtEq, vlo), dcmp(x, Cmp::LtEq, vhi)));
+          });
+#endif
+        tail(done, n, out, [&](size_t i) { return values[i] >= lo && values[i] <= hi; });
+      }
+
+      // hav(a) = (1 - cos(dlat)) / 2 + cos(lat1) cos(lat2) (1 - cos(dlon)) / 2, with
+      // cos(dlat) = cos(lat1) cos(lat2) + sin(lat1) sin(lat2) and likewise for the longitudes.
+      void within(const double *sinLat, const double *cosLat, const double *sinLon, const double *cosLon, size_t n,
+                  const Location &center, double threshold, double margin, uint64_t *inside, uint64_t *maybe) {
+        double latRad = degree_to_radian(center.lat);
+        double lonRad = degree_to_radian(center.lon);
+        double sla = std::sin(latRad), cla = std::cos(latRad), slo = std::sin(lonRad), clo = std::cos(lonRad);
+        double below = threshold - margin, above = threshold + margin;
+        auto hav = [&](size_t i) {
+          double cdlat = cosLat[i] * cla + sinLat[i] * sla;
+          double cdlon = cosLon[i] * clo + sinLon[i] * slo;
+          return 0.5 * ((1.0 - cdlat) + cosLat[i] * cla * (1.0 - cdlon));
+        };
+        size_t done = 0;
+#ifdef OEF_SIMD_KERNELS
+        DVec vsla = dset(sla), vcla = dset(cla), vslo = dset(slo), vclo = dset(clo);
+        DVec one = dset(1.0), half = dset(0.5), vbelow = dset(below), vabove = dset(above);
+        size_t full = n / 64;
+        for(size_t w = 0; w < full; ++w) {
+          uint64_t in = 0, may = 0;
+          for(size_t j = 0; j < 64; j += doubles) {
+            size_t i = w * 64 + j;
+            DVec cl = dload(cosLat + i);
+            DVec cdlat = dadd(dmul(cl, vcla), dmul(dload(sinLat + i), vsla));
+            DVec cdlon = dadd(dmul(dload(cosLon + i), vclo), dmul(dload(sinLon + i), vslo));
+            DVec h = dmul(half, dadd(dsub(one, cdlat), dmul(dmul(cl, vcla), dsub(one, cdlon))));
+            in |= dmask(dcmp(h, Cmp::LtEq, vbelow)) << j;
+            may |= dmask(dcmp(h, Cmp::LtEq, vabove)) << j;
+          }
+          inside[w] = in;
+          maybe[w] = may;
+        }
+        done = full * 64;
+#endif
+        tail(done, n, inside, [&](size_t i) { return hav(i) <= below; });
+        tail(done, n, maybe, [&](size_t i) { return hav(i) <= above; });
+      }
+    }
+  }
+}
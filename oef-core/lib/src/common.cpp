@@ -17,17 +17,68 @@
 //------------------------------------------------------------------------------
 
 #include "common.hpp"
+#include "timingwheel.hpp"
+
+using fetch::oef::TimingWheel;
+
+namespace {
+  // Shuts socket down once timeout seconds have elapsed, if timeout is not 0: a stream that timed out in the
+  // middle of a message is of no further use, and every pending and later operation on it fails at once.
+  // The shutdown is posted to the socket's executor rather than made from the wheel's callback, and is skipped if
+  // the operation's handlers, which hold the deadline, are gone by then: so may be the socket.
+  std::shared_ptr<TimingWheel::Deadline> deadline(asio::ip::tcp::socket &socket, uint32_t timeout) {
+    if(timeout == 0) {
+      return nullptr;
+    }
+    auto &wheel = asio::use_service<TimingWheel>(static_cast<asio::io_context&>(socket.get_executor().context()));
+    // Set as soon as the deadline starts, a second at least before it can expire.
+    auto self = std::make_shared<std::weak_ptr<TimingWheel::Deadline>>();
+    auto expiry = wheel.start(timeout, [&socket,self]() {
+        std::weak_ptr<TimingWheel::Deadline> weak = *self;
+        asio::post(socket.get_executor(), [&socket,weak]() {
+            if(weak.lock()) {
+              std::error_code ignored;
+              socket.shutdown(asio::ip::tcp::socket::shutdown_both, ignored);
+            }
+          });
+      });
+    *self = expiry;
+    return expiry;
+  }
+  // ec, or timed_out if the deadline expired.
+  std::error_code complete(const std::shared_ptr<TimingWheel::Deadline> &deadline, std::error_code ec) {
+    if(deadline && !deadline->complete()) {
+      return asio::error::timed_out;
+    }
+    return ec;
+  }
+}
 
 void asyncReadBuffer(asio::ip::tcp::socket &socket, uint32_t timeout, std::function<void(std::error_code,std::shared_ptr<Buffer>)> handler)
 {
+  asyncReadBuffer(socket, timeout, std::move(handler), nullptr);
+}
+
+void asyncReadBuffer(asio::ip::tcp::socket &socket, uint32_t timeout, std::function<void(std::error_code,std::shared_ptr<Buffer>)> handler,
+                     std::function<void()> progress)
+{
+  auto expiry = deadline(socket, timeout);
+  // Called after each read of the composed operation that leaves the buffer short, not after the last one.
+  auto condition = [progress](std::error_code ec, std::size_t length) -> std::size_t {
+    if(length > 0 && progress) {
+      progress();
+    }
+    return ec ? 0 : 65536;
+  };
   auto len = std::make_shared<uint32_t>();
-  asio::async_read(socket, asio::buffer(len.get(), sizeof(uint32_t)), [len,handler,&socket](std::error_code ec, std::size_t length) {
+  asio::async_read(socket, asio::buffer(len.get(), sizeof(uint32_t)), condition, [len,handler,condition,&socket,expiry](std::error_code ec, std::size_t length) {
       if(ec) {
-        handler(ec, std::make_shared<Buffer>());
+        handler(complete(expiry, ec), std::make_shared<Buffer>());
       } else {
         assert(length == sizeof(uint32_t));
         auto buffer = std::make_shared<Buffer>(*len);
-        asio::async_read(socket, asio::buffer(buffer->data(), *len), [buffer,handler](std::error_code ec, std::size_t length) {
+        asio::async_read(socket, asio::buffer(buffer->data(), *len), condition, [buffer,handler,expiry](std::error_code ec, std::size_t length) {
+            ec = complete(expiry, ec);
             if(ec) {
               std::cerr << "asyncRead2 error " << ec.value() << std::endl;
             }
@@ -38,30 +89,20 @@ void asyncReadBuffer(asio::ip::tcp::socket &socket, uint32_t timeout, std::funct
 }
 
 void asyncWriteBuffer(asio::ip::tcp::socket &socket, std::shared_ptr<Buffer> s, uint32_t timeout) {
-  std::vector<asio::const_buffer> buffers;
-  uint32_t len = uint32_t(s->size());
-  buffers.emplace_back(asio::buffer(&len, sizeof(len)));
-  buffers.emplace_back(asio::buffer(s->data(), len));
-  uint32_t total = len+sizeof(len);
-  asio::async_write(socket, buffers,
-                    [total,s](std::error_code ec, std::size_t length) {
-                      if(ec) {
-                        std::cerr << "Grouped Async write error, wrote " << length << " expected " << total << std::endl;
-                      }});
+  asyncWriteBuffer(socket, std::move(s), timeout, [](std::error_code, std::size_t) {});
 }
 
 void asyncWriteBuffer(asio::ip::tcp::socket &socket, std::shared_ptr<Buffer> s, uint32_t timeout, std::function<void(std::error_code, std::size_t length)> handler) {
-  std::vector<asio::const_buffer> buffers;
-  uint32_t len = uint32_t(s->size());
-  buffers.emplace_back(asio::buffer(&len, sizeof(len)));
-  buffers.emplace_back(asio::buffer(s->data(), len));
-  uint32_t total = len+sizeof(len);
+  auto expiry = deadline(socket, timeout);
+  auto len = std::make_shared<uint32_t>(uint32_t(s->size()));
+  std::array<asio::const_buffer,2> buffers{{asio::buffer(len.get(), sizeof(uint32_t)), asio::buffer(s->data(), *len)}};
+  uint32_t total = *len + sizeof(uint32_t);
   asio::async_write(socket, buffers,
-                    [total,s,handler](std::error_code ec, std::size_t length) {
+                    [total,len,s,handler,expiry](std::error_code ec, std::size_t length) {
+                      ec = complete(expiry, ec);
                       if(ec) {
                         std::cerr << "Grouped Async write error, wrote " << length << " expected " << total << std::endl;
-                      } else {
-                        handler(ec, length);
                       }
+                      handler(ec, length);
                     });
 }
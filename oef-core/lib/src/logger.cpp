@@ -17,8 +17,10 @@
 //------------------------------------------------------------------------------
 
 #include "logger.hpp"
+#include <spdlog/async.h>
 #include <spdlog/sinks/dist_sink.h>
 #include <spdlog/sinks/rotating_file_sink.h>
+#include <mutex>
 
 #ifdef _WIN32
 #include <spdlog/sinks/wincolor_sink.h>
@@ -30,25 +32,77 @@
 #include <spdlog/sinks/msvc_sink.h>
 #endif  // _DEBUG && _MSC_VER
 
-fetch::oef::Logger::Logger(std::string section) : section_{std::move(section)} {
-  std::string log_name{fetch::oef::Logger::logger_name};
-  logger_ = spdlog::get(log_name);
+namespace {
+  // Queue of the background thread writing the sinks: when it is full, callers wait for room.
+  constexpr size_t queueSize = 8192;
 
-  if (logger_ == nullptr) {
+  std::shared_ptr<spdlog::sinks::sink> sink() {
 #ifdef _WIN32
     auto color_sink = std::make_shared<spdlog::sinks::wincolor_stdout_sink_mt>();
 #else
     auto color_sink = std::make_shared<spdlog::sinks::ansicolor_stdout_sink_mt>();
 #endif
-    auto dist_sink = std::make_shared<spdlog::sinks::dist_sink_st>();
+    auto dist_sink = std::make_shared<spdlog::sinks::dist_sink_mt>();
     auto rotating_sink = std::make_shared<spdlog::sinks::rotating_file_sink_mt>("log.txt", 1024*1024*10, 10);
     dist_sink->add_sink(color_sink);
     dist_sink->add_sink(rotating_sink);
 #if defined(_DEBUG) && defined(_MSC_VER)
-    auto debug_sink = std::make_shared<spdlog::sinks::msvc_sink_st>();
+    auto debug_sink = std::make_shared<spdlog::sinks::msvc_sink_mt>();
     dist_sink->add_sink(debug_sink);
 #endif  // _DEBUG && _MSC_VER
-    logger_ = std::make_shared<spdlog::logger>(log_name, dist_sink);
-    spdlog::register_logger(logger_);
+    return dist_sink;
+  }
+}
+
+fetch::oef::Logger::Logger(std::string section) : section_{std::move(section)} {
+  static std::mutex lock;
+  std::lock_guard<std::mutex> guard(lock);
+  logger_ = spdlog::get(section_);
+  if (logger_ == nullptr) {
+    static auto shared_sink = sink();
+    auto &registry = spdlog::details::registry::instance();
+    std::lock_guard<std::recursive_mutex> tp_lock(registry.tp_mutex());
+    auto tp = registry.get_tp();
+    if (tp == nullptr) {
+      tp = std::make_shared<spdlog::details::thread_pool>(queueSize, 1);
+      registry.set_tp(tp);
+    }
+    logger_ = std::make_shared<spdlog::async_logger>(section_, shared_sink, std::move(tp),
+                                                     spdlog::async_overflow_policy::block);
+    registry.initialize_logger(logger_);
+  }
+}
+
+namespace {
+  bool parse(const std::string &name, spdlog::level::level_enum &level) {
+    level = spdlog::level::from_str(name);
+    return level != spdlog::level::off || name == "off";
+  }
+}
+
+bool fetch::oef::Logger::level(const std::string &name) {
+  spdlog::level::level_enum level;
+  if (!parse(name, level)) {
+    return false;
+  }
+  spdlog::set_level(level);
+  return true;
+}
+
+bool fetch::oef::Logger::level(const std::string &section, const std::string &name) {
+  spdlog::level::level_enum level;
+  auto logger = spdlog::get(section);
+  if (!logger || !parse(name, level)) {
+    return false;
+  }
+  logger->set_level(level);
+  return true;
+}
+
+bool fetch::oef::Logger::configure(const std::string &spec) {
+  auto pos = spec.rfind('=');
+  if (pos == std::string::npos) {
+    return level(spec);
   }
+  return level(spec.substr(0, pos), spec.substr(pos + 1));
 }
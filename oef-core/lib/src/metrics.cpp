@@ -0,0 +1,168 @@
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include "metrics.hpp"
+#include "timingwheel.hpp"
+
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+namespace fetch {
+  namespace oef {
+    fetch::oef::Logger MetricsEndpoint::logger = fetch::oef::Logger("oef-node::metrics");
+
+    Metrics::Series &Metrics::series(const std::string &name, const std::string &help, const std::string &type,
+                                     const std::string &labels, double scale) {
+      auto &family = families_[name];
+      if(family.type.empty()) {
+        family.help = help;
+        family.type = type;
+        family.scale = scale;
+      } else if(family.type != type) {
+        throw std::invalid_argument("Metric " + name + " is already a " + family.type + ".");
+      }
+      for(auto &s : family.series) {
+        if(s->labels == labels) {
+          return *s;
+        }
+      }
+      family.series.emplace_back(std::make_unique<Series>());
+      auto &s = *family.series.back();
+      s.labels = labels;
+      return s;
+    }
+    Counter &Metrics::counter(const std::string &name, const std::string &help, const std::string &labels) {
+      std::lock_guard<std::mutex> lock(lock_);
+      auto &s = series(name, help, "counter", labels);
+      if(!s.counter) {
+        s.counter = std::make_unique<Counter>();
+      }
+      return *s.counter;
+    }
+    Gauge &Metrics::gauge(const std::string &name, const std::string &help, const std::string &labels) {
+      std::lock_guard<std::mutex> lock(lock_);
+      auto &s = series(name, help, "gauge", labels);
+      if(!s.gauge) {
+        s.gauge = std::make_unique<Gauge>();
+      }
+      return *s.gauge;
+    }
+    void Metrics::gauge(const std::string &name, const std::string &help, std::function<double()> read,
+                        const std::string &labels) {
+      std::lock_guard<std::mutex> lock(lock_);
+      series(name, help, "gauge", labels).read = std::move(read);
+    }
+    LatencyHistogram &Metrics::histogram(const std::string &name, const std::string &help, double scale,
+                                         const std::string &labels) {
+      std::lock_guard<std::mutex> lock(lock_);
+      auto &s = series(name, help, "summary", labels, scale);
+      if(!s.histogram) {
+        s.histogram = std::make_unique<LatencyHistogram>();
+      }
+      return *s.histogram;
+    }
+    std::string Metrics::prometheus() const {
+      static const std::vector<std::string> quantiles{"0.5", "0.9", "0.99", "0.999"};
+      auto braces = [](const std::string &labels) { return labels.empty() ? labels : "{" + labels + "}"; };
+      std::ostringstream os;
+      // all the digits: at the default precision of 6, a sum past 10^6 would print rounded, as 1.23457e+06.
+      os.precision(std::numeric_limits<double>::max_digits10);
+      std::lock_guard<std::mutex> lock(lock_);
+      for(auto &f : families_) {
+        const auto &name = f.first;
+        const auto &family = f.second;
+        os << "# HELP " << name << " " << family.help << "\n# TYPE " << name << " " << family.type << "\n";
+        for(auto &s : family.series) {
+          if(s->counter) {
+            os << name << braces(s->labels) << " " << s->counter->value() << "\n";
+          } else if(s->read) {
+            os << name << braces(s->labels) << " " << s->read() << "\n";
+          } else if(s->gauge) {
+            os << name << braces(s->labels) << " " << s->gauge->value() << "\n";
+          } else if(s->histogram) {
+            const auto &h = *s->histogram;
+            std::string sep = s->labels.empty() ? "" : ",";
+            for(auto &q : quantiles) {
+              os << name << "{" << s->labels << sep << "quantile=\"" << q << "\"} "
+                 << h.quantile(std::stod(q)) * family.scale << "\n";
+            }
+            os << name << "_sum" << braces(s->labels) << " " << double(h.sum()) * family.scale << "\n";
+            os << name << "_count" << braces(s->labels) << " " << h.count() << "\n";
+          }
+        }
+      }
+      return os.str();
+    }
+
+    MetricsEndpoint::MetricsEndpoint(asio::io_context &io_context, const Metrics &metrics, uint16_t port,
+                                     std::function<std::string()> statistics)
+      : acceptor_(io_context, tcp::endpoint(asio::ip::address_v4::loopback(), port)), retry_{io_context}, metrics_{metrics},
+        statistics_{std::move(statistics)} {}
+
+    void MetricsEndpoint::do_accept() {
+      acceptor_.async_accept([this](std::error_code ec, tcp::socket socket) {
+          if(ec) {
+            if(ec == asio::error::operation_aborted || !acceptor_.is_open()) {
+              return;
+            }
+            // accepting again at once would fail the same way, in a busy loop
+            logger.error("MetricsEndpoint::do_accept error {}", ec.value());
+            retry_.expires_after(std::chrono::milliseconds{100});
+            retry_.async_wait([this](std::error_code ec) {
+                if(!ec) {
+                  do_accept();
+                }
+              });
+            return;
+          }
+          auto s = std::make_shared<tcp::socket>(std::move(socket));
+          auto request = std::make_shared<asio::streambuf>(8192);
+          auto &io_context = static_cast<asio::io_context&>(acceptor_.get_executor().context());
+          auto expiry = asio::use_service<TimingWheel>(io_context).start(requestTimeout, [s]() {
+              std::error_code ignored;
+              s->shutdown(tcp::socket::shutdown_both, ignored);
+            });
+          asio::async_read_until(*s, *request, "\r\n\r\n", [this,s,request,expiry](std::error_code ec, std::size_t) {
+              if(!expiry->complete()) {
+                logger.trace("MetricsEndpoint::do_accept request timed out");
+                return;
+              }
+              if(ec) {
+                logger.trace("MetricsEndpoint::do_accept read error {}", ec.value());
+                return;
+              }
+              std::string line;
+              std::istream is{request.get()};
+              std::getline(is, line);
+              // GET /statistics serves the statistics, anything else the metrics.
+              bool json = statistics_ && line.compare(0, 16, "GET /statistics ") == 0;
+              std::string body = json ? statistics_() : metrics_.prometheus();
+              auto response = std::make_shared<std::string>(
+                  std::string{"HTTP/1.0 200 OK\r\nContent-Type: "} + (json ? "application/json" : "text/plain; version=0.0.4")
+                  + "\r\nContent-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body);
+              asio::async_write(*s, asio::buffer(*response), [s,response](std::error_code, std::size_t) {
+                  std::error_code ignored;
+                  s->shutdown(tcp::socket::shutdown_both, ignored);
+                });
+            });
+          do_accept();
+        });
+    }
+  }
+}
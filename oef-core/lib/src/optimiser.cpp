@@ -0,0 +1,382 @@
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include "schema.hpp"
+#include "statistics.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+
+namespace fetch {
+  namespace oef {
+    namespace {
+      using Expr = fetch::oef::pb::Query_ConstraintExpr;
+      using PbRange = fetch::oef::pb::Query_Range;
+
+      template <typename Pair>
+      bool ordered(const Pair &p) {
+        return p.first() <= p.second();
+      }
+      bool foldable(const PbRange &range) {
+        switch(range.pair_case()) {
+        case PbRange::kS:
+        case PbRange::kI:
+          return true;
+        case PbRange::kD: // NaN bounds do not intersect like numbers.
+          return !std::isnan(range.d().first()) && !std::isnan(range.d().second());
+        default:
+          return false;
+        }
+      }
+      // Intersection (conjunction) or union (disjunction) of the ranges of group, written back into children.
+      // Ranges of one case only ever see the same default pair for values of another type, so both are exact.
+      template <typename Pair, typename Access>
+      void foldGroup(bool conjunction, std::vector<Expr> &children, const std::vector<size_t> &group,
+                     Access access, std::vector<bool> &removed) {
+        std::vector<Pair> pairs;
+        for(auto i : group) {
+          pairs.push_back(access(*children[i].mutable_constraint()->mutable_range_()));
+        }
+        std::vector<Pair> res;
+        if(conjunction) {
+          Pair acc = pairs[0];
+          for(auto &p : pairs) {
+            if(p.first() > acc.first()) {
+              acc.set_first(p.first());
+            }
+            if(p.second() < acc.second()) {
+              acc.set_second(p.second());
+            }
+          }
+          res.push_back(acc);
+        } else {
+          std::sort(pairs.begin(), pairs.end(), [](const Pair &a, const Pair &b) { return a.first() < b.first(); });
+          for(auto &p : pairs) {
+            if(!ordered(p)) { // adds nothing to the union.
+              continue;
+            }
+            if(!res.empty() && p.first() <= res.back().second()) {
+              if(p.second() > res.back().second()) {
+                res.back().set_second(p.second());
+              }
+            } else {
+              res.push_back(p);
+            }
+          }
+          if(res.empty()) {
+            res.push_back(pairs[0]);
+          }
+        }
+        for(size_t k = 0; k < group.size(); ++k) {
+          if(k < res.size()) {
+            access(*children[group[k]].mutable_constraint()->mutable_range_()).CopyFrom(res[k]);
+          } else {
+            removed[group[k]] = true;
+          }
+        }
+      }
+    }
+
+    Expr QueryOptimiser::always(bool value) {
+      Expr res;
+      if(value) {
+        res.mutable_and_();
+      } else {
+        res.mutable_or_();
+      }
+      return res;
+    }
+
+    bool QueryOptimiser::is(const Expr &expr, bool value) {
+      return value ? (expr.has_and_() && expr.and_().expr_size() == 0) : (expr.has_or_() && expr.or_().expr_size() == 0);
+    }
+
+    bool QueryOptimiser::empty(const fetch::oef::pb::Query_ConstraintExpr_Constraint &constraint) const {
+      if(!model_ || !constraint.has_range_()) {
+        return false;
+      }
+      const auto *attr = model_->attribute(constraint.attribute_name());
+      if(!attr) {
+        return false;
+      }
+      const auto &range = constraint.range_();
+      switch(range.pair_case()) {
+      case PbRange::kS:
+        return attr->type() == fetch::oef::pb::Query_Attribute_Type_STRING && !ordered(range.s());
+      case PbRange::kI:
+        return attr->type() == fetch::oef::pb::Query_Attribute_Type_INT && !ordered(range.i());
+      case PbRange::kD:
+        return attr->type() == fetch::oef::pb::Query_Attribute_Type_DOUBLE && !ordered(range.d());
+      default:
+        return false;
+      }
+    }
+
+    Expr QueryOptimiser::normalise(const Expr &expr, bool negate) const {
+      switch(expr.expression_case()) {
+      case Expr::kNot:
+        return normalise(expr.not_().expr(), !negate);
+      case Expr::kAnd:
+      case Expr::kOr: {
+        bool conjunction = expr.has_and_() != negate;
+        const auto &exprs = expr.has_and_() ? expr.and_().expr() : expr.or_().expr();
+        std::vector<Expr> children;
+        for(auto &c : exprs) {
+          auto n = normalise(c, negate);
+          const auto *same = conjunction ? (n.has_and_() ? &n.and_().expr() : nullptr)
+                                         : (n.has_or_() ? &n.or_().expr() : nullptr);
+          if(same && same->size() > 0) {
+            children.insert(children.end(), same->begin(), same->end());
+          } else {
+            children.emplace_back(std::move(n));
+          }
+        }
+        return combine(conjunction, std::move(children));
+      }
+      case Expr::kConstraint:
+        if(empty(expr.constraint())) {
+          return always(negate);
+        }
+        break;
+      case Expr::EXPRESSION_NOT_SET:
+        break;
+      }
+      if(negate) {
+        Expr res;
+        res.mutable_not_()->mutable_expr()->CopyFrom(expr);
+        return res;
+      }
+      return expr;
+    }
+
+    Expr QueryOptimiser::combine(bool conjunction, std::vector<Expr> children) const {
+      // true is the identity of And and false absorbs it, and conversely for Or.
+      std::vector<Expr> kept;
+      std::unordered_set<std::string> keys;
+      for(auto &c : children) {
+        if(is(c, conjunction)) {
+          continue;
+        }
+        if(is(c, !conjunction)) {
+          return always(!conjunction);
+        }
+        if(keys.insert(c.SerializeAsString()).second) {
+          kept.emplace_back(std::move(c));
+        }
+      }
+      for(auto &c : kept) {
+        if(c.has_not_() && keys.count(c.not_().expr().SerializeAsString())) {
+          return always(!conjunction);
+        }
+      }
+      if(!fold(conjunction, kept)) {
+        return always(!conjunction);
+      }
+      if(kept.empty()) {
+        return always(conjunction);
+      }
+      if(kept.size() == 1) {
+        return kept.front();
+      }
+      order(conjunction, kept);
+      Expr res;
+      auto *exprs = conjunction ? res.mutable_and_()->mutable_expr() : res.mutable_or_()->mutable_expr();
+      for(auto &c : kept) {
+        exprs->Add()->Swap(&c);
+      }
+      return res;
+    }
+
+    // Returns false if a conjunction is found to be false.
+    bool QueryOptimiser::fold(bool conjunction, std::vector<Expr> &children) const {
+      std::map<std::pair<std::string,int>,std::vector<size_t>> groups;
+      for(size_t i = 0; i < children.size(); ++i) {
+        const auto &c = children[i];
+        if(c.has_constraint() && c.constraint().has_range_() && foldable(c.constraint().range_())) {
+          groups[std::make_pair(c.constraint().attribute_name(), int(c.constraint().range_().pair_case()))].push_back(i);
+        }
+      }
+      std::vector<bool> removed(children.size(), false);
+      bool folded = false;
+      for(auto &g : groups) {
+        if(g.second.size() < 2) {
+          continue;
+        }
+        folded = true;
+        switch(PbRange::PairCase(g.first.second)) {
+        case PbRange::kS:
+          foldGroup<fetch::oef::pb::Query_StringPair>(conjunction, children, g.second,
+                                                      [](PbRange &r) -> fetch::oef::pb::Query_StringPair& { return *r.mutable_s(); }, removed);
+          break;
+        case PbRange::kI:
+          foldGroup<fetch::oef::pb::Query_IntPair>(conjunction, children, g.second,
+                                                   [](PbRange &r) -> fetch::oef::pb::Query_IntPair& { return *r.mutable_i(); }, removed);
+          break;
+        case PbRange::kD:
+          foldGroup<fetch::oef::pb::Query_DoublePair>(conjunction, children, g.second,
+                                                      [](PbRange &r) -> fetch::oef::pb::Query_DoublePair& { return *r.mutable_d(); }, removed);
+          break;
+        default:
+          break;
+        }
+      }
+      if(!folded) {
+        return true;
+      }
+      std::vector<Expr> res;
+      for(size_t i = 0; i < children.size(); ++i) {
+        if(removed[i]) {
+          continue;
+        }
+        if(empty(children[i].constraint())) {
+          if(conjunction) {
+            return false;
+          }
+          continue;
+        }
+        res.emplace_back(std::move(children[i]));
+      }
+      children = std::move(res);
+      return true;
+    }
+
+    // And: ascending cost / (1 - selectivity), so that the cheapest way to a false comes first.
+    // Or: ascending cost / selectivity, likewise for true.
+    void QueryOptimiser::order(bool conjunction, std::vector<Expr> &children) const {
+      std::vector<std::pair<double,size_t>> ranks;
+      for(size_t i = 0; i < children.size(); ++i) {
+        double s = selectivity(children[i]);
+        double p = std::max(conjunction ? 1.0 - s : s, 1e-3);
+        ranks.emplace_back(cost(children[i]) / p, i);
+      }
+      std::stable_sort(ranks.begin(), ranks.end(),
+                       [](const std::pair<double,size_t> &a, const std::pair<double,size_t> &b) { return a.first < b.first; });
+      std::vector<Expr> res;
+      for(auto &r : ranks) {
+        res.emplace_back(std::move(children[r.second]));
+      }
+      children = std::move(res);
+    }
+
+    double QueryOptimiser::cost(const Expr &expr) const {
+      switch(expr.expression_case()) {
+      case Expr::kOr:
+      case Expr::kAnd: {
+        // expected cost when checking the children in order.
+        bool conjunction = expr.has_and_();
+        double res = 0.0, reached = 1.0;
+        for(auto &c : conjunction ? expr.and_().expr() : expr.or_().expr()) {
+          res += reached * cost(c);
+          double s = selectivity(c);
+          reached *= conjunction ? s : 1.0 - s;
+        }
+        return res;
+      }
+      case Expr::kNot:
+        return cost(expr.not_().expr());
+      case Expr::kConstraint: {
+        const auto &c = expr.constraint();
+        switch(c.constraint_case()) {
+        case fetch::oef::pb::Query_ConstraintExpr_Constraint::kRelation:
+          return c.relation().val().has_s() ? 2.0 : 1.0;
+        case fetch::oef::pb::Query_ConstraintExpr_Constraint::kRange:
+          return c.range_().has_s() || c.range_().has_l() ? 2.0 : 1.0;
+        case fetch::oef::pb::Query_ConstraintExpr_Constraint::kSet: {
+          if(Set::Lookup::worth(c.set_())) {
+            return 1.5;
+          }
+          const auto &v = c.set_().vals();
+          size_t n = v.i().vals_size() + v.d().vals_size() + v.s().vals_size() + v.b().vals_size() + v.l().vals_size();
+          return 1.0 + n / 8.0;
+        }
+        case fetch::oef::pb::Query_ConstraintExpr_Constraint::kDistance:
+          return 10.0;
+        default:
+          return 1.0;
+        }
+      }
+      case Expr::EXPRESSION_NOT_SET:
+        break;
+      }
+      return 0.0;
+    }
+
+    double QueryOptimiser::selectivity(const Expr &expr) const {
+      switch(expr.expression_case()) {
+      case Expr::kOr: {
+        double none = 1.0;
+        for(auto &c : expr.or_().expr()) {
+          none *= 1.0 - selectivity(c);
+        }
+        return 1.0 - none;
+      }
+      case Expr::kAnd: {
+        double all = 1.0;
+        for(auto &c : expr.and_().expr()) {
+          all *= selectivity(c);
+        }
+        return all;
+      }
+      case Expr::kNot:
+        return 1.0 - selectivity(expr.not_().expr());
+      case Expr::kConstraint: {
+        const auto &c = expr.constraint();
+        if(statistics_ && statistics_->rows() > 0) {
+          return statistics_->selectivity(c);
+        }
+        switch(c.constraint_case()) {
+        case fetch::oef::pb::Query_ConstraintExpr_Constraint::kRelation:
+          switch(c.relation().op()) {
+          case fetch::oef::pb::Query_Relation_Operator_EQ: return 0.1;
+          case fetch::oef::pb::Query_Relation_Operator_NOTEQ: return 0.9;
+          default: return 0.35;
+          }
+        case fetch::oef::pb::Query_ConstraintExpr_Constraint::kRange:
+          return 0.25;
+        case fetch::oef::pb::Query_ConstraintExpr_Constraint::kSet: {
+          const auto &v = c.set_().vals();
+          size_t n = v.i().vals_size() + v.d().vals_size() + v.s().vals_size() + v.b().vals_size() + v.l().vals_size();
+          double in = std::min(0.05 + 0.05 * n, 0.9);
+          return c.set_().op() == fetch::oef::pb::Query_Set_Operator_IN ? in : 1.0 - in;
+        }
+        case fetch::oef::pb::Query_ConstraintExpr_Constraint::kDistance:
+          return 0.2;
+        default:
+          return 0.5;
+        }
+      }
+      case Expr::EXPRESSION_NOT_SET:
+        break;
+      }
+      return 0.0;
+    }
+
+    void QueryOptimiser::optimise(google::protobuf::RepeatedPtrField<Expr> &constraints) const {
+      Expr all;
+      all.mutable_and_()->mutable_expr()->Swap(&constraints);
+      auto res = normalise(all, false);
+      constraints.Clear();
+      if(res.has_and_() && res.and_().expr_size() > 0) {
+        constraints.Swap(res.mutable_and_()->mutable_expr());
+      } else { // a single constraint, or always true or false.
+        constraints.Add()->Swap(&res);
+      }
+    }
+  } // namespace oef
+} // namespace fetch
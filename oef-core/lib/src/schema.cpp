@@ -54,7 +54,7 @@ namespace fetch {
       return Or{{lhs, rhs}};
     }
     
-    bool ConstraintExpr::valid(const fetch::oef::pb::Query_ConstraintExpr &constraint, const fetch::oef::pb::Query_DataModel &dm) {
+    bool ConstraintExpr::valid(const fetch::oef::pb::Query_ConstraintExpr &constraint, const DataModel &dm) {
       auto expr_case = constraint.expression_case();
       switch(expr_case) {
       case fetch::oef::pb::Query_ConstraintExpr::kOr:
@@ -90,17 +90,17 @@ namespace fetch {
       return false;
     }
     
-    bool ConstraintExpr::check(const fetch::oef::pb::Query_ConstraintExpr &constraint, const Instance &i) {
+    bool ConstraintExpr::check(const fetch::oef::pb::Query_ConstraintExpr &constraint, const Instance &i, const Lookups *lookups) {
       auto expr_case = constraint.expression_case();
       switch(expr_case) {
       case fetch::oef::pb::Query_ConstraintExpr::kOr:
-        return Or::check(constraint.or_(), i);
+        return Or::check(constraint.or_(), i, lookups);
       case fetch::oef::pb::Query_ConstraintExpr::kAnd:
-        return And::check(constraint.and_(), i);
+        return And::check(constraint.and_(), i, lookups);
       case fetch::oef::pb::Query_ConstraintExpr::kNot:
-        return Not::check(constraint.not_(), i);
+        return Not::check(constraint.not_(), i, lookups);
       case fetch::oef::pb::Query_ConstraintExpr::kConstraint:
-        return Constraint::check(constraint.constraint(), i);
+        return Constraint::check(constraint.constraint(), i, lookups);
       case fetch::oef::pb::Query_ConstraintExpr::EXPRESSION_NOT_SET:
         // should not reach this line
         return false;
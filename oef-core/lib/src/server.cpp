@@ -16,188 +16,630 @@
 //
 //------------------------------------------------------------------------------
 
-#define DEBUG_ON 1
 #include "server.hpp"
+#include "clientmsg.hpp"
+#include "trace.hpp"
+#include "timingwheel.hpp"
 #include <iostream>
 #include <google/protobuf/text_format.h>
 #include <sstream>
 #include <iomanip>
+#include <deque>
 
 namespace fetch {
   namespace oef {
     fetch::oef::Logger Server::logger = fetch::oef::Logger("oef-node");
     fetch::oef::Logger AgentDirectory::logger = fetch::oef::Logger("agent-directory");
+
+    NodeMetrics::NodeMetrics(Metrics &metrics)
+      : agentsFound{metrics.histogram("oef_search_results", "Agents found by a search.", 1.0, "operation=\"search_agents\"")},
+        servicesFound{metrics.histogram("oef_search_results", "Agents found by a search.", 1.0, "operation=\"search_services\"")},
+        handshakes{metrics.histogram("oef_handshake_duration_seconds", "Time from connection to session start.", 1e-9)},
+        connections{metrics.counter("oef_connections_total", "Connections accepted.")},
+        bytesReceived{metrics.counter("oef_received_bytes_total", "Bytes received from agents.")},
+        bytesSent{metrics.counter("oef_sent_bytes_total", "Bytes sent to agents.")},
+        oefErrors{metrics.counter("oef_errors_total", "OEFErrors sent to agents.")},
+        dialogueErrors{metrics.counter("oef_dialogue_errors_total", "Messages that could not be delivered.")},
+        queuedBytes{metrics.gauge("oef_outbound_queued_bytes", "Bytes waiting to be sent to agents.")},
+        queuedMessages{metrics.gauge("oef_outbound_queued_messages", "Messages waiting to be sent to agents.")},
+        dropped{metrics.counter("oef_outbound_dropped_total", "Messages dropped because their destination's queue was full.")},
+        paused{metrics.counter("oef_paused_reads_total", "Times an agent was not read until a queue drained.")},
+        disconnected{metrics.counter("oef_overflow_disconnects_total", "Agents disconnected because their queue was full.")},
+        pings{metrics.counter("oef_pings_total", "Pings sent to idle agents.")},
+        evictions{metrics.counter("oef_idle_evictions_total", "Agents disconnected because they were idle too long.")} {
+      const auto *payload = fetch::oef::pb::Envelope::descriptor()->FindOneofByName("payload");
+      int last = 0;
+      for(int i = 0; i < payload->field_count(); ++i) {
+        last = std::max(last, payload->field(i)->number());
+      }
+      requests.resize(size_t(last) + 1);
+      durations.resize(size_t(last) + 1);
+      // PAYLOAD_NOT_SET is 0.
+      for(int i = 0; i <= payload->field_count(); ++i) {
+        int number = i < payload->field_count() ? payload->field(i)->number() : 0;
+        std::string labels = "operation=\"" + (number ? payload->field(i)->name() : std::string{"unknown"}) + "\"";
+        requests[size_t(number)] = &metrics.counter("oef_requests_total", "Requests received, per operation.", labels);
+        durations[size_t(number)] = &metrics.histogram("oef_request_duration_seconds", "Time to process a request, per operation.",
+                                                        1e-9, labels);
+      }
+      for(size_t i = 0; i < requests.size(); ++i) { // numbers the payload does not use
+        if(!requests[i]) {
+          requests[i] = requests[0];
+          durations[i] = durations[0];
+        }
+      }
+    }
     
+    bool SessionLimits::parse(const std::string &name, Overflow &overflow) {
+      static const std::unordered_map<std::string,Overflow> names{
+        {"drop", Overflow::Drop}, {"pause", Overflow::Pause}, {"disconnect", Overflow::Disconnect}};
+      auto iter = names.find(name);
+      if(iter == names.end()) {
+        return false;
+      }
+      overflow = iter->second;
+      return true;
+    }
+
     std::string to_string(const google::protobuf::Message &msg) {
       std::string output;
       google::protobuf::TextFormat::PrintToString(msg, &output);
       return output;
     }
+    // Text of msg, only rendered if the log line it is an argument of is written.
+    class Dump {
+    private:
+      const google::protobuf::Message &msg_;
+    public:
+      explicit Dump(const google::protobuf::Message &msg) : msg_{msg} {}
+      friend std::ostream &operator<<(std::ostream &os, const Dump &dump) {
+        return os << to_string(dump.msg_);
+      }
+    };
     class AgentSession : public std::enable_shared_from_this<AgentSession>
     {
     private:
       const std::string publicKey_;
-      stde::optional<Instance> description_;
       AgentDirectory &agentDirectory_;
       ServiceDirectory &serviceDirectory_;
+      DataModelRegistry &dataModels_;
+      NodeMetrics &metrics_;
+      const SessionLimits &limits_;
       tcp::socket socket_;
 
+      struct Frame {
+        uint32_t size;
+        std::shared_ptr<Buffer> buffer;
+        std::function<void()> failed; // called if the frame is not sent
+      };
+      // Frames to send, the front one being written: one write at a time, whichever thread queues them.
+      // References to the front survive push_back, so its size can be written from the queue.
+      std::mutex writeLock_;
+      std::deque<Frame> queue_;
+      size_t queuedBytes_ = 0;
+      bool closed_ = false;
+      std::vector<std::weak_ptr<AgentSession>> waiting_; // not read until the queue drains
+      std::shared_ptr<AgentSession> blockedOn_; // set by process(): its queue must drain before the next read
+      std::atomic<int64_t> lastRead_{now()}; // in milliseconds, of the last bytes read
+      std::atomic<bool> held_{false}; // not read until a queue drains: its silence is the node's doing
+      std::atomic<bool> removed_{false};
+      uint64_t pings_ = 0;
+
       static fetch::oef::Logger logger;
       
     public:
-      explicit AgentSession(std::string publicKey, AgentDirectory &agentDirectory, ServiceDirectory &serviceDirectory, tcp::socket socket)
-        : publicKey_{std::move(publicKey)}, agentDirectory_{agentDirectory}, serviceDirectory_{serviceDirectory}, socket_(std::move(socket)) {}
+      explicit AgentSession(std::string publicKey, AgentDirectory &agentDirectory, ServiceDirectory &serviceDirectory,
+                            DataModelRegistry &dataModels, NodeMetrics &metrics, const SessionLimits &limits, tcp::socket socket)
+        : publicKey_{std::move(publicKey)}, agentDirectory_{agentDirectory}, serviceDirectory_{serviceDirectory},
+          dataModels_{dataModels}, metrics_{metrics}, limits_{limits}, socket_(std::move(socket)) {}
       virtual ~AgentSession() {
         logger.trace("~AgentSession");
-        //socket_.shutdown(asio::socket_base::shutdown_both);
+        metrics_.queuedBytes.add(-int64_t(queuedBytes_));
+        metrics_.queuedMessages.add(-int64_t(queue_.size()));
       }
       AgentSession(const AgentSession &) = delete;
       AgentSession operator=(const AgentSession &) = delete;
       void start() {
         read();
+        watch();
       }
+      // Queues an answer to the agent's own request.
       void write(std::shared_ptr<Buffer> buffer) {
-        asyncWriteBuffer(socket_, std::move(buffer), 5);
+        std::lock_guard<std::mutex> lock(writeLock_);
+        if(!closed_) {
+          push(std::move(buffer), nullptr);
+        }
       }
       void send(const fetch::oef::pb::Server_AgentMessage &msg) {
-        asyncWriteBuffer(socket_, serialize(msg), 10 /* sec ? */);
+        write(serialize(msg));
       }
-      std::string id() const { return publicKey_; }
-      bool match(const QueryModel &query) const {
-        if(!description_) {
+      // Queues a message from another agent, unless the queue is full and the limits say to drop it or to
+      // disconnect the agent. Returns false if the message will not be sent; otherwise failed is called if it
+      // cannot be.
+      bool deliver(std::shared_ptr<Buffer> buffer, std::function<void()> failed) {
+        std::lock_guard<std::mutex> lock(writeLock_);
+        if(closed_) {
+          return false;
+        }
+        if(full()) {
+          switch(limits_.overflow) {
+          case SessionLimits::Overflow::Drop:
+            metrics_.dropped.add();
+            return false;
+          case SessionLimits::Overflow::Disconnect:
+            logger.info("AgentSession::deliver disconnecting {}: {} messages, {} bytes queued", publicKey_, queue_.size(), queuedBytes_);
+            metrics_.disconnected.add();
+            close();
+            return false;
+          case SessionLimits::Overflow::Pause:
+            break;
+          }
+        }
+        push(std::move(buffer), std::move(failed));
+        return true;
+      }
+      // Holds session's reads while the queue is full, until it drains. Returns false if it is not full.
+      bool wait(const std::shared_ptr<AgentSession> &session) {
+        std::lock_guard<std::mutex> lock(writeLock_);
+        if(closed_ || !full()) {
           return false;
         }
-        return query.check(*description_);
+        waiting_.emplace_back(session);
+        return true;
       }
+      std::string id() const { return publicKey_; }
     private:
-      void processRegisterDescription(uint32_t msg_id, const fetch::oef::pb::AgentDescription &desc) {
-        description_ = Instance(desc.description());
-        DEBUG(logger, "AgentSession::processRegisterDescription setting description to agent {} : {}", publicKey_, to_string(desc));
-        if(!description_) {
-          fetch::oef::pb::Server_AgentMessage answer;
-          answer.set_answer_id(msg_id);
-          auto *error = answer.mutable_oef_error();
-          error->set_operation(fetch::oef::pb::Server_AgentMessage_OEFError::REGISTER_DESCRIPTION);
-          logger.trace("AgentSession::processRegisterDescription sending error {} to {}", error->operation(), publicKey_);
-          send(answer);
+      static int64_t now() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+      }
+      // Checks every half idle timeout whether the agent was heard from: pings it after half the timeout and
+      // evicts it after the whole, so an agent that answers pings is never idle for long. Agents the node
+      // does not read, as it waits for a queue to drain, are not checked.
+      void watch() {
+        if(limits_.idleTimeout == 0) {
+          return;
+        }
+        auto &io_context = static_cast<asio::io_context&>(socket_.get_executor().context());
+        std::weak_ptr<AgentSession> weak = shared_from_this();
+        asio::use_service<TimingWheel>(io_context).start(std::max(1u, limits_.idleTimeout / 2), [&io_context,weak]() {
+            asio::post(io_context, [weak]() {
+                if(auto session = weak.lock()) {
+                  session->check();
+                }
+              });
+          });
+      }
+      void check() {
+        auto idle = now() - lastRead_.load(std::memory_order_relaxed);
+        bool closed;
+        bool ping = false;
+        {
+          std::lock_guard<std::mutex> lock(writeLock_);
+          if(held_) {
+            idle = 0;
+          }
+          if(!closed_ && idle >= int64_t(limits_.idleTimeout) * 1000) {
+            logger.info("AgentSession::check evicting {}: idle for {}ms", publicKey_, idle);
+            metrics_.evictions.add();
+            close();
+          }
+          closed = closed_;
+          // a full queue is already waiting for the agent: the write timeout covers it
+          ping = !closed_ && !full() && idle >= int64_t(limits_.idleTimeout) * 500;
+        }
+        if(closed) {
+          // its reads may not fail, if it waits for a queue to drain
+          remove();
+          return;
+        }
+        if(ping) {
+          fetch::oef::pb::Server_AgentMessage msg;
+          msg.set_answer_id(0);
+          msg.mutable_ping()->set_nonce(++pings_);
+          metrics_.pings.add();
+          send(msg);
+        }
+        watch();
+      }
+      // Takes the agent out of the directories, once.
+      void remove() {
+        if(!removed_.exchange(true)) {
+          agentDirectory_.remove(publicKey_);
+          serviceDirectory_.unregisterAll(publicKey_);
+        }
+      }
+      // The queue methods are called with writeLock_ held.
+      bool full() const {
+        return queuedBytes_ >= limits_.bytes || queue_.size() >= limits_.messages;
+      }
+      bool drained() const {
+        return queuedBytes_ <= limits_.bytes / 2 && queue_.size() <= limits_.messages / 2;
+      }
+      void push(std::shared_ptr<Buffer> buffer, std::function<void()> failed) {
+        auto size = uint32_t(buffer->size());
+        queue_.push_back(Frame{size, std::move(buffer), std::move(failed)});
+        queuedBytes_ += size;
+        metrics_.queuedBytes.add(size);
+        metrics_.queuedMessages.add();
+        if(queue_.size() == 1) {
+          do_write();
+        }
+      }
+      void pop() {
+        metrics_.queuedBytes.add(-int64_t(queue_.front().size));
+        metrics_.queuedMessages.add(-1);
+        queuedBytes_ -= queue_.front().size;
+        queue_.pop_front();
+      }
+      void do_write() {
+        auto &frame = queue_.front();
+        std::array<asio::const_buffer,2> buffers{{asio::buffer(&frame.size, sizeof(frame.size)),
+                                                  asio::buffer(frame.buffer->data(), frame.size)}};
+        auto self(shared_from_this());
+        std::shared_ptr<TimingWheel::Deadline> deadline;
+        if(limits_.writeTimeout) {
+          auto &wheel = asio::use_service<TimingWheel>(static_cast<asio::io_context&>(socket_.get_executor().context()));
+          deadline = wheel.start(limits_.writeTimeout, [self]() {
+              self->shutdown();
+            });
+        }
+        asio::async_write(socket_, buffers, [this,self,deadline](std::error_code ec, std::size_t length) {
+            if(deadline && !deadline->complete()) {
+              ec = asio::error::timed_out;
+            }
+            written(ec, length);
+          });
+      }
+      // The agent's reads fail once its socket is shut down, which removes it from the directories.
+      void close() {
+        closed_ = true;
+        shutdown();
+      }
+      // Other sessions' threads and the timing wheel close sessions, while the socket's reads and writes are pending:
+      // the shutdown is posted to the socket's own thread, and made under writeLock_, as the writes that other threads
+      // start are. Asio sockets are not safe for concurrent calls.
+      void shutdown() {
+        auto self(shared_from_this());
+        asio::post(socket_.get_executor(), [this,self]() {
+            std::lock_guard<std::mutex> lock(writeLock_);
+            std::error_code ignored;
+            socket_.shutdown(tcp::socket::shutdown_both, ignored);
+          });
+      }
+      void written(std::error_code ec, std::size_t length) {
+        std::vector<std::function<void()>> failures;
+        std::vector<std::weak_ptr<AgentSession>> resumed;
+        {
+          std::lock_guard<std::mutex> lock(writeLock_);
+          if(ec) {
+            logger.info("AgentSession::written error on id {} ec {}", publicKey_, ec);
+            closed_ = true;
+            while(!queue_.empty()) {
+              if(queue_.front().failed) {
+                failures.emplace_back(std::move(queue_.front().failed));
+              }
+              pop();
+            }
+          } else {
+            metrics_.bytesSent.add(length);
+            pop();
+            if(!queue_.empty()) {
+              do_write();
+            }
+          }
+          if(closed_ || drained()) {
+            resumed.swap(waiting_);
+          }
+        }
+        for(auto &f : failures) {
+          f();
+        }
+        for(auto &w : resumed) {
+          if(auto session = w.lock()) {
+            // its reads are started on its own thread
+            asio::post(session->socket_.get_executor(), [session]() { session->resume(); });
+          }
+        }
+      }
+
+      // Every request is decoded, and its answer built, on an arena whose first block belongs to the session:
+      // most requests then never reach malloc, and whatever they do allocate is released in one go.
+      static constexpr size_t arenaBlockSize = 4096;
+      std::vector<char> arenaBlock_ = std::vector<char>(arenaBlockSize);
+
+      static fetch::oef::pb::Server_AgentMessage *answer(google::protobuf::Arena &arena, uint32_t msg_id) {
+        auto *answer = google::protobuf::Arena::CreateMessage<fetch::oef::pb::Server_AgentMessage>(&arena);
+        answer->set_answer_id(msg_id);
+        return answer;
+      }
+      // unknownModel tells the agent to send the data model in full: the message referred to one the node does not keep.
+      void sendOEFError(google::protobuf::Arena &arena, uint32_t msg_id, fetch::oef::pb::Server_AgentMessage_OEFError_Operation operation,
+                        bool unknownModel = false) {
+        auto *error_answer = answer(arena, msg_id);
+        auto *error = error_answer->mutable_oef_error();
+        error->set_operation(operation);
+        if(unknownModel) {
+          error->set_unknown_model(true);
+        }
+        metrics_.oefErrors.add();
+        logger.trace("AgentSession::sendOEFError sending error {} to {}", error->operation(), publicKey_);
+        send(*error_answer);
+      }
+      void processRegisterDescription(google::protobuf::Arena &arena, uint32_t msg_id, const fetch::oef::pb::AgentDescription &desc) {
+        DEBUG(logger, "AgentSession::processRegisterDescription setting description to agent {} : {}", publicKey_, Dump{desc});
+        bool success = false;
+        bool unknownModel = false;
+        try {
+          auto instance = dataModels_.resolve(desc.description());
+          success = agentDirectory_.registerDescription(publicKey_, instance);
+          if(success) {
+            dataModels_.intern(instance.dataModel());
+          }
+        } catch(UnknownDataModel &e) {
+          logger.info("AgentSession::processRegisterDescription from agent {}: {}", publicKey_, e.what());
+          unknownModel = true;
+        } catch(std::invalid_argument &e) {
+          logger.info("AgentSession::processRegisterDescription from agent {}: {}", publicKey_, e.what());
+        }
+        if(!success) {
+          sendOEFError(arena, msg_id, fetch::oef::pb::Server_AgentMessage_OEFError::REGISTER_DESCRIPTION, unknownModel);
         }
       }
       void processUnregisterDescription(uint32_t msg_id) {
-        description_ = stde::nullopt;
+        agentDirectory_.unregisterDescription(publicKey_);
         DEBUG(logger, "AgentSession::processUnregisterDescription setting description to agent {}", publicKey_);
       }
-      void processRegisterService(uint32_t msg_id, const fetch::oef::pb::AgentDescription &desc) {
-        DEBUG(logger, "AgentSession::processRegisterService registering agent {} : {}", publicKey_, to_string(desc));
-        bool success = serviceDirectory_.registerAgent(Instance(desc.description()), publicKey_);
+      void processRegisterService(google::protobuf::Arena &arena, uint32_t msg_id, const fetch::oef::pb::AgentDescription &desc) {
+        DEBUG(logger, "AgentSession::processRegisterService registering agent {} : {}", publicKey_, Dump{desc});
+        bool success = false;
+        bool unknownModel = false;
+        try {
+          auto instance = dataModels_.resolve(desc.description());
+          success = serviceDirectory_.registerAgent(instance, publicKey_);
+          if(success) {
+            dataModels_.intern(instance.dataModel());
+          }
+        } catch(UnknownDataModel &e) {
+          logger.info("AgentSession::processRegisterService from agent {}: {}", publicKey_, e.what());
+          unknownModel = true;
+        } catch(std::invalid_argument &e) {
+          logger.info("AgentSession::processRegisterService from agent {}: {}", publicKey_, e.what());
+        }
         if(!success) {
-          fetch::oef::pb::Server_AgentMessage answer;
-          answer.set_answer_id(msg_id);
-          auto *error = answer.mutable_oef_error();
-          error->set_operation(fetch::oef::pb::Server_AgentMessage_OEFError::REGISTER_SERVICE);
-          logger.trace("AgentSession::processRegisterService sending error {} to {}", error->operation(), publicKey_);
-          send(answer);
+          sendOEFError(arena, msg_id, fetch::oef::pb::Server_AgentMessage_OEFError::REGISTER_SERVICE, unknownModel);
         }
       }
-      void processUnregisterService(uint32_t msg_id, const fetch::oef::pb::AgentDescription &desc) {
-        DEBUG(logger, "AgentSession::processUnregisterService unregistering agent {} : {}", publicKey_, to_string(desc));
-        bool success = serviceDirectory_.unregisterAgent(Instance(desc.description()), publicKey_);
+      void processUnregisterService(google::protobuf::Arena &arena, uint32_t msg_id, const fetch::oef::pb::AgentDescription &desc) {
+        DEBUG(logger, "AgentSession::processUnregisterService unregistering agent {} : {}", publicKey_, Dump{desc});
+        bool success = false;
+        bool unknownModel = false;
+        try {
+          success = serviceDirectory_.unregisterAgent(dataModels_.resolve(desc.description()), publicKey_);
+        } catch(UnknownDataModel &e) {
+          logger.info("AgentSession::processUnregisterService from agent {}: {}", publicKey_, e.what());
+          unknownModel = true;
+        } catch(std::invalid_argument &e) {
+          logger.info("AgentSession::processUnregisterService from agent {}: {}", publicKey_, e.what());
+        }
         if(!success) {
-          fetch::oef::pb::Server_AgentMessage answer;
-          answer.set_answer_id(msg_id);
-          auto *error = answer.mutable_oef_error();
-          error->set_operation(fetch::oef::pb::Server_AgentMessage_OEFError::UNREGISTER_SERVICE);
-          logger.trace("AgentSession::processUnregisterService sending error {} to {}", error->operation(), publicKey_);
-          send(answer);
+          sendOEFError(arena, msg_id, fetch::oef::pb::Server_AgentMessage_OEFError::UNREGISTER_SERVICE, unknownModel);
         }
       }
-      void processSearchAgents(uint32_t msg_id, const fetch::oef::pb::AgentSearch &search) {
-        QueryModel model{search.query()};
-        DEBUG(logger, "AgentSession::processSearchAgents from agent {} : {}", publicKey_, to_string(search));
-        auto agents_vec = agentDirectory_.search(model);
-        fetch::oef::pb::Server_AgentMessage answer;
-        answer.set_answer_id(msg_id);
-        auto agents = answer.mutable_agents();
+      // Descriptions the node cannot resolve fail on their own, without failing the rest of the batch.
+      void processServices(google::protobuf::Arena &arena, uint32_t msg_id, const fetch::oef::pb::AgentDescriptions &descs,
+                           fetch::oef::pb::Server_AgentMessage_OEFError_Operation operation) {
+        DEBUG(logger, "AgentSession::processServices {} {} descriptions from agent {} : {}", operation, descs.descriptions_size(), publicKey_, Dump{descs});
+        std::vector<Instance> instances;
+        std::vector<size_t> items;
+        std::vector<bool> unknown;
+        instances.reserve(descs.descriptions_size());
+        items.reserve(descs.descriptions_size());
+        for(int i = 0; i < descs.descriptions_size(); ++i) {
+          try {
+            instances.emplace_back(dataModels_.resolve(descs.descriptions(i)));
+            items.push_back(size_t(i));
+          } catch(UnknownDataModel &e) {
+            logger.info("AgentSession::processServices item {} from agent {}: {}", i, publicKey_, e.what());
+            unknown.resize(size_t(descs.descriptions_size()), false);
+            unknown[size_t(i)] = true;
+          } catch(std::invalid_argument &e) {
+            logger.info("AgentSession::processServices item {} from agent {}: {}", i, publicKey_, e.what());
+          }
+        }
+        auto done = operation == fetch::oef::pb::Server_AgentMessage_OEFError::REGISTER_SERVICE
+          ? serviceDirectory_.registerAgent(instances, publicKey_)
+          : serviceDirectory_.unregisterAgent(instances, publicKey_);
+        std::vector<bool> status(size_t(descs.descriptions_size()), false);
+        for(size_t i = 0; i < items.size(); ++i) {
+          status[items[i]] = done[i];
+          if(done[i] && operation == fetch::oef::pb::Server_AgentMessage_OEFError::REGISTER_SERVICE) {
+            dataModels_.intern(instances[i].dataModel());
+          }
+        }
+        auto *status_answer = answer(arena, msg_id);
+        RegistrationStatus::encode(operation, status, *status_answer->mutable_registration_status(), unknown);
+        logger.trace("AgentSession::processServices sending status of {} items to {}", status.size(), publicKey_);
+        send(*status_answer);
+      }
+      void processUpdateDescription(google::protobuf::Arena &arena, uint32_t msg_id, const fetch::oef::pb::AgentUpdate &update) {
+        DEBUG(logger, "AgentSession::processUpdateDescription updating agent {} : {}", publicKey_, Dump{update});
+        bool success = false;
+        try {
+          success = agentDirectory_.updateDescription(publicKey_, update.values(), update.removed());
+        } catch(std::invalid_argument &e) {
+          logger.info("AgentSession::processUpdateDescription from agent {}: {}", publicKey_, e.what());
+        }
+        if(!success) {
+          sendOEFError(arena, msg_id, fetch::oef::pb::Server_AgentMessage_OEFError::UPDATE_DESCRIPTION);
+        }
+      }
+      void processUpdateService(google::protobuf::Arena &arena, uint32_t msg_id, const fetch::oef::pb::AgentUpdate &update) {
+        DEBUG(logger, "AgentSession::processUpdateService updating agent {} : {}", publicKey_, Dump{update});
+        bool success = false;
+        try {
+          if(update.has_model()) {
+            const auto &model = update.model();
+            success = bool(serviceDirectory_.update(model.name(), Fingerprint{model.hi(), model.lo()},
+                                                    Fingerprint{update.service_hi(), update.service_lo()}, publicKey_,
+                                                    update.values(), update.removed()));
+          }
+        } catch(std::invalid_argument &e) {
+          logger.info("AgentSession::processUpdateService from agent {}: {}", publicKey_, e.what());
+        }
+        if(!success) {
+          sendOEFError(arena, msg_id, fetch::oef::pb::Server_AgentMessage_OEFError::UPDATE_SERVICE);
+        }
+      }
+      void sendSearchResult(google::protobuf::Arena &arena, uint32_t msg_id, const std::vector<std::string> &agents_vec) {
+        auto *search_answer = answer(arena, msg_id);
+        auto agents = search_answer->mutable_agents();
+        agents->mutable_agents()->Reserve(agents_vec.size());
         for(auto &a : agents_vec) {
           agents->add_agents(a);
         }
-        logger.trace("AgentSession::processSearchAgents sending {} agents to {}", agents_vec.size(), publicKey_);
-        send(answer);
+        logger.trace("AgentSession::sendSearchResult sending {} agents to {}", agents_vec.size(), publicKey_);
+        send(*search_answer);
       }
-      void processQuery(uint32_t msg_id, const fetch::oef::pb::AgentSearch &search) {
+      // Queries on a data model the node knows are checked against the node's copy of it, which is returned in dm.
+      bool valid(const QueryModel &model, stde::optional<DataModel> &dm) const {
+        if(model.handle().has_model()) {
+          dm = dataModels_.find(model.handle().model());
+          if(dm) {
+            return model.valid(*dm);
+          }
+        }
+        return model.valid();
+      }
+      void processSearchAgents(google::protobuf::Arena &arena, uint32_t msg_id, const fetch::oef::pb::AgentSearch &search) {
         QueryModel model{search.query()};
-        DEBUG(logger, "AgentSession::processQuery from agent {} : {}", publicKey_, to_string(search));
-        auto agents_vec = serviceDirectory_.query(model);
-        fetch::oef::pb::Server_AgentMessage answer;
-        answer.set_answer_id(msg_id);
-        auto agents = answer.mutable_agents();
-        for(auto &a : agents_vec) {
-          agents->add_agents(a);
+        DEBUG(logger, "AgentSession::processSearchAgents from agent {} : {}", publicKey_, Dump{search});
+        stde::optional<DataModel> dm;
+        if(!valid(model, dm)) {
+          logger.info("AgentSession::processSearchAgents invalid query from agent {}", publicKey_);
+          sendSearchResult(arena, msg_id, {});
+          return;
+        }
+        agentDirectory_.optimise(model, dm ? &*dm : nullptr);
+        auto agents = agentDirectory_.search(model);
+        metrics_.agentsFound.record(agents.size());
+        sendSearchResult(arena, msg_id, agents);
+      }
+      void processQuery(google::protobuf::Arena &arena, uint32_t msg_id, const fetch::oef::pb::AgentSearch &search) {
+        QueryModel model{search.query()};
+        DEBUG(logger, "AgentSession::processQuery from agent {} : {}", publicKey_, Dump{search});
+        stde::optional<DataModel> dm;
+        if(!valid(model, dm)) {
+          logger.info("AgentSession::processQuery invalid query from agent {}", publicKey_);
+          sendSearchResult(arena, msg_id, {});
+          return;
         }
-        logger.trace("AgentSession::processQuery sending {} agents to {}", agents_vec.size(), publicKey_);
-        send(answer);
+        serviceDirectory_.optimise(model, dm ? &*dm : nullptr);
+        auto agents = serviceDirectory_.query(model);
+        metrics_.servicesFound.record(agents.size());
+        sendSearchResult(arena, msg_id, agents);
       }
-      void sendDialogError(uint32_t msg_id, uint32_t dialogue_id, const std::string &origin) {
-        fetch::oef::pb::Server_AgentMessage answer;
-        answer.set_answer_id(msg_id);
-        auto *error = answer.mutable_dialogue_error();
+      void sendDialogError(google::protobuf::Arena &arena, uint32_t msg_id, uint32_t dialogue_id, const std::string &origin) {
+        auto *error_answer = answer(arena, msg_id);
+        auto *error = error_answer->mutable_dialogue_error();
         error->set_dialogue_id(dialogue_id);
         error->set_origin(origin);
+        metrics_.dialogueErrors.add();
         logger.trace("AgentSession::processMessage sending dialogue error {} to {}", dialogue_id, publicKey_);
-        send(answer);
+        send(*error_answer);
       }
-      void processMessage(uint32_t msg_id, fetch::oef::pb::Agent_Message *msg) {
+      // trace is the message's, if it is sampled.
+      void processMessage(google::protobuf::Arena &arena, uint32_t msg_id, fetch::oef::pb::Agent_Message *msg,
+                          fetch::oef::pb::Trace *trace) {
         auto session = agentDirectory_.session(msg->destination());
-        DEBUG(logger, "AgentSession::processMessage from agent {} : {}", publicKey_, to_string(*msg));
+        DEBUG(logger, "AgentSession::processMessage from agent {} : {}", publicKey_, Dump{*msg});
         logger.trace("AgentSession::processMessage to {} from {}", msg->destination(), publicKey_);
         uint32_t did = msg->dialogue_id();
         if(session) {
-          fetch::oef::pb::Server_AgentMessage message;
-          message.set_answer_id(msg_id);
-          auto content = message.mutable_content();
+          auto *message = answer(arena, msg_id);
+          auto content = message->mutable_content();
           content->set_dialogue_id(did);
           content->set_origin(publicKey_);
+          // msg and message live on the same arena: hand the payload over instead of copying it.
           if(msg->has_content()) {
-            content->set_allocated_content(msg->release_content());
+            content->set_content(std::move(*msg->mutable_content()));
           }
           if(msg->has_fipa()) {
-            content->set_allocated_fipa(msg->release_fipa());
+            content->unsafe_arena_set_allocated_fipa(msg->unsafe_arena_release_fipa());
           }
-          DEBUG(logger, "AgentSession::processMessage to agent {} : {}", msg->destination(), to_string(message));
-          auto buffer = serialize(message);
-          asyncWriteBuffer(session->socket_, buffer, 5, [this,did,msg_id,msg](std::error_code ec, std::size_t length) {
-              if(ec) {
-                sendDialogError(msg_id, did, msg->destination());
-              }
+          if(trace) {
+            trace->set_node_forward(Tracer::now());
+            Tracer::instance().write(*trace, "node");
+            message->unsafe_arena_set_allocated_trace(trace);
+          }
+          DEBUG(logger, "AgentSession::processMessage to agent {} : {}", msg->destination(), Dump{*message});
+          auto self(shared_from_this());
+          bool queued = session->deliver(serialize(*message), [this,self,did,msg_id,destination = msg->destination()]() {
+              google::protobuf::Arena error_arena;
+              sendDialogError(error_arena, msg_id, did, destination);
             });
+          if(!queued) {
+            sendDialogError(arena, msg_id, did, msg->destination());
+          } else if(limits_.overflow == SessionLimits::Overflow::Pause) {
+            blockedOn_ = std::move(session);
+          }
         } else {
-          sendDialogError(msg_id, did, msg->destination());
+          sendDialogError(arena, msg_id, did, msg->destination());
         }
       }
       void process(const std::shared_ptr<Buffer> &buffer) {
-        auto envelope = deserialize<fetch::oef::pb::Envelope>(*buffer);
-        auto payload_case = envelope.payload_case();
-        uint32_t msg_id = envelope.msg_id();
+        auto received = Tracer::now();
+        google::protobuf::ArenaOptions options;
+        options.initial_block = arenaBlock_.data();
+        options.initial_block_size = arenaBlock_.size();
+        google::protobuf::Arena arena{options};
+        auto *envelope = google::protobuf::Arena::CreateMessage<fetch::oef::pb::Envelope>(&arena);
+        envelope->ParseFromArray(buffer->data(), buffer->size());
+        auto payload_case = envelope->payload_case();
+        uint32_t msg_id = envelope->msg_id();
+        fetch::oef::pb::Trace *trace = nullptr;
+        if(envelope->has_trace()) {
+          trace = envelope->unsafe_arena_release_trace();
+          trace->set_node_receive(received);
+        }
+        metrics_.bytesReceived.add(buffer->size() + sizeof(uint32_t));
+        metrics_.request(payload_case).add();
+        Stopwatch stopwatch{metrics_.duration(payload_case)};
         switch(payload_case) {
         case fetch::oef::pb::Envelope::kSendMessage:
-          processMessage(msg_id, envelope.release_send_message());
+          processMessage(arena, msg_id, envelope->mutable_send_message(), trace);
           break;
         case fetch::oef::pb::Envelope::kRegisterService:
-          processRegisterService(msg_id, envelope.register_service());
+          processRegisterService(arena, msg_id, envelope->register_service());
           break;
         case fetch::oef::pb::Envelope::kUnregisterService:
-          processUnregisterService(msg_id, envelope.unregister_service());
+          processUnregisterService(arena, msg_id, envelope->unregister_service());
+          break;
+        case fetch::oef::pb::Envelope::kRegisterServices:
+          processServices(arena, msg_id, envelope->register_services(), fetch::oef::pb::Server_AgentMessage_OEFError::REGISTER_SERVICE);
+          break;
+        case fetch::oef::pb::Envelope::kUnregisterServices:
+          processServices(arena, msg_id, envelope->unregister_services(), fetch::oef::pb::Server_AgentMessage_OEFError::UNREGISTER_SERVICE);
           break;
         case fetch::oef::pb::Envelope::kRegisterDescription:
-          processRegisterDescription(msg_id, envelope.register_description());
+          processRegisterDescription(arena, msg_id, envelope->register_description());
           break;
         case fetch::oef::pb::Envelope::kUnregisterDescription:
           processUnregisterDescription(msg_id);
           break;
+        case fetch::oef::pb::Envelope::kUpdateDescription:
+          processUpdateDescription(arena, msg_id, envelope->update_description());
+          break;
+        case fetch::oef::pb::Envelope::kUpdateService:
+          processUpdateService(arena, msg_id, envelope->update_service());
+          break;
         case fetch::oef::pb::Envelope::kSearchAgents:
-          processSearchAgents(msg_id, envelope.search_agents());
+          processSearchAgents(arena, msg_id, envelope->search_agents());
           break;
         case fetch::oef::pb::Envelope::kSearchServices:
-          processQuery(msg_id, envelope.search_services());
+          processQuery(arena, msg_id, envelope->search_services());
+          break;
+        case fetch::oef::pb::Envelope::kPong:
+          // the agent was heard from, which is all a pong is for
           break;
         case fetch::oef::pb::Envelope::PAYLOAD_NOT_SET:
           logger.error("AgentSession::process cannot process payload {} from {}", payload_case, publicKey_);
@@ -205,31 +647,40 @@ namespace fetch {
       }
       void read() {
         auto self(shared_from_this());
-        asyncReadBuffer(socket_, 5, [this, self](std::error_code ec, std::shared_ptr<Buffer> buffer) {
+        asyncReadBuffer(socket_, 0, [this, self](std::error_code ec, std::shared_ptr<Buffer> buffer) {
                                 if(ec) {
-                                  agentDirectory_.remove(publicKey_);
-                                  serviceDirectory_.unregisterAll(publicKey_);
+                                  remove();
                                   logger.info("AgentSession::read error on id {} ec {}", publicKey_, ec);
                                 } else {
+                                  lastRead_.store(now(), std::memory_order_relaxed);
                                   process(buffer);
-                                  read();
-                                }});
+                                  next();
+                                }},
+          [this]() { lastRead_.store(now(), std::memory_order_relaxed); }); // a large message in progress is activity
+      }
+      void resume() {
+        held_ = false;
+        lastRead_.store(now(), std::memory_order_relaxed);
+        read();
+      }
+      // Reads the next request, unless the session's own queue, or that of the agent its last message went
+      // to, has to drain first.
+      void next() {
+        auto self(shared_from_this());
+        auto blocker = blockedOn_ ? std::move(blockedOn_) : self;
+        held_ = true; // before the queue can resume it
+        if(blocker->wait(self)) {
+          DEBUG(logger, "AgentSession::next {} waits for {} to drain", publicKey_, blocker->publicKey_);
+          metrics_.paused.add();
+        } else {
+          held_ = false;
+          read();
+        }
       }
       
     };
     fetch::oef::Logger AgentSession::logger = fetch::oef::Logger("oef-node::agent-session");
 
-    const std::vector<std::string> AgentDirectory::search(const QueryModel &query) const {
-      std::lock_guard<std::mutex> lock(lock_);
-      std::vector<std::string> res;
-      for(const auto &s : sessions_) {
-        if(s.second->match(query)) {
-          res.emplace_back(s.first);
-        }
-      }
-      return res;
-    }
-
     void Server::secretHandshake(const std::string &publicKey, const std::shared_ptr<Context> &context) {
       fetch::oef::pb::Server_Phrase phrase;
       phrase.set_phrase("RandomlyGeneratedString");
@@ -245,8 +696,11 @@ namespace fetch {
                           try {
                             auto ans = deserialize<fetch::oef::pb::Agent_Server_Answer>(*buffer);
                             logger.trace("Server::secretHandshake secret [{}]", ans.answer());
-                            auto session = std::make_shared<AgentSession>(publicKey, agentDirectory_, serviceDirectory_, std::move(context->socket_));
+                            auto session = std::make_shared<AgentSession>(publicKey, agentDirectory_, serviceDirectory_, dataModels_, nodeMetrics_,
+                                                                          limits_, std::move(context->socket_));
                             if(agentDirectory_.add(publicKey, session)) {
+                              auto elapsed = std::chrono::steady_clock::now() - context->start_;
+                              nodeMetrics_.handshakes.record(uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
                               session->start();
                               fetch::oef::pb::Server_Connected status;
                               status.set_status(true);
@@ -278,7 +732,7 @@ namespace fetch {
                           try {
                             logger.trace("Server::newSession received {} bytes", buffer->size());
                             auto id = deserialize<fetch::oef::pb::Agent_Server_ID>(*buffer);
-                            logger.trace("Debug {}", to_string(id));
+                            logger.trace("Debug {}", Dump{id});
                             logger.trace("Server::newSession connection from {}", id.public_key());
                             if(!agentDirectory_.exist(id.public_key())) { // not yet connected
                               secretHandshake(id.public_key(), context);
@@ -302,6 +756,7 @@ namespace fetch {
       acceptor_.async_accept([this](std::error_code ec, tcp::socket socket) {
                                if (!ec) {
                                  logger.trace("Server::do_accept starting new session");
+                                 nodeMetrics_.connections.add();
                                  newSession(std::move(socket));
                                  do_accept();
                                } else {
@@ -309,6 +764,18 @@ namespace fetch {
                                }
                              });
     }
+    Server::Server(uint32_t nbThreads, uint32_t backlog, uint16_t metricsPort, const SessionLimits &limits) :
+      acceptor_(io_context_, tcp::endpoint(tcp::v4(), static_cast<int>(Ports::Agents))), nodeMetrics_{metrics_},
+      limits_{limits} {
+      acceptor_.listen(backlog); // pending connections
+      threads_.resize(nbThreads);
+      metrics_.gauge("oef_agents", "Connected agents.", [this]() { return double(agentDirectory_.size()); });
+      metrics_.gauge("oef_services", "Registered services.", [this]() { return double(serviceDirectory_.size()); });
+      if(metricsPort) {
+        metricsEndpoint_ = std::make_unique<MetricsEndpoint>(io_context_, metrics_, metricsPort,
+                                                             [this]() { return statistics(); });
+      }
+    }
     Server::~Server() {
       logger.trace("~Server stopping");
       stop();
@@ -324,6 +791,9 @@ namespace fetch {
       logger.trace("~Server threads stopped");
     }
     void Server::run() {
+      if(metricsEndpoint_) {
+        metricsEndpoint_->start();
+      }
       for(auto &t : threads_) {
         if(!t) {
           t = std::make_unique<std::thread>([this]() {do_accept(); io_context_.run();});
@@ -331,6 +801,9 @@ namespace fetch {
       }
     }
     void Server::run_in_thread() {
+      if(metricsEndpoint_) {
+        metricsEndpoint_->start();
+      }
       do_accept();
       io_context_.run();
     }
@@ -0,0 +1,98 @@
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+
+#include "timingwheel.hpp"
+
+namespace fetch {
+  namespace oef {
+    constexpr std::chrono::milliseconds TimingWheel::tick;
+    constexpr size_t TimingWheel::slots;
+    asio::io_context::id TimingWheel::id;
+
+    TimingWheel::TimingWheel(asio::io_context &io_context)
+      : asio::io_context::service{io_context}, timer_{io_context}, wheel_(slots) {}
+
+    std::shared_ptr<TimingWheel::Deadline> TimingWheel::start(uint32_t seconds, std::function<void()> expire) {
+      // One more tick, as the current one has partly elapsed: deadlines never expire early.
+      size_t ticks = size_t(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::seconds{seconds}) / tick) + 1;
+      auto deadline = std::make_shared<Deadline>(std::move(expire), (ticks - 1) / slots);
+      std::lock_guard<std::mutex> lock(lock_);
+      wheel_[(cursor_ + ticks) % slots].emplace_back(deadline);
+      ++size_;
+      if(!ticking_) {
+        ticking_ = true;
+        next_ = std::chrono::steady_clock::now();
+        schedule();
+      }
+      return deadline;
+    }
+    void TimingWheel::schedule() {
+      next_ += tick;
+      timer_.expires_at(next_);
+      timer_.async_wait([this](std::error_code ec) {
+          if(!ec) {
+            advance();
+          }
+        });
+    }
+    void TimingWheel::advance() {
+      std::vector<std::shared_ptr<Deadline>> expired;
+      {
+        std::lock_guard<std::mutex> lock(lock_);
+        cursor_ = (cursor_ + 1) % slots;
+        auto &slot = wheel_[cursor_];
+        size_t kept = 0;
+        for(auto &d : slot) {
+          std::lock_guard<std::mutex> dlock(d->lock_);
+          if(d->state_ != Deadline::State::Pending) {
+            continue;
+          }
+          if(d->rounds_ > 0) {
+            --d->rounds_;
+            slot[kept++] = std::move(d);
+          } else {
+            expired.emplace_back(std::move(d));
+          }
+        }
+        size_ -= slot.size() - kept;
+        slot.resize(kept);
+        if(size_ > 0) {
+          schedule();
+        } else {
+          ticking_ = false;
+        }
+      }
+      for(auto &d : expired) {
+        std::lock_guard<std::mutex> lock(d->lock_);
+        if(d->state_ == Deadline::State::Pending) {
+          d->state_ = Deadline::State::Expired;
+          d->expire_();
+          d->expire_ = nullptr;
+        }
+      }
+    }
+    void TimingWheel::shutdown() {
+      std::lock_guard<std::mutex> lock(lock_);
+      for(auto &slot : wheel_) {
+        slot.clear();
+      }
+      size_ = 0;
+    }
+  }
+}
@@ -0,0 +1,73 @@
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include "trace.hpp"
+#include "statistics.hpp"
+
+#include <random>
+
+namespace fetch {
+  namespace oef {
+    fetch::oef::Logger Tracer::logger = fetch::oef::Logger("oef-trace");
+
+    Tracer::Tracer() {
+      std::random_device rd;
+      prefix_ = uint64_t(rd()) << 32;
+    }
+    Tracer &Tracer::instance() {
+      static Tracer tracer;
+      return tracer;
+    }
+    bool Tracer::configure(uint32_t period, const std::string &path) {
+      std::lock_guard<std::mutex> lock(lock_);
+      if(file_.is_open()) {
+        file_.close();
+      }
+      if(!path.empty()) {
+        file_.open(path, std::ios::app);
+        if(!file_) {
+          logger.error("Tracer::configure cannot open {}", path);
+          period_ = 0;
+          return false;
+        }
+      }
+      period_ = period;
+      return true;
+    }
+    void Tracer::write(const fetch::oef::pb::Trace &trace, const std::string &hop) {
+      std::lock_guard<std::mutex> lock(lock_);
+      if(!file_.is_open()) {
+        return;
+      }
+      file_ << "{\"id\":" << trace.id() << ",\"hop\":" << DataModelStatistics::quoted(hop);
+      if(trace.has_client_send()) {
+        file_ << ",\"client_send\":" << trace.client_send();
+      }
+      if(trace.has_node_receive()) {
+        file_ << ",\"node_receive\":" << trace.node_receive();
+      }
+      if(trace.has_node_forward()) {
+        file_ << ",\"node_forward\":" << trace.node_forward();
+      }
+      if(trace.has_client_receive()) {
+        file_ << ",\"client_receive\":" << trace.client_receive();
+      }
+      file_ << "}\n";
+    }
+  }
+}
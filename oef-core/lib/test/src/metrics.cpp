@@ -0,0 +1,68 @@
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include "catch.hpp"
+#include "metrics.hpp"
+
+namespace Test {
+  using fetch::oef::LatencyHistogram;
+
+  TEST_CASE("latency histogram", "[metrics]") {
+    for(uint64_t v : {0ull, 7ull, 8ull, 9ull, 15ull, 16ull, 1000ull, 123456789ull, ~0ull}) {
+      auto b = LatencyHistogram::bucket(v);
+      REQUIRE(b < size_t(LatencyHistogram::buckets));
+      REQUIRE(LatencyHistogram::lower(b) <= v);
+      REQUIRE(v <= LatencyHistogram::upper(b));
+    }
+    LatencyHistogram h;
+    REQUIRE(h.quantile(0.5) == 0.0);
+    for(uint64_t v = 1; v <= 1000; ++v) {
+      h.record(v);
+    }
+    REQUIRE(h.count() == 1000);
+    REQUIRE(h.sum() == 500500);
+    REQUIRE(h.quantile(0.5) == Approx(500).epsilon(1.0 / 16));
+    REQUIRE(h.quantile(0.99) == Approx(990).epsilon(1.0 / 16));
+  }
+  TEST_CASE("metrics registry", "[metrics]") {
+    fetch::oef::Metrics metrics;
+    auto &c = metrics.counter("requests_total", "Requests.", "operation=\"a\"");
+    REQUIRE(&c == &metrics.counter("requests_total", "Requests.", "operation=\"a\""));
+    std::vector<std::thread> threads;
+    for(int i = 0; i < 4; ++i) {
+      threads.emplace_back([&c]() { for(int j = 0; j < 1000; ++j) c.add(); });
+    }
+    for(auto &t : threads) {
+      t.join();
+    }
+    REQUIRE(c.value() == 4000);
+    metrics.gauge("agents", "Agents.", []() { return 3.0; });
+    metrics.gauge("bytes_total", "Bytes.", []() { return 12345678.0; });
+    metrics.histogram("duration_seconds", "Durations.", 1e-9).record(2000);
+    metrics.histogram("size_bytes", "Sizes.", 1).record(1234567);
+    REQUIRE_THROWS_AS(metrics.gauge("requests_total", "Requests."), std::invalid_argument);
+    auto text = metrics.prometheus();
+    REQUIRE(text.find("# TYPE requests_total counter\nrequests_total{operation=\"a\"} 4000\n") != std::string::npos);
+    REQUIRE(text.find("agents 3\n") != std::string::npos);
+    REQUIRE(text.find("duration_seconds{quantile=\"0.5\"} ") != std::string::npos);
+    REQUIRE(text.find("duration_seconds_count 1\n") != std::string::npos);
+    // large values keep all their digits.
+    REQUIRE(text.find("bytes_total 12345678\n") != std::string::npos);
+    REQUIRE(text.find("size_bytes_sum 1234567\n") != std::string::npos);
+  }
+}
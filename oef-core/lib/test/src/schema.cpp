@@ -20,7 +20,12 @@
 #include "catch.hpp"
 #include "schema.hpp"
 #include <iostream>
+#include <random>
 #include "servicedirectory.hpp"
+#include "agentdirectory.hpp"
+#include "datamodelregistry.hpp"
+#include "statistics.hpp"
+#include "clientmsg.hpp"
 #include <google/protobuf/text_format.h>
 #include "common.hpp"
 
@@ -52,6 +57,24 @@ namespace Test {
     REQUIRE(s3->schema() == d1);
     //    std::cerr << toJsonString<SchemaDirectory>(sd);
   }
+  TEST_CASE("schema versions", "[creation]") {
+    DataModel d1{"Person", {Attribute{"firstName", Type::String, true}}};
+    DataModel d5{"Person", {Attribute{"lastName", Type::String, true}}};
+    DataModel d3{"Person", {Attribute{"age", Type::Int, true}}};
+    SchemaDirectory sd;
+    REQUIRE(!sd.get("person"));
+    REQUIRE(sd.add("person", d1, 1) == 1);
+    REQUIRE(sd.add("person", d5, 5) == 5);
+    REQUIRE(sd.add("person", d3, 3) == 3); // out of order
+    REQUIRE(sd.get("person", 2)->version() == 3);
+    REQUIRE(sd.get("person", 4)->schema() == d5);
+    REQUIRE(sd.get("person", 6)->version() == 5);
+    REQUIRE(sd.get("person")->version() == 5);
+    REQUIRE(sd.add("person", d1) == 6);
+    REQUIRE(sd.find("person", d3.fingerprint())->version() == 3);
+    REQUIRE(!sd.find("person", DataModel{"Person", {}}.fingerprint()));
+    REQUIRE(!sd.find("nobody", d3.fingerprint()));
+  }
   TEST_CASE("servicedirectory api", "[sd]") {
     ServiceDirectory sd;
     REQUIRE(sd.size() == 0);
@@ -96,6 +119,473 @@ namespace Test {
     REQUIRE(sd.size() == 0);
     REQUIRE(!sd.unregisterAgent(instance1, "Agent2"));
   }
+  TEST_CASE("instance values", "[sd]") {
+    Attribute s_attr{"a_string", Type::String, true};
+    Attribute i_attr{"an_integer", Type::Int, true};
+    DataModel dm{"a_data_model", {s_attr, i_attr}};
+    Instance instance1{dm, {{"a_string", VariantType{std::string{"Anything"}}},
+                            {"an_integer", VariantType{42}}}};
+    // same values, wire order reversed.
+    fetch::oef::pb::Query_Instance reversed;
+    reversed.mutable_model()->CopyFrom(dm.handle());
+    for(int i = instance1.valuesHandle().values_size() - 1; i >= 0; --i) {
+      reversed.add_values()->CopyFrom(instance1.valuesHandle().values(i));
+    }
+    Instance instance2{reversed};
+    REQUIRE(instance1 == instance2);
+    REQUIRE(instance1.hash() == instance2.hash());
+    REQUIRE(instance2.value("an_integer")->get<int>() == 42);
+    REQUIRE(!instance2.value("typo"));
+    // on duplicated keys, the last value wins.
+    auto *kv = reversed.add_values();
+    kv->set_key("an_integer");
+    kv->mutable_value()->set_i(43);
+    Instance instance3{reversed};
+    REQUIRE(instance3.value("an_integer")->get<int>() == 43);
+    REQUIRE(!(instance1 == instance3));
+    REQUIRE(instance3.values().size() == 2);
+    REQUIRE(instance1.fingerprint() == instance2.fingerprint());
+    REQUIRE(instance1.fingerprint() != instance3.fingerprint());
+    DataModel dm2{"a_data_model", {Attribute{"a_double", Type::Double, true}}};
+    Instance zero{dm2, {{"a_double", VariantType{0.0}}}};
+    Instance negative_zero{dm2, {{"a_double", VariantType{-0.0}}}};
+    REQUIRE(zero == negative_zero);
+    REQUIRE(zero.hash() == negative_zero.hash());
+    REQUIRE(!(zero == Instance{dm2, {{"a_double", VariantType{1.0}}}}));
+  }
+  TEST_CASE("datamodel registry", "[sd]") {
+    DataModelRegistry registry;
+    Attribute i_attr{"an_integer", Type::Int, true, "Any integer."};
+    DataModel dm{"a_data_model", {i_attr}, "A data model with one integer."};
+    Instance instance{dm, {{"an_integer", VariantType{42}}}};
+    fetch::oef::pb::Query_Instance full;
+    instance.copyTo(full);
+    fetch::oef::pb::Query_Instance ref;
+    instance.copyTo(ref, true);
+    REQUIRE(!ref.has_model());
+    REQUIRE(ref.ByteSizeLong() < full.ByteSizeLong());
+    // a reference is only known once an instance of the model has been registered.
+    REQUIRE_THROWS_AS(registry.resolve(ref), std::invalid_argument);
+    auto i1 = registry.resolve(full);
+    REQUIRE(registry.size() == 0);
+    REQUIRE_THROWS_AS(registry.resolve(ref), std::invalid_argument);
+    registry.intern(i1.dataModel());
+    auto i2 = registry.resolve(ref);
+    auto i3 = registry.resolve(full);
+    registry.intern(i3.dataModel());
+    REQUIRE(registry.size() == 1);
+    REQUIRE(i1 == instance);
+    REQUIRE(i2 == instance);
+    REQUIRE(&i1.model() == &i2.model());
+    REQUIRE(&i1.model() == &i3.model());
+    // same name, different attributes: another model.
+    DataModel dm2{"a_data_model", {Attribute{"an_integer", Type::Int, false}}};
+    Instance other{dm2, {{"an_integer", VariantType{42}}}};
+    fetch::oef::pb::Query_Instance other_pb;
+    other.copyTo(other_pb);
+    auto i4 = registry.resolve(other_pb);
+    REQUIRE(!(i4 == instance));
+    registry.intern(i4.dataModel());
+    REQUIRE(registry.size() == 2);
+    // models no instance uses any more are swept as the table grows.
+    for(int i = 0; i < 4 * int(DataModelRegistry::minSweep); ++i) {
+      registry.intern(DataModel{"model" + std::to_string(i), {i_attr}});
+    }
+    REQUIRE(registry.size() < size_t(DataModelRegistry::minSweep));
+    REQUIRE(registry.find(ref.model_ref()));
+    REQUIRE(registry.find(other_pb.model()));
+    REQUIRE(&registry.resolve(ref).model() == &i1.model());
+  }
+  TEST_CASE("servicedirectory data models", "[sd]") {
+    ServiceDirectory sd;
+    Attribute wireless{"wireless", Type::Bool, true};
+    DataModel station{"weather_station", {wireless}};
+    DataModel sensor{"sensor", {wireless}};
+    REQUIRE(sd.registerAgent(Instance{station, {{"wireless", VariantType{true}}}}, "Agent1"));
+    REQUIRE(sd.registerAgent(Instance{sensor, {{"wireless", VariantType{true}}}}, "Agent2"));
+    REQUIRE(sd.registerAgent(Instance{sensor, {{"wireless", VariantType{false}}}}, "Agent3"));
+    REQUIRE(sd.size() == 3);
+    Constraint wireless_c{wireless.name(), Relation{Relation::Op::Eq, true}};
+    REQUIRE(sd.query(QueryModel{{wireless_c}, station}) == std::vector<std::string>({"Agent1"}));
+    REQUIRE(sd.query(QueryModel{{wireless_c}, sensor}) == std::vector<std::string>({"Agent2"}));
+    auto agents = sd.query(QueryModel{{wireless_c}});
+    std::sort(agents.begin(), agents.end());
+    REQUIRE(agents == std::vector<std::string>({"Agent1", "Agent2"}));
+    sd.unregisterAll("Agent2");
+    REQUIRE(sd.size() == 2);
+    REQUIRE(sd.query(QueryModel{{wireless_c}, sensor}).empty());
+
+    AgentDirectory ad;
+    REQUIRE(!ad.registerDescription("Agent1", Instance{station, {{"wireless", VariantType{true}}}}));
+    REQUIRE(ad.add("Agent1", nullptr));
+    REQUIRE(ad.registerDescription("Agent1", Instance{station, {{"wireless", VariantType{true}}}}));
+    REQUIRE(ad.search(QueryModel{{wireless_c}, station}) == std::vector<std::string>({"Agent1"}));
+    REQUIRE(ad.registerDescription("Agent1", Instance{station, {{"wireless", VariantType{false}}}}));
+    REQUIRE(ad.search(QueryModel{{wireless_c}, station}).empty());
+    REQUIRE(ad.registerDescription("Agent1", Instance{station, {{"wireless", VariantType{true}}}}));
+    REQUIRE(ad.remove("Agent1"));
+    REQUIRE(ad.search(QueryModel{{wireless_c}, station}).empty());
+  }
+  TEST_CASE("servicedirectory bulk registration", "[sd]") {
+    ServiceDirectory sd;
+    Attribute wireless{"wireless", Type::Bool, true};
+    DataModel station{"weather_station", {wireless}};
+    DataModel sensor{"sensor", {wireless}};
+    Instance on{station, {{"wireless", VariantType{true}}}};
+    Instance off{station, {{"wireless", VariantType{false}}}};
+    Instance sensorOn{sensor, {{"wireless", VariantType{true}}}};
+    REQUIRE(sd.registerAgent(on, "Agent2"));
+    auto status = sd.registerAgent(std::vector<Instance>{on, off, sensorOn, on}, "Agent1");
+    REQUIRE(status == std::vector<bool>({true, true, true, false}));
+    REQUIRE(sd.size() == 3);
+    Constraint wireless_c{wireless.name(), Relation{Relation::Op::Eq, true}};
+    auto agents = sd.query(QueryModel{{wireless_c}, station});
+    std::sort(agents.begin(), agents.end());
+    REQUIRE(agents == std::vector<std::string>({"Agent1", "Agent2"}));
+    status = sd.unregisterAgent(std::vector<Instance>{sensorOn, on, sensorOn}, "Agent1");
+    REQUIRE(status == std::vector<bool>({true, true, false}));
+    REQUIRE(sd.size() == 2);
+    REQUIRE(sd.query(QueryModel{{wireless_c}, station}) == std::vector<std::string>({"Agent2"}));
+    REQUIRE(sd.query(QueryModel{{wireless_c}, sensor}).empty());
+
+    std::vector<bool> bits(19);
+    for(size_t i = 0; i < bits.size(); i += 3) {
+      bits[i] = true;
+    }
+    fetch::oef::pb::Server_AgentMessage_RegistrationStatus msg;
+    RegistrationStatus::encode(fetch::oef::pb::Server_AgentMessage_OEFError::REGISTER_SERVICE, bits, msg);
+    REQUIRE(msg.status().size() == 3);
+    REQUIRE(RegistrationStatus::decode(msg) == bits);
+    REQUIRE(!msg.has_unknown_models());
+    REQUIRE(RegistrationStatus::unknownModels(msg) == std::vector<bool>(19));
+    std::vector<bool> unknown(19);
+    unknown[1] = unknown[17] = true;
+    RegistrationStatus::encode(fetch::oef::pb::Server_AgentMessage_OEFError::REGISTER_SERVICE, bits, msg, unknown);
+    REQUIRE(RegistrationStatus::decode(msg) == bits);
+    REQUIRE(RegistrationStatus::unknownModels(msg) == unknown);
+  }
+
+  TEST_CASE("servicedirectory updates", "[sd]") {
+    ServiceDirectory sd;
+    Attribute name{"name", Type::String, true};
+    Attribute price{"price", Type::Int, false};
+    DataModel book{"book", {name, price}};
+    Instance dune{book, {{"name", VariantType{std::string{"Dune"}}}, {"price", VariantType{10}}}};
+    Instance emma{book, {{"name", VariantType{std::string{"Emma"}}}, {"price", VariantType{5}}}};
+    REQUIRE(sd.registerAgent(dune, "Agent1"));
+    REQUIRE(sd.registerAgent(emma, "Agent2"));
+    Constraint cheap{price.name(), Relation{Relation::Op::Lt, 8}};
+    Constraint isDune{name.name(), Relation{Relation::Op::Eq, std::string{"Dune"}}};
+    auto update = [&sd](const Instance &instance, const std::string &agent,
+                        const std::unordered_map<std::string,VariantType> &values, const std::vector<std::string> &removed) {
+      // as the node gets it: the service's fingerprint and the changes only.
+      UpdateService msg{1, instance, values, removed};
+      const auto &u = msg.handle().update_service();
+      REQUIRE(u.values_size() == int(values.size()));
+      return sd.update(u.model().name(), Fingerprint{u.model().hi(), u.model().lo()},
+                       Fingerprint{u.service_hi(), u.service_lo()}, agent, u.values(), u.removed());
+    };
+    // only Agent1 registered dune.
+    REQUIRE(!update(dune, "Agent2", {{"price", VariantType{3}}}, {}));
+    auto cheapDune = update(dune, "Agent1", {{"price", VariantType{3}}}, {});
+    REQUIRE(cheapDune);
+    REQUIRE(cheapDune->value("price")->get<int>() == 3);
+    REQUIRE(sd.size() == 2);
+    auto agents = sd.query(QueryModel{{cheap}, book});
+    std::sort(agents.begin(), agents.end());
+    REQUIRE(agents == std::vector<std::string>({"Agent1", "Agent2"}));
+    REQUIRE(sd.query(QueryModel{{isDune}, book}) == std::vector<std::string>({"Agent1"}));
+    // the registered instance is now the updated one.
+    REQUIRE(!sd.unregisterAgent(dune, "Agent1"));
+    // removing an optional attribute; required ones, unknown ones and wrong types are refused.
+    auto freeDune = update(*cheapDune, "Agent1", {}, {"price"});
+    REQUIRE(freeDune);
+    REQUIRE(!freeDune->value("price"));
+    REQUIRE(sd.query(QueryModel{{cheap}, book}) == std::vector<std::string>({"Agent2"}));
+    REQUIRE_THROWS_WITH(update(*freeDune, "Agent1", {}, {"name"}), "Cannot remove a required attribute.");
+    REQUIRE_THROWS_WITH(update(*freeDune, "Agent1", {{"typo", VariantType{1}}}, {}), "Attribute does not exist in data model.");
+    REQUIRE_THROWS_WITH(update(*freeDune, "Agent1", {{"price", VariantType{1.5}}}, {}), "Attribute is not a double in data model.");
+    REQUIRE(sd.query(QueryModel{{isDune}, book}) == std::vector<std::string>({"Agent1"}));
+    // a shared instance is only updated for the agent that asks.
+    REQUIRE(sd.registerAgent(emma, "Agent3"));
+    auto dearEmma = update(emma, "Agent3", {{"price", VariantType{20}}}, {});
+    REQUIRE(dearEmma);
+    REQUIRE(sd.size() == 3);
+    REQUIRE(sd.query(QueryModel{{cheap}, book}) == std::vector<std::string>({"Agent2"}));
+    // updating into an instance already registered merges the two.
+    REQUIRE(update(*dearEmma, "Agent3", {{"price", VariantType{5}}}, {}));
+    REQUIRE(sd.size() == 2);
+    agents = sd.query(QueryModel{{cheap}, book});
+    std::sort(agents.begin(), agents.end());
+    REQUIRE(agents == std::vector<std::string>({"Agent2", "Agent3"}));
+    sd.unregisterAll("Agent2");
+    sd.unregisterAll("Agent3");
+    REQUIRE(sd.query(QueryModel{{cheap}, book}).empty());
+
+    AgentDirectory ad;
+    REQUIRE(ad.add("Agent1", nullptr));
+    REQUIRE(ad.registerDescription("Agent1", dune));
+    fetch::oef::pb::AgentUpdate msg;
+    UpdateDescription::fill(msg, {{"price", VariantType{3}}}, {});
+    REQUIRE(ad.updateDescription("Agent1", msg.values(), msg.removed()));
+    REQUIRE(ad.search(QueryModel{{cheap}, book}) == std::vector<std::string>({"Agent1"}));
+    REQUIRE(ad.updateDescription("Agent1", msg.values(), msg.removed()));
+    REQUIRE(!ad.updateDescription("Agent2", msg.values(), msg.removed()));
+  }
+
+  TEST_CASE("large sets", "[query]") {
+    DataModel station{"station", {Attribute{"id", Type::String, true},
+                                  Attribute{"rank", Type::Int, true},
+                                  Attribute{"wireless", Type::Bool, true}}};
+    ServiceDirectory sd;
+    std::unordered_set<std::string> ids;
+    std::unordered_set<int> ranks;
+    for(int i = 0; i < 100; ++i) {
+      Instance instance{station, {{"id", VariantType{"station" + std::to_string(i)}},
+                                  {"rank", VariantType{i}},
+                                  {"wireless", VariantType{i % 2 == 0}}}};
+      REQUIRE(sd.registerAgent(instance, "Agent" + std::to_string(i)));
+      if(i < 40) {
+        ids.insert("station" + std::to_string(i));
+        ranks.insert(i);
+      }
+    }
+    ids.insert("unknown");
+    Constraint in_ids{"id", Set{Set::Op::In, ids}};
+    Constraint in_ranks{"rank", Set{Set::Op::In, ranks}};
+    Constraint not_in_ranks{"rank", Set{Set::Op::NotIn, ranks}};
+    Constraint wireless{"wireless", Relation{Relation::Op::Eq, true}};
+    QueryModel q1{{in_ids, wireless}, station};
+    REQUIRE(q1.sets().size() == 1);
+    QueryModel q1_copy = q1;
+    REQUIRE(q1_copy.sets().size() == 1);
+    REQUIRE(q1_copy.sets().count(&q1_copy.handle().constraints(0).constraint().set_()) == 1);
+    REQUIRE(sd.query(q1).size() == 20);
+    REQUIRE(sd.query(q1_copy).size() == 20);
+    REQUIRE(sd.query(QueryModel{{in_ids, in_ranks}, station}).size() == 40);
+    REQUIRE(sd.query(QueryModel{{not_in_ranks}, station}).size() == 60);
+    REQUIRE(sd.query(QueryModel{{ConstraintExpr{in_ranks} || ConstraintExpr{wireless}}, station}).size() == 70);
+    REQUIRE(sd.query(QueryModel{{Constraint{"id", Relation{Relation::Op::Eq, std::string{"station42"}}}}, station})
+            == std::vector<std::string>({"Agent42"}));
+    REQUIRE(sd.query(QueryModel{{Constraint{"id", Relation{Relation::Op::Eq, std::string{"unknown"}}}}, station}).empty());
+    sd.unregisterAll("Agent42");
+    REQUIRE(sd.query(QueryModel{{Constraint{"id", Relation{Relation::Op::Eq, std::string{"station42"}}}}, station}).empty());
+  }
+  TEST_CASE("columnar evaluation", "[query]") {
+    DataModel sensor{"sensor", {Attribute{"id", Type::String, true},
+                                Attribute{"level", Type::Int, false},
+                                Attribute{"temperature", Type::Double, false},
+                                Attribute{"position", Type::Location, false},
+                                Attribute{"active", Type::Bool, false}}};
+    std::mt19937 gen{42};
+    std::uniform_int_distribution<int> level{-50, 50};
+    std::uniform_real_distribution<double> temperature{-20.0, 40.0}, lon{-10.0, 10.0}, lat{40.0, 60.0};
+    ServiceDirectory sd;
+    std::vector<Instance> instances;
+    // not a multiple of 64, so that the kernels go through their tails.
+    for(int i = 0; i < 333; ++i) {
+      std::unordered_map<std::string,VariantType> values{{"id", VariantType{"sensor" + std::to_string(i)}}};
+      if(i % 7 != 0) {
+        values["level"] = VariantType{level(gen)};
+      }
+      if(i % 5 != 0) {
+        values["temperature"] = VariantType{i % 11 == 0 ? 25.0 : temperature(gen)};
+      }
+      if(i % 3 != 0) {
+        values["position"] = VariantType{Location{lon(gen), lat(gen)}};
+      }
+      values["active"] = VariantType{i % 2 == 0};
+      instances.emplace_back(sensor, values);
+      REQUIRE(sd.registerAgent(instances.back(), "Agent" + std::to_string(i)));
+    }
+    // removed rows are replaced by the last ones.
+    for(int i = 0; i < 333; i += 10) {
+      REQUIRE(sd.unregisterAgent(instances[i], "Agent" + std::to_string(i)));
+    }
+    auto expected = [&instances](const QueryModel &q) {
+      std::vector<std::string> res;
+      for(size_t i = 0; i < instances.size(); ++i) {
+        if(i % 10 != 0 && q.check(instances[i])) {
+          res.emplace_back("Agent" + std::to_string(i));
+        }
+      }
+      std::sort(res.begin(), res.end());
+      return res;
+    };
+    Location center{2.35, 48.85};
+    std::vector<ConstraintExpr> constraints{
+      Constraint{"level", Relation{Relation::Op::Lt, 10}},
+      Constraint{"level", Relation{Relation::Op::GtEq, -3}},
+      Constraint{"level", Relation{Relation::Op::NotEq, 0}},
+      Constraint{"temperature", Relation{Relation::Op::Eq, 25.0}},
+      Constraint{"temperature", Relation{Relation::Op::Gt, 12.5}},
+      Constraint{"temperature", Relation{Relation::Op::LtEq, 0.0}},
+      Constraint{"level", Range{std::make_pair(-5, 20)}},
+      Constraint{"temperature", Range{std::make_pair(10.0, 30.0)}},
+      Constraint{"position", Distance{center, 500.0}},
+      Constraint{"position", Distance{center, 0.0}},
+      Constraint{"active", Relation{Relation::Op::Eq, true}},
+      Constraint{"id", Range{std::make_pair(std::string{"sensor1"}, std::string{"sensor3"})}},
+      Constraint{"missing", Relation{Relation::Op::Lt, 10}}};
+    std::vector<QueryModel> queries;
+    for(auto &c : constraints) {
+      queries.emplace_back(QueryModel{{c}});
+      queries.emplace_back(QueryModel{{!c}});
+    }
+    for(size_t i = 0; i + 1 < constraints.size(); ++i) {
+      queries.emplace_back(QueryModel{{constraints[i], constraints[i + 1]}});
+      queries.emplace_back(QueryModel{{constraints[i] || !constraints[i + 1]}});
+    }
+    queries.emplace_back(QueryModel{{!(constraints[0] && (constraints[4] || !constraints[8])), constraints[6]}});
+    queries.emplace_back(QueryModel{{constraints[6] || Constraint{"level", Range{std::make_pair(15, 40)}},
+                                     constraints[7] || constraints[7]}});
+    for(auto &q : queries) {
+      auto res = sd.query(q);
+      std::sort(res.begin(), res.end());
+      REQUIRE(res == expected(q));
+      QueryModel optimised = q;
+      optimised.optimise(&sensor);
+      res = sd.query(optimised);
+      std::sort(res.begin(), res.end());
+      REQUIRE(res == expected(q));
+    }
+    REQUIRE(sd.query(QueryModel{{constraints[8]}, sensor}).size() > 0);
+  }
+  TEST_CASE("query optimisation", "[query]") {
+    DataModel sensor{"sensor", {Attribute{"level", Type::Int, false},
+                                Attribute{"position", Type::Location, false}}};
+    ConstraintExpr low{Constraint{"level", Range{std::make_pair(10, 50)}}};
+    ConstraintExpr high{Constraint{"level", Range{std::make_pair(20, 80)}}};
+    ConstraintExpr higher{Constraint{"level", Range{std::make_pair(60, 90)}}};
+    ConstraintExpr zero{Constraint{"level", Relation{Relation::Op::Eq, 0}}};
+    ConstraintExpr near{Constraint{"position", Distance{Location{2.35, 48.85}, 10.0}}};
+    auto optimised = [&sensor](const std::vector<ConstraintExpr> &constraints) {
+      QueryModel q{constraints, sensor};
+      q.optimise(&sensor);
+      return q.handle();
+    };
+    // flattened, deduplicated and ranges intersected
+    auto q1 = optimised({low && (high && zero), zero});
+    REQUIRE(q1.constraints_size() == 2);
+    REQUIRE(q1.constraints(0).constraint().relation().val().i() == 0);
+    REQUIRE(q1.constraints(1).constraint().range_().i().first() == 20);
+    REQUIRE(q1.constraints(1).constraint().range_().i().second() == 50);
+    // De Morgan
+    auto q2 = optimised({!(zero && !near)});
+    REQUIRE(q2.constraints_size() == 1);
+    REQUIRE(q2.constraints(0).or_().expr_size() == 2);
+    REQUIRE(q2.constraints(0).or_().expr(0).not_().expr().has_constraint());
+    REQUIRE(q2.constraints(0).or_().expr(1).constraint().has_distance());
+    // contradictions and tautologies
+    auto q3 = optimised({low, higher});
+    REQUIRE(q3.constraints_size() == 1);
+    REQUIRE(q3.constraints(0).or_().expr_size() == 0);
+    auto q4 = optimised({zero && !zero});
+    REQUIRE(q4.constraints(0).or_().expr_size() == 0);
+    auto q5 = optimised({near, zero || !zero});
+    REQUIRE(q5.constraints_size() == 1);
+    REQUIRE(q5.constraints(0).constraint().has_distance());
+    // ranges merged, and cheap selective constraints first
+    auto q6 = optimised({near, low || high});
+    REQUIRE(q6.constraints_size() == 2);
+    REQUIRE(q6.constraints(0).constraint().range_().i().first() == 10);
+    REQUIRE(q6.constraints(0).constraint().range_().i().second() == 80);
+    REQUIRE(q6.constraints(1).constraint().has_distance());
+  }
+  TEST_CASE("distance lookups", "[query]") {
+    std::mt19937 gen{7};
+    std::uniform_real_distribution<double> lon{-180.0, 180.0}, lat{-90.0, 90.0};
+    std::vector<Location> centers{{2.35, 48.85}, {179.9, 0.0}, {-179.9, 60.0}, {0.0, 89.9}, {10.0, -89.99}, {0.0, 0.0}};
+    std::vector<double> distances{0.0, 1.0, 100.0, 2500.0, 15000.0, 30000.0, -1.0};
+    std::vector<Location> points;
+    for(int i = 0; i < 2000; ++i) {
+      points.push_back(Location{lon(gen), lat(gen)});
+    }
+    for(auto &c : centers) {
+      // close to the center, and across the antimeridian
+      points.push_back(c);
+      points.push_back(Location{c.lon + 0.001, c.lat});
+      points.push_back(Location{c.lon > 0 ? c.lon - 359.99 : c.lon + 359.99, c.lat});
+    }
+    size_t mismatches = 0;
+    for(auto &c : centers) {
+      for(auto d : distances) {
+        Distance distance{c, d};
+        Distance::Lookup lookup{distance.handle()};
+        for(auto &p : points) {
+          mismatches += lookup.check(GeoPoint{p.lon, p.lat}) != (c.distance(p) <= d);
+        }
+      }
+    }
+    REQUIRE(mismatches == 0);
+    DataModel station{"station", {Attribute{"position", Type::Location, true}}};
+    Instance paris{station, {{"position", VariantType{Location{2.35, 48.85}}}}};
+    Instance london{station, {{"position", VariantType{Location{-0.13, 51.51}}}}};
+    REQUIRE(paris.point("position") != nullptr);
+    REQUIRE(paris.point("unknown") == nullptr);
+    QueryModel q{{Constraint{"position", Distance{Location{2.29, 48.86}, 10.0}}}, station};
+    REQUIRE(q.lookups().distances.size() == 1);
+    REQUIRE(q.check(paris));
+    REQUIRE(!q.check(london));
+  }
+  TEST_CASE("statistics", "[sd]") {
+    DataModel paint{"paint", {Attribute{"id", Type::String, true},
+                              Attribute{"level", Type::Int, true},
+                              Attribute{"colour", Type::String, true},
+                              Attribute{"gloss", Type::Double, false}}};
+    std::vector<std::string> colours{"red", "green", "blue", "white", "black"};
+    ServiceDirectory sd;
+    std::vector<Instance> instances;
+    for(int i = 0; i < 1000; ++i) {
+      std::unordered_map<std::string,VariantType> values{{"id", VariantType{"paint" + std::to_string(i)}},
+                                                         {"level", VariantType{i % 100}},
+                                                         {"colour", VariantType{colours[i % 5]}}};
+      if(i % 2 == 0) {
+        values["gloss"] = VariantType{i / 1000.0};
+      }
+      instances.emplace_back(paint, values);
+      REQUIRE(sd.registerAgent(instances.back(), "Agent" + std::to_string(i)));
+    }
+    DataModelStatistics stats;
+    stats.rebuild(instances.begin(), instances.end(), [](const Instance &i) -> const Instance& { return i; });
+    REQUIRE(stats.rows() == 1000);
+    REQUIRE(stats.nullFraction("gloss") == Approx(0.5));
+    REQUIRE(stats.nullFraction("level") == Approx(0.0));
+    REQUIRE(stats.nullFraction("unknown") == Approx(1.0));
+    REQUIRE(stats.distinct("colour") == Approx(5).epsilon(0.01));
+    REQUIRE(stats.distinct("id") == Approx(1000).epsilon(0.1));
+    auto selectivity = [&stats](const Constraint &c) { return stats.selectivity(c.handle()); };
+    REQUIRE(selectivity(Constraint{"level", Relation{Relation::Op::Lt, 50}}) == Approx(0.5).epsilon(0.1));
+    REQUIRE(selectivity(Constraint{"level", Range{std::make_pair(90, 99)}}) == Approx(0.1).epsilon(0.3));
+    REQUIRE(selectivity(Constraint{"gloss", Range{std::make_pair(0.0, 0.25)}}) == Approx(0.125).epsilon(0.2));
+    REQUIRE(selectivity(Constraint{"colour", Relation{Relation::Op::Eq, std::string{"red"}}}) == Approx(0.2).epsilon(0.01));
+    REQUIRE(selectivity(Constraint{"unknown", Relation{Relation::Op::Eq, 1}}) == 0.0);
+    // kept up to date on unregister
+    for(int i = 0; i < 1000; i += 2) {
+      REQUIRE(sd.unregisterAgent(instances[i], "Agent" + std::to_string(i)));
+      stats.remove(instances[i]);
+    }
+    REQUIRE(stats.rows() == 500);
+    REQUIRE(stats.nullFraction("gloss") == Approx(1.0));
+    REQUIRE(sd.statistics().find("\"paint\":{\"rows\":500,") != std::string::npos);
+    // cheap but unselective constraints go last
+    ConstraintExpr many{Constraint{"level", Relation{Relation::Op::Gt, 5}}};
+    ConstraintExpr red{Constraint{"colour", Relation{Relation::Op::Eq, std::string{"red"}}}};
+    QueryModel q{{many, red}, paint};
+    QueryModel defaults = q;
+    defaults.optimise(&paint);
+    REQUIRE(defaults.handle().constraints(0).constraint().attribute_name() == "level");
+    sd.optimise(q, &paint);
+    REQUIRE(q.handle().constraints(0).constraint().attribute_name() == "colour");
+    // valid JSON whatever the names and values
+    REQUIRE(DataModelStatistics::quoted("a\"b\\c\n\t\x01") == "\"a\\\"b\\\\c\\n\\t\\u0001\"");
+    DataModel odd{"odd", {Attribute{"x\ny", Type::Double, true}}};
+    std::vector<Instance> odds{Instance{odd, {{"x\ny", VariantType{-std::numeric_limits<double>::infinity()}}}},
+                               Instance{odd, {{"x\ny", VariantType{1.5}}}}};
+    DataModelStatistics oddStats;
+    oddStats.rebuild(odds.begin(), odds.end(), [](const Instance &i) -> const Instance& { return i; });
+    REQUIRE(oddStats.json() == "{\"rows\":2,\"attributes\":{\"x\\ny\":{\"null_fraction\":0,\"distinct\":2,\"histogram\":[null,null,1.5]}}}");
+  }
   TEST_CASE("person", "[query]") {
     DataModel datamodel1{"Person", {Attribute{"firstName", Type::String, true, "The first name."},
                                     Attribute{"lastName", Type::String, true},
@@ -109,6 +599,9 @@ namespace Test {
                                   {"weight", VariantType{50.0}},
                                   {"married", VariantType{false}},
                                   {"birth_place", VariantType{Location{0.1225, 52.20806}}}}};
+    REQUIRE(datamodel1.attribute("age")->type() == fetch::oef::pb::Query_Attribute_Type_INT);
+    REQUIRE(datamodel1.attribute("birth_place")->name() == "birth_place");
+    REQUIRE(datamodel1.attribute("middleName") == nullptr);
     // Range
     Range range_a_c{std::make_pair("A", "C")};
     QueryModel qm1{{Constraint{"firstName", range_a_c}}};
@@ -294,7 +787,9 @@ namespace Test {
                                 {"wireless", VariantType{true}}}};
     Instance opes{station, {{"manufacturer", VariantType{std::string{"Opes"}}},
                             {"model", VariantType{std::string{"17500"}}}, {"wireless", VariantType{true}}}};
-    REQUIRE(google::protobuf::TextFormat::PrintToString(youshiko.handle(), &output));
+    fetch::oef::pb::Query_Instance youshiko_pb;
+    youshiko.copyTo(youshiko_pb);
+    REQUIRE(google::protobuf::TextFormat::PrintToString(youshiko_pb, &output));
     std::cout << output;
     // Instance youshiko2 = fromJsonString<Instance>(toJsonString<Instance>(youshiko));
     // std::cout << toJsonString<Instance>(youshiko2) << "\n";
@@ -0,0 +1,62 @@
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+
+#include "catch.hpp"
+#include "timingwheel.hpp"
+
+#include <atomic>
+#include <thread>
+
+namespace Test {
+  using fetch::oef::TimingWheel;
+
+  TEST_CASE("timing wheel", "[timeout]") {
+    asio::io_context io_context;
+    auto work = asio::make_work_guard(io_context);
+    std::thread thread{[&io_context]() { io_context.run(); }};
+    auto &wheel = asio::use_service<TimingWheel>(io_context);
+    std::atomic<int> expired{0};
+    auto start = std::chrono::steady_clock::now();
+    std::atomic<int64_t> elapsed{0};
+    auto late = wheel.start(1, [&]() {
+        elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        ++expired;
+      });
+    auto done = wheel.start(1, [&expired]() { ++expired; });
+    auto never = wheel.start(0, [&expired]() { ++expired; });
+    REQUIRE(wheel.size() == 3);
+    REQUIRE(done->complete());
+    REQUIRE(never->complete());
+    std::this_thread::sleep_for(std::chrono::milliseconds{1500});
+    REQUIRE(expired == 1);
+    REQUIRE(elapsed >= 1000);
+    REQUIRE(!late->complete());
+    REQUIRE(wheel.size() == 0);
+    // longer than a turn of the wheel
+    auto turn = std::chrono::duration_cast<std::chrono::seconds>(TimingWheel::tick * TimingWheel::slots).count();
+    auto longer = wheel.start(uint32_t(turn + 1), [&expired]() { ++expired; });
+    std::this_thread::sleep_for(std::chrono::milliseconds{1500});
+    REQUIRE(expired == 1);
+    REQUIRE(wheel.size() == 1);
+    REQUIRE(longer->complete());
+    work.reset();
+    io_context.stop();
+    thread.join();
+  }
+}